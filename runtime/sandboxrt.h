@@ -40,6 +40,15 @@ extern void *mmap(void *addr,
                   int fd,
                   /*off_t*/ int offset);
 
+// with sandbox --jobs, each job starts here with its own data attached
+extern struct moxie_memory_map_ent *moxie_snapshot(void);
+
+// memcpy, memset, memcmp and memmove run by the sandbox host
+extern void *moxie_bulk_copy(void *dest, const void *src, size_t n);
+extern void *moxie_bulk_fill(void *s, int c, size_t n);
+extern int moxie_bulk_compare(const void *s1, const void *s2, size_t n);
+extern void *moxie_bulk_move(void *dest, const void *src, size_t n);
+
 // ISO C assert.h
 #ifndef assert
 #ifdef NDEBUG
@@ -41,6 +41,11 @@ void sha256_done(sha256_context *ctx, uint8_t *hash);
 
 void sha256(const void *data, size_t len, uint8_t *hash);
 
+/* The same, computed by the sandbox host with the same effect on ctx */
+void moxie_sha256_init(sha256_context *ctx);
+void moxie_sha256_hash(sha256_context *ctx, const void *data, size_t len);
+void moxie_sha256_done(sha256_context *ctx, uint8_t *hash);
+
 #ifdef __cplusplus
 }
 #endif
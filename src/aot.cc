@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <dlfcn.h>
+#include "sandbox.h"
+
+using namespace std;
+
+static int aotRead8(void *mach, uint32_t addr, uint32_t *val)
+{
+    return ((machine *) mach)->read8(addr, *val);
+}
+
+static int aotRead16(void *mach, uint32_t addr, uint32_t *val)
+{
+    return ((machine *) mach)->read16(addr, *val);
+}
+
+static int aotRead32(void *mach, uint32_t addr, uint32_t *val)
+{
+    return ((machine *) mach)->read32(addr, *val);
+}
+
+static int aotWrite8(void *mach, uint32_t addr, uint32_t val)
+{
+    return ((machine *) mach)->write8(addr, val);
+}
+
+static int aotWrite16(void *mach, uint32_t addr, uint32_t val)
+{
+    return ((machine *) mach)->write16(addr, val);
+}
+
+static int aotWrite32(void *mach, uint32_t addr, uint32_t val)
+{
+    return ((machine *) mach)->write32(addr, val);
+}
+
+aotModule::~aotModule()
+{
+    if (handle)
+        dlclose(handle);
+}
+
+/* Load the translation of the program whose ELF file hashes to hash.
+   path names the shared object, or a directory holding <hash>.so.  */
+bool aotModule::load(machine &mach, const string &path, const string &hash)
+{
+    string filename = path;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        filename = path + "/" + hash + ".so";
+
+    void *h = dlopen(filename.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!h) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+
+    const unsigned *abi = (const unsigned *) dlsym(h, "moxie_aot_abi");
+    const unsigned *regsetSize =
+        (const unsigned *) dlsym(h, "moxie_aot_regset_size");
+    const char *aotHash = (const char *) dlsym(h, "moxie_aot_hash");
+    const unsigned *count = (const unsigned *) dlsym(h, "moxie_aot_count");
+    const struct aotEntry *table =
+        (const struct aotEntry *) dlsym(h, "moxie_aot_blocks");
+
+    if (!abi || !regsetSize || !aotHash || !count || !table ||
+        *abi != AOT_ABI_VERSION ||
+        *regsetSize != sizeof(struct moxie_regset)) {
+        fprintf(stderr, "%s: not a compatible moxie-aot object\n",
+                filename.c_str());
+        dlclose(h);
+        return false;
+    }
+    if (hash != aotHash) {
+        fprintf(stderr, "%s: translated from another program\n",
+                filename.c_str());
+        dlclose(h);
+        return false;
+    }
+
+    handle = h;
+    ctx.regs = &mach.cpu.asregs;
+    ctx.mach = &mach;
+    ctx.modified = &mach.bbcache.modified;
+    ctx.read8 = aotRead8;
+    ctx.read16 = aotRead16;
+    ctx.read32 = aotRead32;
+    ctx.write8 = aotWrite8;
+    ctx.write16 = aotWrite16;
+    ctx.write32 = aotWrite32;
+
+    for (unsigned i = 0; i < *count; i++)
+        blocks[table[i].addr] = &table[i];
+
+    return true;
+}
+
+/* The translation of the block decoded at [start, end), if its code
+   lies in read-only memory, which still holds what was translated.  */
+const struct aotEntry *aotModule::lookup(machine &mach,
+                                         uint32_t start,
+                                         uint32_t end)
+{
+    if (blocks.empty())
+        return NULL;
+
+    unordered_map<uint32_t, const struct aotEntry *>::iterator it =
+        blocks.find(start);
+    if (it == blocks.end() || it->second->end != end)
+        return NULL;
+
+    addressRange *ar = mach.findRange(start, end - start);
+    if (!ar || !ar->readOnly)
+        return NULL;
+
+    return it->second;
+}
@@ -0,0 +1,85 @@
+#include <string.h>
+#include "sandbox.h"
+
+using namespace std;
+
+blockCache::~blockCache()
+{
+    for (unordered_map<uint32_t, moxieBlock *>::iterator it = blocks.begin();
+         it != blocks.end(); ++it)
+        delete it->second;
+
+    reclaim();
+}
+
+moxieBlock *blockCache::lookupSlow(uint32_t pc)
+{
+    unordered_map<uint32_t, moxieBlock *>::iterator it = blocks.find(pc);
+    if (it == blocks.end())
+        return NULL;
+
+    moxieBlock *blk = it->second;
+    hash[(pc >> 1) & (BB_HASH_SIZE - 1)] = blk;
+    return blk;
+}
+
+void blockCache::insert(moxieBlock *blk)
+{
+    blocks[blk->start] = blk;
+    hash[(blk->start >> 1) & (BB_HASH_SIZE - 1)] = blk;
+
+    // index by every guest page the block was decoded from
+    uint32_t firstPage = blk->start >> MACH_PAGE_SHIFT;
+    uint32_t lastPage = (blk->end - 1) >> MACH_PAGE_SHIFT;
+    for (uint32_t page = firstPage; page <= lastPage; page++)
+        pageBlocks[page].push_back(blk->start);
+}
+
+// Blocks are not freed on invalidation, since sim_resume may still be
+// executing one of them; they are released at the next block boundary.
+void blockCache::retire(moxieBlock *blk)
+{
+    blocks.erase(blk->start);
+
+    unsigned int idx = (blk->start >> 1) & (BB_HASH_SIZE - 1);
+    if (hash[idx] == blk)
+        hash[idx] = NULL;
+
+    retired.push_back(blk);
+    modified = true;
+    epoch++;
+}
+
+void blockCache::invalidate(uint32_t addr, uint32_t len)
+{
+    if (!len || pageBlocks.empty())
+        return;
+
+    uint32_t firstPage = addr >> MACH_PAGE_SHIFT;
+    uint32_t lastPage = (addr + len - 1) >> MACH_PAGE_SHIFT;
+    for (uint32_t page = firstPage; page <= lastPage; page++) {
+        unordered_map<uint32_t, vector<uint32_t> >::iterator pit =
+            pageBlocks.find(page);
+        if (pit == pageBlocks.end())
+            continue;
+
+        vector<uint32_t> &starts = pit->second;
+        for (unsigned int i = 0; i < starts.size(); i++) {
+            unordered_map<uint32_t, moxieBlock *>::iterator it =
+                blocks.find(starts[i]);
+            if (it != blocks.end())
+                retire(it->second);
+        }
+
+        pageBlocks.erase(pit);
+    }
+}
+
+void blockCache::reclaim()
+{
+    for (unsigned int i = 0; i < retired.size(); i++)
+        delete retired[i];
+
+    retired.clear();
+    modified = false;
+}
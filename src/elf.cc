@@ -18,25 +18,35 @@
 
 using namespace std;
 
-bool loadElfProgSection(machine &mach, Elf *e, GElf_Phdr *phdr, void *p)
+bool loadElfProgSection(machine &mach, Elf *e, GElf_Phdr *phdr, mfile &pf)
 {
     bool writable = (phdr->p_flags & PF_W);
     size_t sz = phdr->p_memsz;
-    static unsigned int elfCount = 0;
     char tmpstr[32];
 
-    sprintf(tmpstr, "elf%u", elfCount++);
+    sprintf(tmpstr, "elf%u", mach.elfCount++);
     addressRange *rdr = new addressRange(tmpstr, sz);
 
     rdr->start = phdr->p_vaddr;
     rdr->length = sz;
     rdr->end = rdr->start + rdr->length;
     rdr->readOnly = (writable ? false : true);
+    rdr->executable = (phdr->p_flags & PF_X);
 
-    char *cp = (char *) p;
-    rdr->buf.assign(cp + phdr->p_offset, phdr->p_filesz);
-    rdr->buf.resize(phdr->p_memsz);
-    rdr->updateRoot();
+    if (phdr->p_offset > (uint64_t) pf.st.st_size ||
+        phdr->p_filesz > pf.st.st_size - phdr->p_offset) {
+        delete rdr;
+        return false;
+    }
+
+    // map the segment in place, or copy it if it cannot be mapped
+    if (!sz || !rdr->mapFile(pf.fd, phdr->p_offset, phdr->p_filesz)) {
+        char *cp = (char *) pf.data;
+        rdr->buf.assign(cp + phdr->p_offset,
+                        std::min(phdr->p_filesz, phdr->p_memsz));
+        rdr->buf.resize(phdr->p_memsz);
+        rdr->updateRoot();
+    }
 
     mach.memmap.push_back(rdr);
     mach.sortMemMap();
@@ -44,6 +54,38 @@ bool loadElfProgSection(machine &mach, Elf *e, GElf_Phdr *phdr, void *p)
     return true;
 }
 
+/* Record the function symbols of the program, for --hle.  */
+static bool loadElfSymbols(machine &mach, Elf *e)
+{
+    Elf_Scn *scn = NULL;
+    while ((scn = elf_nextscn(e, scn)) != NULL) {
+        GElf_Shdr shdr;
+        if (gelf_getshdr(scn, &shdr) != &shdr)
+            return false;
+        if (shdr.sh_type != SHT_SYMTAB || !shdr.sh_entsize)
+            continue;
+
+        Elf_Data *data = elf_getdata(scn, NULL);
+        if (!data)
+            return false;
+
+        size_t count = shdr.sh_size / shdr.sh_entsize;
+        for (size_t i = 0; i < count; i++) {
+            GElf_Sym sym;
+            if (gelf_getsym(data, i, &sym) != &sym)
+                return false;
+            if (GELF_ST_TYPE(sym.st_info) != STT_FUNC || !sym.st_value)
+                continue;
+
+            const char *name = elf_strptr(e, shdr.sh_link, sym.st_name);
+            if (name && *name)
+                mach.symbols[name] = sym.st_value;
+        }
+    }
+
+    return true;
+}
+
 static bool loadElfFile(machine &mach, mfile &pf)
 {
     if (elf_version(EV_CURRENT) == EV_NONE)
@@ -86,10 +128,13 @@ static bool loadElfFile(machine &mach, mfile &pf)
             continue;
         }
 
-        if (!loadElfProgSection(mach, e, &phdr, pf.data))
+        if (!loadElfProgSection(mach, e, &phdr, pf))
             goto err_out_elf;
     }
 
+    if (!loadElfSymbols(mach, e))
+        goto err_out_elf;
+
     elf_end(e);
     return true;
 
@@ -0,0 +1,158 @@
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "sandbox.h"
+
+using namespace std;
+
+static const uint64_t FLAT_SIZE = 1ULL << 32;
+
+// the flat space of the machine running on this thread
+static __thread flatSpace *flatCurrent;
+
+flatSpace::~flatSpace()
+{
+    if (flatCurrent == this)
+        flatCurrent = NULL;
+    if (base)
+        munmap(base, FLAT_SIZE);
+    if (shadow)
+        munmap(shadow, FLAT_SIZE);
+    if (fd >= 0)
+        close(fd);
+}
+
+void flatSpace::activate()
+{
+    flatCurrent = this;
+}
+
+/* Let a faulting guest access complete on a scratch page; the accessor
+   notices the fault, restores the page and takes the checked path.  */
+static void flatSegv(int sig, siginfo_t *si, void *ctx)
+{
+    flatSpace *flat = flatCurrent;
+    char *addr = (char *) si->si_addr;
+    (void) ctx;
+
+    if (!flat || flat->fault || addr < flat->base ||
+        (uint64_t)(addr - flat->base) >= FLAT_SIZE) {
+        // not a guest access: crash as usual
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    char *page = addr - ((addr - flat->base) & MACH_PAGE_MASK);
+    if (mmap(page, MACH_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    flat->scratch = page;
+    flat->fault = 1;
+}
+
+bool machine::flatInit()
+{
+    int fd = memfd_create("moxie-flat", 0);
+    if (fd < 0)
+        return false;
+
+    void *shadow = MAP_FAILED, *base = MAP_FAILED;
+    if (ftruncate(fd, FLAT_SIZE) == 0) {
+        shadow = mmap(NULL, FLAT_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_NORESERVE, fd, 0);
+        base = mmap(NULL, FLAT_SIZE, PROT_NONE, MAP_SHARED | MAP_NORESERVE,
+                    fd, 0);
+    }
+    if (shadow == MAP_FAILED || base == MAP_FAILED) {
+        if (shadow != MAP_FAILED)
+            munmap(shadow, FLAT_SIZE);
+        if (base != MAP_FAILED)
+            munmap(base, FLAT_SIZE);
+        close(fd);
+        return false;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = flatSegv;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL) < 0) {
+        munmap(shadow, FLAT_SIZE);
+        munmap(base, FLAT_SIZE);
+        close(fd);
+        return false;
+    }
+
+    flat.fd = fd;
+    flat.shadow = (char *) shadow;
+    flat.base = (char *) base;
+    flat.code.assign(FLAT_SIZE >> MACH_PAGE_SHIFT, false);
+    flat.partial.assign(FLAT_SIZE >> MACH_PAGE_SHIFT, false);
+
+    for (unordered_map<uint32_t, vector<uint32_t> >::iterator it =
+             bbcache.pageBlocks.begin();
+         it != bbcache.pageBlocks.end(); ++it)
+        if (!it->second.empty())
+            flat.code[it->first] = true;
+
+    for (unsigned int i = 0; i < memmap.size(); i++)
+        flatMap(memmap[i]);
+
+    flat.activate();
+    return true;
+}
+
+/* Move the contents of a range into the flat space.  */
+void machine::flatMap(addressRange *ar)
+{
+    if (flat.owns(ar) || ar->end <= ar->start)
+        return;
+
+    char *root = flat.shadow + ar->start;
+    size_t len = ar->end - ar->start;
+    size_t have = ar->mapping ? len : ar->buf.size();
+    memcpy(root, ar->root, min(have, len));
+    ar->root = root;
+    string().swap(ar->buf);
+    ar->mapping.reset();
+    tlbFlush();
+
+    uint32_t last = (ar->end - 1) >> MACH_PAGE_SHIFT;
+    for (uint32_t page = ar->start >> MACH_PAGE_SHIFT; page <= last; page++)
+        flatProtect(page);
+}
+
+/* Map a page of the fast view with the permissions of its range.  A
+   page that one range does not cover entirely is left inaccessible and
+   marked partial, so that accesses to it take the checked path, which
+   raises SIGBUS for the bytes outside the range.  */
+void machine::flatProtect(uint32_t page)
+{
+    uint32_t addr = page << MACH_PAGE_SHIFT;
+    int prot = PROT_NONE;
+
+    const struct pageEntry *pe = pages.lookup(addr);
+    if (pe && pe->ar && pe->ar->start <= addr &&
+        pe->ar->end - addr >= MACH_PAGE_SIZE) {
+        prot = PROT_READ | PROT_WRITE;
+        if (flat.code[page] || pe->ar->readOnly)
+            prot = PROT_READ;
+    }
+    flat.partial[page] = prot == PROT_NONE && pe && (pe->ar || pe->shared);
+
+    mmap(flat.base + addr, MACH_PAGE_SIZE, prot, MAP_SHARED | MAP_FIXED,
+         flat.fd, addr);
+}
+
+void machine::flatRecover()
+{
+    uint32_t page = (flat.scratch - flat.base) >> MACH_PAGE_SHIFT;
+
+    flatProtect(page);
+    flat.scratch = NULL;
+    flat.fault = 0;
+}
@@ -0,0 +1,241 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* Each -E/-D directory keeps an index of the SHA-256 of its files, in
+   INDEX_NAME.  An entry stays valid while its file keeps the size,
+   modification time and inode it had when it was hashed, so a lookup
+   only hashes the files added or changed since the last one.  */
+static const char INDEX_NAME[] = ".moxiebox-index";
+static const char INDEX_MAGIC[] = "moxiebox-index 1";
+
+struct indexEntry {
+    string hash;
+    off_t size;
+    time_t mtimeSec;
+    long mtimeNsec;
+    ino_t ino;
+};
+
+typedef unordered_map<string, indexEntry> dirIndex; // by file name
+
+static bool sameFile(const indexEntry &ent, const struct stat &st)
+{
+    return ent.size == st.st_size && ent.mtimeSec == st.st_mtim.tv_sec &&
+           ent.mtimeNsec == st.st_mtim.tv_nsec && ent.ino == st.st_ino;
+}
+
+static void readIndex(const string &dir, dirIndex &index)
+{
+    string filename = dir + "/" + INDEX_NAME;
+    FILE *f = fopen(filename.c_str(), "r");
+    if (!f)
+        return;
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, f);
+    if (len > 0 && line[len - 1] == '\n')
+        line[--len] = 0;
+    if (len < 0 || strcmp(line, INDEX_MAGIC)) {
+        free(line);
+        fclose(f);
+        return;
+    }
+
+    // <sha256> <size> <mtime sec> <mtime nsec> <inode> <name>
+    while ((len = getline(&line, &cap, f)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = 0;
+
+        char hash[65];
+        long long size, sec, ino;
+        long nsec;
+        int nameOfs = -1;
+        if (sscanf(line, "%64s %lld %lld %ld %lld %n", hash, &size, &sec,
+                   &nsec, &ino, &nameOfs) != 5 ||
+            nameOfs < 0 || !line[nameOfs] ||
+            strlen(hash) != SHA256_SIZE * 2 || !IsHex(hash))
+            continue;
+
+        indexEntry ent;
+        ent.hash = hash;
+        ent.size = size;
+        ent.mtimeSec = sec;
+        ent.mtimeNsec = nsec;
+        ent.ino = ino;
+        index[line + nameOfs] = ent;
+    }
+
+    free(line);
+    fclose(f);
+}
+
+/* Replace the index file, if the directory is writable.  A temporary
+   file is renamed over it, so concurrent runs see one index or the
+   other.  */
+static void writeIndex(const string &dir, const dirIndex &index)
+{
+    string filename = dir + "/" + INDEX_NAME;
+    string tmpname = filename + "." + to_string(getpid());
+    FILE *f = fopen(tmpname.c_str(), "w");
+    if (!f)
+        return;
+
+    fprintf(f, "%s\n", INDEX_MAGIC);
+    for (dirIndex::const_iterator it = index.begin(); it != index.end();
+         it++) {
+        const indexEntry &ent = it->second;
+        fprintf(f, "%s %lld %lld %ld %lld %s\n", ent.hash.c_str(),
+                (long long) ent.size, (long long) ent.mtimeSec, ent.mtimeNsec,
+                (long long) ent.ino, it->first.c_str());
+    }
+
+    if (fclose(f) != 0 || rename(tmpname.c_str(), filename.c_str()) < 0)
+        unlink(tmpname.c_str());
+}
+
+/* Hash filenames[i] into hashes[i] on one thread per CPU.  Files that
+   cannot be read get an empty hash.  */
+static void hashFiles(const vector<string> &filenames, vector<string> &hashes)
+{
+    hashes.assign(filenames.size(), string());
+    atomic<size_t> next(0);
+
+    auto work = [&]() {
+        for (size_t i; (i = next++) < filenames.size();)
+            if (!sha256File(filenames[i], hashes[i]))
+                hashes[i].clear();
+    };
+
+    unsigned int nthreads = thread::hardware_concurrency();
+    if (nthreads > filenames.size())
+        nthreads = filenames.size();
+
+    vector<thread> threads;
+    for (unsigned int i = 1; i < nthreads; i++)
+        threads.push_back(thread(work));
+    work();
+    for (unsigned int i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+/* Bring the index of dir up to date with the files in it.  */
+static bool updateIndex(const string &dir, dirIndex &index)
+{
+    vector<string> names;
+    if (!ReadDir(dir, names))
+        return false;
+
+    dirIndex old;
+    readIndex(dir, old);
+
+    bool changed = false;
+    vector<string> stale, staleFiles;
+    vector<struct stat> staleStats;
+    for (unsigned int i = 0; i < names.size(); i++) {
+        const string &name = names[i];
+        if (name[0] == '.' || name.find('\n') != string::npos)
+            continue;
+
+        string filename = dir + "/" + name;
+        struct stat st;
+        if (stat(filename.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        dirIndex::iterator it = old.find(name);
+        if (it != old.end() && sameFile(it->second, st)) {
+            index[name] = it->second;
+            continue;
+        }
+
+        stale.push_back(name);
+        staleFiles.push_back(filename);
+        staleStats.push_back(st);
+    }
+
+    vector<string> hashes;
+    hashFiles(staleFiles, hashes);
+    for (unsigned int i = 0; i < stale.size(); i++) {
+        if (hashes[i].empty())
+            continue;
+
+        indexEntry ent;
+        ent.hash = hashes[i];
+        ent.size = staleStats[i].st_size;
+        ent.mtimeSec = staleStats[i].st_mtim.tv_sec;
+        ent.mtimeNsec = staleStats[i].st_mtim.tv_nsec;
+        ent.ino = staleStats[i].st_ino;
+        index[stale[i]] = ent;
+        changed = true;
+    }
+
+    if (changed || index.size() != old.size())
+        writeIndex(dir, index);
+    return true;
+}
+
+/* Find the file whose SHA-256 is hash in dirs, searched in order, and
+   check that it still has that content.  */
+static bool findHashedFile(const string &hash,
+                           const vector<string> &dirs,
+                           string &filename)
+{
+    if (hash.size() != SHA256_SIZE * 2 || !IsHex(hash))
+        return false;
+    string want = HexStr(ParseHex(hash).data(), SHA256_SIZE); // lower case
+
+    for (unsigned int d = 0; d < dirs.size(); d++) {
+        dirIndex index;
+        if (!updateIndex(dirs[d], index))
+            continue;
+
+        bool changed = false;
+        for (dirIndex::iterator it = index.begin(); it != index.end(); it++) {
+            if (it->second.hash != want)
+                continue;
+
+            // the index only trusts file times; the content must match
+            string got;
+            filename = dirs[d] + "/" + it->first;
+            if (sha256File(filename, got) && got == want)
+                return true;
+
+            // changed behind its times: record what it holds now
+            it->second.hash = got;
+            changed = true;
+        }
+
+        if (changed)
+            writeIndex(dirs[d], index);
+    }
+
+    return false;
+}
+
+bool loadElfHash(machine &mach,
+                 const string &hash,
+                 const vector<string> &pathExec)
+{
+    string filename;
+    return findHashedFile(hash, pathExec, filename) &&
+           loadElfProgram(mach, filename);
+}
+
+bool loadDataHash(machine &mach,
+                  const string &hash,
+                  const vector<string> &pathData)
+{
+    string filename;
+    return findHashedFile(hash, pathData, filename) &&
+           loadRawData(mach, filename);
+}
@@ -0,0 +1,180 @@
+#include <string.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* Instructions charged for a native call, plus one per HLE_BYTES_PER_INSN
+   bytes it touched.  The cost only depends on the arguments and memory
+   contents, so budgets stop at the same point on every run.  */
+enum {
+    HLE_CALL_COST = 16,
+    HLE_BYTES_PER_INSN = 4,
+};
+
+static const char *const hleNames[HLE_COUNT] = {
+    "memcpy", "memset", "memcmp", "strlen", "memchr", "strstr",
+};
+
+/* Bind the runtime functions found in the program's symbol table.  */
+void hleInit(machine &mach)
+{
+    for (int i = 0; i < HLE_COUNT; i++) {
+        unordered_map<string, uint32_t>::const_iterator it =
+            mach.symbols.find(hleNames[i]);
+        if (it != mach.symbols.end())
+            mach.hleFuncs[it->second] = i;
+    }
+}
+
+int hleFind(machine &mach, uint32_t pc)
+{
+    if (mach.hleFuncs.empty())
+        return -1;
+
+    unordered_map<uint32_t, int>::const_iterator it = mach.hleFuncs.find(pc);
+    return it == mach.hleFuncs.end() ? -1 : it->second;
+}
+
+/* Whether guest [addr, addr + len) overlaps [addr2, addr2 + len2).  */
+static bool overlaps(uint32_t addr, uint32_t len, uint32_t addr2,
+                     uint32_t len2)
+{
+    return (uint64_t) addr < (uint64_t) addr2 + len2 &&
+           (uint64_t) addr2 < (uint64_t) addr + len;
+}
+
+/* Length of the NUL-terminated string at addr, if it ends within the
+   range it starts in.  */
+static bool hostString(machine &mach, uint32_t addr, const char *&p,
+                       uint32_t &len)
+{
+    addressRange *ar = mach.findRange(addr, 1);
+    if (!ar)
+        return false;
+
+    p = (const char *) ar->physaddr(addr);
+    const char *nul = (const char *) memchr(p, 0, ar->end - addr);
+    if (!nul)
+        return false;
+
+    len = nul - p;
+    return true;
+}
+
+/* Run runtime function func natively for a call that just entered it,
+   then return to the caller as its ret would.  Arguments are in $r0-$r2
+   and the result goes to $r0; other registers are left alone.  If the
+   arguments touch memory the native code cannot check in one piece, the
+   guest code is run instead, and faults exactly where it would.  */
+int hleCall(machine &mach,
+            int func,
+            unsigned long long limit,
+            uint32_t &pc,
+            unsigned long long &cost)
+{
+    word *regs = mach.cpu.asregs.regs;
+    uint32_t a0 = regs[2], a1 = regs[3], a2 = regs[4];
+    uint32_t fp = regs[0];
+    uint32_t ret = 0, touched = 0, hlen = 0, nlen = 0;
+    const char *src = NULL, *src2 = NULL;
+    char *dst = NULL;
+
+    // the frame ret would pop
+    uint32_t frame[2];
+    char *fr = (char *) mach.hostRange(fp, sizeof(frame));
+    if (!fr)
+        return HLE_GUEST;
+    memcpy(frame, fr, sizeof(frame));
+
+    switch (func) {
+    case HLE_MEMCPY:
+        // the guest copies forward a byte at a time, which memmove only
+        // matches unless the destination starts inside the source
+        if (a0 > a1 && a0 - a1 < a2)
+            return HLE_GUEST;
+        if (!(src = (char *) mach.hostRange(a1, a2)))
+            return HLE_GUEST;
+        touched = a2;
+        break;
+    case HLE_MEMSET:
+        touched = a2;
+        break;
+    case HLE_MEMCMP:
+        if (!(src = (char *) mach.hostRange(a0, a2)) ||
+            !(src2 = (char *) mach.hostRange(a1, a2)))
+            return HLE_GUEST;
+        touched = a2;
+        break;
+    case HLE_STRLEN:
+        if (!hostString(mach, a0, src, touched))
+            return HLE_GUEST;
+        break;
+    case HLE_MEMCHR:
+        if (!(src = (char *) mach.hostRange(a0, a2)))
+            return HLE_GUEST;
+        touched = a2;
+        break;
+    case HLE_STRSTR:
+        if (!hostString(mach, a0, src, hlen) ||
+            !hostString(mach, a1, src2, nlen))
+            return HLE_GUEST;
+        touched = hlen + nlen;
+        break;
+    }
+
+    // ret would pop what the stores left in the frame
+    if ((func == HLE_MEMCPY || func == HLE_MEMSET) &&
+        overlaps(a0, a2, fp, sizeof(frame)))
+        return HLE_GUEST;
+
+    cost = HLE_CALL_COST + touched / HLE_BYTES_PER_INSN;
+    if (cost > limit)
+        return HLE_BUDGET;
+
+    switch (func) {
+    case HLE_MEMCPY:
+        if (a2 && !(dst = (char *) mach.hostRange(a0, a2, true)))
+            return HLE_GUEST;
+        if (a2)
+            memmove(dst, src, a2);
+        ret = a0;
+        break;
+    case HLE_MEMSET:
+        if (a2 && !(dst = (char *) mach.hostRange(a0, a2, true)))
+            return HLE_GUEST;
+        if (a2)
+            memset(dst, a1, a2);
+        ret = a0;
+        break;
+    case HLE_MEMCMP:
+        // the guest returns the difference of the first unequal bytes
+        if (memcmp(src, src2, a2)) {
+            uint32_t i = 0;
+            while (i + 64 <= a2 && !memcmp(src + i, src2 + i, 64))
+                i += 64;
+            while (src[i] == src2[i])
+                i++;
+            ret = (unsigned char) src[i] - (unsigned char) src2[i];
+        }
+        break;
+    case HLE_STRLEN:
+        ret = touched;
+        break;
+    case HLE_MEMCHR: {
+        const char *p = (const char *) memchr(src, (unsigned char) a1, a2);
+        ret = p ? a0 + (p - src) : 0;
+        break;
+    }
+    case HLE_STRSTR: {
+        const char *p = (const char *) memmem(src, hlen, src2, nlen);
+        ret = p ? a0 + (p - src) : 0;
+        break;
+    }
+    }
+
+    regs[2] = ret;
+    regs[0] = frame[0];
+    regs[1] = fp + 12;
+    pc = frame[1];
+    return HLE_DONE;
+}
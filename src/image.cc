@@ -0,0 +1,216 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* A prepared program image: the ranges of a loaded executable, its
+   entry point and symbols, laid out so that later runs can map the
+   ranges straight from the file.  Images live in a cache directory under
+   the SHA-256 of the executable, so they are never stale.  They are in
+   host byte order and only meant for the host that wrote them.
+
+   The file holds an imageHeader, rangeCount imageRange entries, the
+   symbols as NUL-terminated names each followed by a 32-bit address,
+   and then the contents of each range at a page-aligned offset, without
+   trailing zero bytes.  */
+static const char IMAGE_MAGIC[8] = "MOXIMG1";
+
+struct imageHeader {
+    char magic[8];
+    uint32_t startAddr;
+    uint32_t rangeCount;
+    uint32_t symbolCount;
+    uint32_t symbolSize; // bytes of symbols, after the ranges
+};
+
+struct imageRange {
+    uint32_t start;
+    uint32_t length;
+    uint32_t fileLength; // bytes stored; the rest is zero
+    uint32_t flags;
+    uint64_t offset;
+};
+
+enum {
+    IMAGE_READONLY = 1 << 0,
+    IMAGE_EXECUTABLE = 1 << 1,
+};
+
+static bool writeAll(int fd, const void *p, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t bytes = pwrite(fd, p, len, offset);
+        if (bytes < 0)
+            return false;
+        p = (const char *) p + bytes;
+        len -= bytes;
+        offset += bytes;
+    }
+    return true;
+}
+
+/* Map the ranges of the image in filename into mach, in place of
+   loading the executable it was made from.  */
+bool loadImage(machine &mach, const string &filename)
+{
+    mfile pf(filename);
+    if (!pf.open(O_RDONLY, 0, false) || fstat(pf.fd, &pf.st) < 0)
+        return false;
+
+    imageHeader hdr;
+    if (pread(pf.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)))
+        return false;
+
+    size_t tableSize = hdr.rangeCount * sizeof(imageRange) + hdr.symbolSize;
+    if ((uint64_t) sizeof(hdr) + tableSize > (uint64_t) pf.st.st_size)
+        return false;
+
+    vector<char> table(tableSize);
+    if (pread(pf.fd, table.data(), tableSize, sizeof(hdr)) !=
+        (ssize_t) tableSize)
+        return false;
+
+    // ranges must be ones the ELF loader could have built: non-empty,
+    // within the address space, without overlaps, and within the file
+    const imageRange *ranges = (const imageRange *) table.data();
+    vector<pair<uint32_t, uint32_t> > spans;
+    for (uint32_t i = 0; i < hdr.rangeCount; i++) {
+        const imageRange &ir = ranges[i];
+        if (!ir.length || (uint64_t) ir.start + ir.length > UINT32_MAX ||
+            ir.fileLength > ir.length ||
+            (ir.fileLength &&
+             ir.offset + ir.fileLength > (uint64_t) pf.st.st_size))
+            return false;
+        spans.push_back(make_pair(ir.start, ir.start + ir.length));
+    }
+
+    sort(spans.begin(), spans.end());
+    for (size_t i = 1; i < spans.size(); i++)
+        if (spans[i].first < spans[i - 1].second)
+            return false;
+
+    // the symbols come first, so a bad table leaves no ranges behind
+    const char *p = table.data() + hdr.rangeCount * sizeof(imageRange);
+    const char *end = p + hdr.symbolSize;
+    unordered_map<string, uint32_t> symbols;
+    for (uint32_t i = 0; i < hdr.symbolCount; i++) {
+        const char *nul = (const char *) memchr(p, 0, end - p);
+        uint32_t addr;
+        if (!nul || (size_t)(end - nul - 1) < sizeof(addr))
+            return false;
+        memcpy(&addr, nul + 1, sizeof(addr));
+        symbols[p] = addr;
+        p = nul + 1 + sizeof(addr);
+    }
+
+    mach.startAddr = hdr.startAddr;
+    fprintf(stderr, "ep %08x\n", hdr.startAddr);
+
+    for (uint32_t i = 0; i < hdr.rangeCount; i++) {
+        const imageRange &ir = ranges[i];
+        char tmpstr[32];
+
+        sprintf(tmpstr, "elf%u", mach.elfCount++);
+        addressRange *rdr = new addressRange(tmpstr, ir.length);
+        rdr->start = ir.start;
+        rdr->end = ir.start + ir.length;
+        rdr->readOnly = (ir.flags & IMAGE_READONLY);
+        rdr->executable = (ir.flags & IMAGE_EXECUTABLE);
+
+        if (!rdr->mapFile(pf.fd, ir.offset, ir.fileLength)) {
+            rdr->buf.resize(ir.length);
+            if (ir.fileLength &&
+                pread(pf.fd, &rdr->buf[0], ir.fileLength, ir.offset) !=
+                    (ssize_t) ir.fileLength) {
+                delete rdr;
+                return false;
+            }
+            rdr->updateRoot();
+        }
+
+        mach.memmap.push_back(rdr);
+    }
+
+    mach.sortMemMap();
+    mach.symbols.insert(symbols.begin(), symbols.end());
+    return true;
+}
+
+/* Write the image of the given ranges of mach, just loaded from an
+   executable, to filename.  A temporary file is renamed into place, so
+   concurrent runs never map a partial image.  */
+bool saveImage(machine &mach,
+               const vector<addressRange *> &ranges,
+               const string &filename)
+{
+    imageHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.startAddr = mach.startAddr;
+    hdr.rangeCount = ranges.size();
+
+    string symbols;
+    for (unordered_map<string, uint32_t>::const_iterator it =
+             mach.symbols.begin();
+         it != mach.symbols.end(); it++) {
+        symbols.append(it->first.c_str(), it->first.size() + 1);
+        symbols.append((const char *) &it->second, sizeof(it->second));
+        hdr.symbolCount++;
+    }
+    hdr.symbolSize = symbols.size();
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t offset = sizeof(hdr) + ranges.size() * sizeof(imageRange) +
+                      symbols.size();
+    vector<imageRange> table(ranges.size());
+    for (unsigned int i = 0; i < ranges.size(); i++) {
+        addressRange *ar = ranges[i];
+        const char *data = (const char *) ar->root;
+        imageRange &ir = table[i];
+
+        // loadImage refuses empty ranges; such programs are not cached
+        if (!ar->length)
+            return false;
+
+        ir.start = ar->start;
+        ir.length = ar->length;
+        ir.fileLength = ar->length;
+        while (ir.fileLength && !data[ir.fileLength - 1])
+            ir.fileLength--;
+        ir.flags = (ar->readOnly ? IMAGE_READONLY : 0) |
+                   (ar->executable ? IMAGE_EXECUTABLE : 0);
+        ir.offset = (offset + pageSize - 1) & ~(uint64_t)(pageSize - 1);
+        offset = ir.offset + ir.fileLength;
+    }
+
+    string tmpname = filename + "." + to_string(getpid());
+    int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0666);
+    if (fd < 0)
+        return false;
+
+    bool ok = writeAll(fd, &hdr, sizeof(hdr), 0) &&
+              writeAll(fd, table.data(), table.size() * sizeof(imageRange),
+                       sizeof(hdr)) &&
+              writeAll(fd, symbols.data(), symbols.size(),
+                       sizeof(hdr) + table.size() * sizeof(imageRange));
+    for (unsigned int i = 0; ok && i < ranges.size(); i++)
+        ok = writeAll(fd, ranges[i]->root, table[i].fileLength,
+                      table[i].offset);
+
+    if (close(fd) != 0)
+        ok = false;
+    if (ok && rename(tmpname.c_str(), filename.c_str()) < 0)
+        ok = false;
+    if (!ok)
+        unlink(tmpname.c_str());
+    return ok;
+}
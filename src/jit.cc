@@ -0,0 +1,887 @@
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sandbox.h"
+
+#ifdef MOXIE_JIT
+
+using namespace std;
+
+/* Translated blocks keep up to five guest registers in callee-saved host
+   registers and address the rest of the register file through r15.
+   Guest memory is only reached through the helpers below, which go
+   through the same range checks as the interpreter.  A block that could
+   raise an exception or overwrite cached code leaves right after the
+   instruction that did it, with the exact pc and instruction count.  */
+
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+enum {
+    X86_B = 0x2,
+    X86_AE = 0x3,
+    X86_E = 0x4,
+    X86_NE = 0x5,
+    X86_BE = 0x6,
+    X86_A = 0x7,
+    X86_L = 0xc,
+    X86_GE = 0xd,
+    X86_LE = 0xe,
+    X86_G = 0xf,
+};
+
+static const int guestHostRegs[] = {RBX, RBP, R12, R13, R14};
+
+enum {
+    NUM_GUEST_HOST_REGS = sizeof(guestHostRegs) / sizeof(guestHostRegs[0]),
+    REGFILE = R15,
+    NUM_GPRS = 16,
+};
+
+/* Stack frame of translated code.  */
+enum {
+    FRAME_COUNT = 0, // instructions retired by earlier loop iterations
+    FRAME_LIMIT = 8, // instruction limit of this call
+    FRAME_TMP0 = 16,
+    FRAME_TMP1 = 20,
+    FRAME_SIZE = 24, // keeps rsp 16-byte aligned at helper calls
+};
+
+/* Upper bound of the host code emitted for one block.  */
+enum {
+    JIT_BLOCK_MAX = 256 * BB_MAX_INSNS + 512,
+};
+
+static uint32_t jitLoad8(machine *mach, uint32_t addr)
+{
+    uint32_t val = 0;
+    if (!mach->read8(addr, val))
+        mach->cpu.asregs.exception = SIGBUS;
+    return val;
+}
+
+static uint32_t jitLoad16(machine *mach, uint32_t addr)
+{
+    uint32_t val = 0;
+    if (!mach->read16(addr, val))
+        mach->cpu.asregs.exception = SIGBUS;
+    return val;
+}
+
+static uint32_t jitLoad32(machine *mach, uint32_t addr)
+{
+    uint32_t val = 0;
+    if (!mach->read32(addr, val))
+        mach->cpu.asregs.exception = SIGBUS;
+    return val;
+}
+
+static void jitStore8(machine *mach, uint32_t addr, uint32_t val)
+{
+    if (!mach->write8(addr, val))
+        mach->cpu.asregs.exception = SIGBUS;
+}
+
+static void jitStore16(machine *mach, uint32_t addr, uint32_t val)
+{
+    if (!mach->write16(addr, val))
+        mach->cpu.asregs.exception = SIGBUS;
+}
+
+static void jitStore32(machine *mach, uint32_t addr, uint32_t val)
+{
+    if (!mach->write32(addr, val))
+        mach->cpu.asregs.exception = SIGBUS;
+}
+
+/* Just enough of an x86-64 assembler.  Register operands are 32 bits
+   wide unless the name says otherwise.  */
+class x86Emitter
+{
+public:
+    uint8_t *p;
+
+    x86Emitter(uint8_t *p_) { p = p_; }
+
+    void byte(uint8_t b) { *p++ = b; }
+    void dword(uint32_t d)
+    {
+        memcpy(p, &d, 4);
+        p += 4;
+    }
+    void qword(uint64_t q)
+    {
+        memcpy(p, &q, 8);
+        p += 8;
+    }
+
+    void rex(bool w, int reg, int rm, bool force = false)
+    {
+        uint8_t v = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+        if (v != 0x40 || force)
+            byte(v);
+    }
+    void modrm(int reg, int rm) { byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+    void mem(int reg, int base, int32_t disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        dword(disp);
+    }
+
+    // op rm, reg: 0x01 add, 0x09 or, 0x21 and, 0x29 sub, 0x31 xor, 0x39 cmp
+    void alu(uint8_t op, int dst, int src, bool w = false)
+    {
+        rex(w, src, dst);
+        byte(op);
+        modrm(src, dst);
+    }
+    void mov(int dst, int src) { alu(0x89, dst, src); }
+    void movi(int dst, uint32_t imm)
+    {
+        rex(false, 0, dst);
+        byte(0xb8 + (dst & 7));
+        dword(imm);
+    }
+    void movi64(int dst, uint64_t imm)
+    {
+        rex(true, 0, dst);
+        byte(0xb8 + (dst & 7));
+        qword(imm);
+    }
+    void load(int dst, int base, int32_t disp, bool w = false)
+    {
+        rex(w, dst, base);
+        byte(0x8b);
+        mem(dst, base, disp);
+    }
+    void store(int base, int32_t disp, int src, bool w = false)
+    {
+        rex(w, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+    // group 1 with imm32: 0 add, 1 or, 4 and, 5 sub, 7 cmp
+    void alui(int ext, int dst, uint32_t imm, bool w = false)
+    {
+        rex(w, 0, dst);
+        byte(0x81);
+        modrm(ext, dst);
+        dword(imm);
+    }
+    void addm64(int base, int32_t disp, uint32_t imm)
+    {
+        rex(true, 0, base);
+        byte(0x81);
+        mem(0, base, disp);
+        dword(imm);
+    }
+    void cmpr64m(int reg, int base, int32_t disp)
+    {
+        rex(true, reg, base);
+        byte(0x3b);
+        mem(reg, base, disp);
+    }
+    void cmpm32(int base, int32_t disp, int8_t imm)
+    {
+        rex(false, 0, base);
+        byte(0x83);
+        mem(7, base, disp);
+        byte(imm);
+    }
+    void cmpm8(int base, int32_t disp, int8_t imm)
+    {
+        rex(false, 0, base);
+        byte(0x80);
+        mem(7, base, disp);
+        byte(imm);
+    }
+    void testm32(int base, int32_t disp, uint32_t imm)
+    {
+        rex(false, 0, base);
+        byte(0xf7);
+        mem(0, base, disp);
+        dword(imm);
+    }
+    // group 3: 2 not, 3 neg, 4 mul, 6 div, 7 idiv
+    void unary(int ext, int r)
+    {
+        rex(false, 0, r);
+        byte(0xf7);
+        modrm(ext, r);
+    }
+    // shift by cl: 4 shl, 5 shr, 7 sar
+    void shiftcl(int ext, int r)
+    {
+        rex(false, 0, r);
+        byte(0xd3);
+        modrm(ext, r);
+    }
+    void shli(int r, uint8_t n, bool w = false)
+    {
+        rex(w, 0, r);
+        byte(0xc1);
+        modrm(4, r);
+        byte(n);
+    }
+    void imul(int dst, int src)
+    {
+        rex(false, dst, src);
+        byte(0x0f);
+        byte(0xaf);
+        modrm(dst, src);
+    }
+    // 0xb6 movzx r8, 0xb7 movzx r16, 0xbe movsx r8, 0xbf movsx r16
+    void movx(uint8_t op, int dst, int src)
+    {
+        rex(false, dst, src, true);
+        byte(0x0f);
+        byte(op);
+        modrm(dst, src);
+    }
+    void cdq() { byte(0x99); }
+    void push(int r)
+    {
+        rex(false, 0, r);
+        byte(0x50 + (r & 7));
+    }
+    void pop(int r)
+    {
+        rex(false, 0, r);
+        byte(0x58 + (r & 7));
+    }
+    void call(const void *fn)
+    {
+        movi64(RAX, (uint64_t) fn);
+        byte(0xff);
+        modrm(2, RAX);
+    }
+    void ret() { byte(0xc3); }
+
+    // Branches return their rel32 field, to be patched later.
+    uint8_t *jcc(int cc)
+    {
+        byte(0x0f);
+        byte(0x80 + cc);
+        dword(0);
+        return p - 4;
+    }
+    uint8_t *jmp()
+    {
+        byte(0xe9);
+        dword(0);
+        return p - 4;
+    }
+    static void patch(uint8_t *rel, uint8_t *target)
+    {
+        int32_t d = target - (rel + 4);
+        memcpy(rel, &d, 4);
+    }
+};
+
+static bool jitSupported(uint8_t op)
+{
+    switch (op) {
+    case OP_SWI:
+    case OP_SSR:
+    case OP_BRK:
+    case OP_ILL:
+    case OP_ILL3:
+    case OP_FETCHBUS:
+        return false;
+    default:
+        return true;
+    }
+}
+
+class jitTranslator
+{
+public:
+    jitTranslator(machine &mach_, moxieBlock *blk_, uint8_t *code)
+        : mach(mach_), blk(blk_), e(code)
+    {
+        // superinstructions are translated as their parts
+        insns = blk->insns;
+        for (size_t i = 0; i < insns.size(); i++)
+            insns[i].op = moxie_unfused_op(insns[i].op);
+
+        count = 0;
+        while (count < insns.size() && jitSupported(insns[count].op))
+            count++;
+
+        ccOff = offsetof(struct moxie_regset, cc);
+        ccaOff = offsetof(struct moxie_regset, cca);
+        ccbOff = offsetof(struct moxie_regset, ccb);
+        ccLazyOff = offsetof(struct moxie_regset, ccLazy);
+        cmpSeen = false;
+        cmpLast = false;
+        excOff = offsetof(struct moxie_regset, exception);
+        sregsOff = offsetof(struct moxie_regset, sregs);
+        modifiedOff = (char *) &mach.bbcache.modified - (char *) &mach.cpu.asregs;
+    }
+
+    size_t count; // instructions translated
+
+    uint8_t *translate();
+    uint8_t *end() { return e.p; }
+
+private:
+    struct sideExit {
+        uint8_t *rel;
+        uint32_t pc;
+        uint32_t count;
+    };
+
+    machine &mach;
+    moxieBlock *blk;
+    x86Emitter e;
+    vector<struct moxie_insn> insns;
+    uint8_t *top;
+    int host[NUM_GPRS];
+    bool written[NUM_GPRS];
+    vector<uint8_t *> toExit;
+    vector<sideExit> sideExits;
+    int32_t ccOff, ccaOff, ccbOff, ccLazyOff, excOff, sregsOff, modifiedOff;
+    bool cmpSeen; // an earlier cmp of this block made the flags lazy
+    bool cmpLast; // ... and it was the previous instruction
+
+    void allocate();
+    void get(int r, int g);
+    void put(int g, int r);
+    void callHelper(const void *fn);
+    void exitStatic(uint32_t pc, uint32_t n);
+    void exitDynamic(uint32_t n);
+    void exitIf(int cc, uint32_t pc, uint32_t n);
+    void checkLoad(uint32_t npc, uint32_t n);
+    void checkStore(uint32_t npc, uint32_t n);
+    void branchTo(uint32_t target, uint32_t n);
+    void call(const moxie_insn &ins, uint32_t npc, uint32_t n);
+    void emit(const moxie_insn &ins, uint32_t pc, uint32_t n);
+};
+
+/* Give the most used guest registers a host register.  */
+void jitTranslator::allocate()
+{
+    unsigned uses[NUM_GPRS];
+    memset(uses, 0, sizeof(uses));
+
+    for (size_t i = 0; i < count; i++) {
+        const moxie_insn &ins = insns[i];
+        uses[ins.a]++;
+        uses[ins.b]++;
+        if (ins.op == OP_JSRA || ins.op == OP_JSR || ins.op == OP_RET) {
+            uses[0]++;
+            uses[1]++;
+        }
+    }
+
+    for (int g = 0; g < NUM_GPRS; g++) {
+        host[g] = -1;
+        written[g] = false;
+    }
+
+    for (int i = 0; i < NUM_GUEST_HOST_REGS; i++) {
+        int best = -1;
+        for (int g = 0; g < NUM_GPRS; g++)
+            if (host[g] < 0 && uses[g] && (best < 0 || uses[g] > uses[best]))
+                best = g;
+        if (best < 0)
+            break;
+        host[best] = guestHostRegs[i];
+    }
+}
+
+void jitTranslator::get(int r, int g)
+{
+    if (host[g] >= 0)
+        e.mov(r, host[g]);
+    else
+        e.load(r, REGFILE, 4 * g);
+}
+
+void jitTranslator::put(int g, int r)
+{
+    if (host[g] >= 0) {
+        e.mov(host[g], r);
+        written[g] = true;
+    } else
+        e.store(REGFILE, 4 * g, r);
+}
+
+// address in esi, stored value in edx, loaded value returned in eax
+void jitTranslator::callHelper(const void *fn)
+{
+    e.movi64(RDI, (uint64_t) &mach);
+    e.call(fn);
+}
+
+void jitTranslator::exitStatic(uint32_t pc, uint32_t n)
+{
+    e.movi(RAX, pc);
+    exitDynamic(n);
+}
+
+// next pc in eax
+void jitTranslator::exitDynamic(uint32_t n)
+{
+    e.movi(RCX, n);
+    toExit.push_back(e.jmp());
+}
+
+void jitTranslator::exitIf(int cc, uint32_t pc, uint32_t n)
+{
+    sideExit se = {e.jcc(cc), pc, n};
+    sideExits.push_back(se);
+}
+
+void jitTranslator::checkLoad(uint32_t npc, uint32_t n)
+{
+    e.cmpm32(REGFILE, excOff, 0);
+    exitIf(X86_NE, npc, n);
+}
+
+void jitTranslator::checkStore(uint32_t npc, uint32_t n)
+{
+    checkLoad(npc, n);
+    e.cmpm8(REGFILE, modifiedOff, 0);
+    exitIf(X86_NE, npc, n);
+}
+
+/* A block that branches back to its own start loops in host code for as
+   long as another full iteration fits the instruction limit.  */
+void jitTranslator::branchTo(uint32_t target, uint32_t n)
+{
+    if (target != blk->start || count != insns.size()) {
+        exitStatic(target, n);
+        return;
+    }
+
+    e.addm64(RSP, FRAME_COUNT, n);
+    e.load(RAX, RSP, FRAME_COUNT, true);
+    e.alui(0, RAX, n, true);
+    e.cmpr64m(RAX, RSP, FRAME_LIMIT);
+    exitIf(X86_A, target, 0);
+    x86Emitter::patch(e.jmp(), top);
+}
+
+void jitTranslator::call(const moxie_insn &ins, uint32_t npc, uint32_t n)
+{
+    if (ins.op == OP_JSR) {
+        get(RAX, ins.a);
+        e.store(RSP, FRAME_TMP1, RAX);
+    }
+
+    // static chain slot, return address, frame pointer
+    get(RSI, 1);
+    e.alui(5, RSI, 8);
+    e.store(RSP, FRAME_TMP0, RSI);
+    e.movi(RDX, npc);
+    callHelper((const void *) jitStore32);
+    e.load(RSI, RSP, FRAME_TMP0);
+    e.alui(5, RSI, 4);
+    e.store(RSP, FRAME_TMP0, RSI);
+    get(RDX, 0);
+    callHelper((const void *) jitStore32);
+    e.load(RAX, RSP, FRAME_TMP0);
+    put(1, RAX);
+    put(0, RAX);
+
+    if (ins.op == OP_JSR) {
+        e.load(RAX, RSP, FRAME_TMP1);
+        exitDynamic(n);
+    } else
+        exitStatic(ins.imm, n);
+}
+
+void jitTranslator::emit(const moxie_insn &ins, uint32_t pc, uint32_t n)
+{
+    static const word branchFlags[10] = {
+        CC_EQ,         ~CC_EQ,        CC_LT,
+        CC_GT,         CC_LTU,        CC_GTU,
+        CC_GT | CC_EQ, CC_LT | CC_EQ, CC_GTU | CC_EQ,
+        CC_LTU | CC_EQ};
+    static const int branchConds[10] = {
+        X86_E, X86_NE, X86_L, X86_G, X86_B, X86_A, X86_GE, X86_LE, X86_AE,
+        X86_BE};
+    uint32_t npc = pc + ins.len;
+    const void *fn = NULL;
+    bool afterCmp = cmpLast; // its operands are still in eax and ecx
+    cmpLast = false;
+
+    switch (ins.op) {
+    case OP_BEQ:
+    case OP_BNE:
+    case OP_BLT:
+    case OP_BGT:
+    case OP_BLTU:
+    case OP_BGTU:
+    case OP_BGE:
+    case OP_BLE:
+    case OP_BGEU:
+    case OP_BLEU: {
+        // compare the operands of the last cmp, unless there was none
+        uint8_t *flags = NULL, *flagsNotTaken = NULL;
+        if (!cmpSeen) {
+            e.cmpm32(REGFILE, ccLazyOff, 0);
+            flags = e.jcc(X86_E);
+        }
+        if (!afterCmp) {
+            e.load(RAX, REGFILE, ccaOff);
+            e.load(RCX, REGFILE, ccbOff);
+        }
+        e.alu(0x39, RAX, RCX);
+        uint8_t *notTaken = e.jcc(branchConds[ins.op - OP_BEQ] ^ 1);
+        if (flags) {
+            uint8_t *taken = e.jmp();
+            x86Emitter::patch(flags, e.p);
+            e.testm32(REGFILE, ccOff, branchFlags[ins.op - OP_BEQ]);
+            flagsNotTaken = e.jcc(X86_E);
+            x86Emitter::patch(taken, e.p);
+        }
+        branchTo(ins.imm, n);
+        x86Emitter::patch(notTaken, e.p);
+        if (flagsNotTaken)
+            x86Emitter::patch(flagsNotTaken, e.p);
+        exitStatic(npc, n);
+        break;
+    }
+    case OP_JMPA:
+        branchTo(ins.imm, n);
+        break;
+    case OP_JMP:
+        get(RAX, ins.a);
+        exitDynamic(n);
+        break;
+    case OP_JSRA:
+    case OP_JSR:
+        call(ins, npc, n);
+        break;
+    case OP_RET:
+        get(RSI, 0);
+        e.store(RSP, FRAME_TMP0, RSI);
+        callHelper((const void *) jitLoad32);
+        put(0, RAX);
+        e.load(RSI, RSP, FRAME_TMP0);
+        e.alui(0, RSI, 4);
+        callHelper((const void *) jitLoad32);
+        e.store(RSP, FRAME_TMP1, RAX);
+        e.load(RAX, RSP, FRAME_TMP0);
+        e.alui(0, RAX, 12);
+        put(1, RAX);
+        e.load(RAX, RSP, FRAME_TMP1);
+        exitDynamic(n);
+        break;
+
+    case OP_NOP:
+        break;
+    case OP_LDI_L:
+    case OP_LDI_B:
+    case OP_LDI_S:
+        e.movi(RAX, ins.imm);
+        put(ins.a, RAX);
+        break;
+    case OP_MOV:
+        get(RAX, ins.b);
+        put(ins.a, RAX);
+        break;
+    case OP_INC:
+    case OP_DEC:
+        get(RAX, ins.a);
+        e.alui(ins.op == OP_INC ? 0 : 5, RAX, ins.imm);
+        put(ins.a, RAX);
+        break;
+    case OP_GSR:
+        e.load(RAX, REGFILE, sregsOff + 4 * ins.imm);
+        put(ins.a, RAX);
+        break;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR: {
+        static const uint8_t aluOps[] = {0x01, 0x29, 0x21, 0x09, 0x31};
+        int i = ins.op == OP_ADD ? 0 : ins.op == OP_SUB ? 1 :
+                ins.op == OP_AND ? 2 : ins.op == OP_OR ? 3 : 4;
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.alu(aluOps[i], RAX, RCX);
+        put(ins.a, RAX);
+        break;
+    }
+    case OP_MUL:
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.imul(RAX, RCX);
+        put(ins.a, RAX);
+        break;
+    case OP_UMUL_X:
+    case OP_MUL_X:
+        // both take the high word of the unsigned 64-bit product
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.unary(4, RCX);
+        put(ins.a, RDX);
+        break;
+    case OP_DIV:
+    case OP_MOD:
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.cdq();
+        e.unary(7, RCX);
+        put(ins.a, ins.op == OP_DIV ? RAX : RDX);
+        break;
+    case OP_UDIV:
+    case OP_UMOD:
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.alu(0x31, RDX, RDX);
+        e.unary(6, RCX);
+        put(ins.a, ins.op == OP_UDIV ? RAX : RDX);
+        break;
+    case OP_LSHR:
+    case OP_ASHL:
+    case OP_ASHR:
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.shiftcl(ins.op == OP_LSHR ? 5 : ins.op == OP_ASHL ? 4 : 7, RAX);
+        put(ins.a, RAX);
+        break;
+    case OP_NEG:
+    case OP_NOT:
+        get(RAX, ins.b);
+        e.unary(ins.op == OP_NEG ? 3 : 2, RAX);
+        put(ins.a, RAX);
+        break;
+    case OP_SEX_B:
+    case OP_SEX_S:
+    case OP_ZEX_B:
+    case OP_ZEX_S:
+        get(RAX, ins.b);
+        e.movx(ins.op == OP_SEX_B ? 0xbe : ins.op == OP_SEX_S ? 0xbf :
+               ins.op == OP_ZEX_B ? 0xb6 : 0xb7, RAX, RAX);
+        put(ins.a, RAX);
+        break;
+    case OP_CMP:
+        get(RAX, ins.a);
+        get(RCX, ins.b);
+        e.store(REGFILE, ccaOff, RAX);
+        e.store(REGFILE, ccbOff, RCX);
+        e.movi(RDX, 1);
+        e.store(REGFILE, ccLazyOff, RDX);
+        cmpSeen = true;
+        cmpLast = true;
+        return;
+
+    case OP_LD_B:
+    case OP_LD_S:
+    case OP_LD_L:
+    case OP_LDO_B:
+    case OP_LDO_S:
+    case OP_LDO_L:
+        get(RSI, ins.b);
+        if (ins.op == OP_LDO_B || ins.op == OP_LDO_S || ins.op == OP_LDO_L)
+            e.alui(0, RSI, ins.imm);
+        goto load;
+    case OP_LDA_B:
+    case OP_LDA_S:
+    case OP_LDA_L:
+        e.movi(RSI, ins.imm);
+    load:
+        fn = (ins.op == OP_LD_B || ins.op == OP_LDO_B || ins.op == OP_LDA_B) ?
+                 (const void *) jitLoad8 :
+             (ins.op == OP_LD_S || ins.op == OP_LDO_S || ins.op == OP_LDA_S) ?
+                 (const void *) jitLoad16 :
+                 (const void *) jitLoad32;
+        callHelper(fn);
+        put(ins.a, RAX);
+        checkLoad(npc, n);
+        break;
+
+    case OP_ST_B:
+    case OP_ST_S:
+    case OP_ST_L:
+    case OP_STO_B:
+    case OP_STO_S:
+    case OP_STO_L:
+        get(RSI, ins.a);
+        if (ins.op == OP_STO_B || ins.op == OP_STO_S || ins.op == OP_STO_L)
+            e.alui(0, RSI, ins.imm);
+        get(RDX, ins.b);
+        goto store;
+    case OP_STA_B:
+    case OP_STA_S:
+    case OP_STA_L:
+        e.movi(RSI, ins.imm);
+        get(RDX, ins.a);
+    store:
+        fn = (ins.op == OP_ST_B || ins.op == OP_STO_B || ins.op == OP_STA_B) ?
+                 (const void *) jitStore8 :
+             (ins.op == OP_ST_S || ins.op == OP_STO_S || ins.op == OP_STA_S) ?
+                 (const void *) jitStore16 :
+                 (const void *) jitStore32;
+        callHelper(fn);
+        checkStore(npc, n);
+        break;
+
+    case OP_PUSH:
+        get(RSI, ins.a);
+        e.alui(5, RSI, 4);
+        e.store(RSP, FRAME_TMP0, RSI);
+        get(RDX, ins.b);
+        callHelper((const void *) jitStore32);
+        e.load(RAX, RSP, FRAME_TMP0);
+        put(ins.a, RAX);
+        checkStore(npc, n);
+        break;
+    case OP_POP:
+        get(RSI, ins.a);
+        e.store(RSP, FRAME_TMP0, RSI);
+        callHelper((const void *) jitLoad32);
+        put(ins.b, RAX);
+        e.load(RAX, RSP, FRAME_TMP0);
+        e.alui(0, RAX, 4);
+        put(ins.a, RAX);
+        checkLoad(npc, n);
+        break;
+    }
+}
+
+uint8_t *jitTranslator::translate()
+{
+    uint8_t *entry = e.p;
+    allocate();
+
+    // prologue: r15 = register file, remember the limit
+    static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+    for (int i = 0; i < 6; i++)
+        e.push(saved[i]);
+    e.alui(5, RSP, FRAME_SIZE, true);
+    e.alu(0x89, REGFILE, RDI, true);
+    e.store(RSP, FRAME_LIMIT, RSI, true);
+    e.movi(RAX, 0);
+    e.store(RSP, FRAME_COUNT, RAX, true);
+    for (int g = 0; g < NUM_GPRS; g++)
+        if (host[g] >= 0)
+            e.load(host[g], REGFILE, 4 * g);
+    top = e.p;
+
+    uint32_t pc = blk->start;
+    bool ended = false;
+    for (size_t i = 0; i < count; i++) {
+        const moxie_insn &ins = insns[i];
+        emit(ins, pc, i + 1);
+        pc += ins.len;
+        ended = (ins.op >= OP_BEQ && ins.op <= OP_BLEU) || ins.op == OP_JMPA ||
+                ins.op == OP_JMP || ins.op == OP_JSRA || ins.op == OP_JSR ||
+                ins.op == OP_RET;
+    }
+    if (!ended)
+        exitStatic(pc, count);
+
+    // exit: next pc in eax, instructions of this iteration in ecx
+    uint8_t *exitCode = e.p;
+    for (int g = 0; g < NUM_GPRS; g++)
+        if (host[g] >= 0 && written[g])
+            e.store(REGFILE, 4 * g, host[g]);
+    e.load(RDX, RSP, FRAME_COUNT, true);
+    e.alu(0x01, RDX, RCX, true);
+    e.shli(RDX, 32, true);
+    e.mov(RAX, RAX);
+    e.alu(0x09, RAX, RDX, true);
+    e.alui(0, RSP, FRAME_SIZE, true);
+    for (int i = 5; i >= 0; i--)
+        e.pop(saved[i]);
+    e.ret();
+
+    for (size_t i = 0; i < toExit.size(); i++)
+        x86Emitter::patch(toExit[i], exitCode);
+
+    for (size_t i = 0; i < sideExits.size(); i++) {
+        x86Emitter::patch(sideExits[i].rel, e.p);
+        e.movi(RAX, sideExits[i].pc);
+        e.movi(RCX, sideExits[i].count);
+        x86Emitter::patch(e.jmp(), exitCode);
+    }
+
+    return entry;
+}
+
+/* Set the protection of the pages of the code buffer holding
+   [from, to).  */
+static void jitProtect(jitBuffer &jb, size_t from, size_t to, int prot)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    from &= ~(pageSize - 1);
+    to = (to + pageSize - 1) & ~(pageSize - 1);
+    if (to > jb.size)
+        to = jb.size;
+    if (from < to)
+        mprotect(jb.base + from, to - from, prot);
+}
+
+/* Forget all translations, so the code buffer can be reused.  The old
+   code is made inaccessible until it is overwritten.  */
+static void jitFlush(machine &mach)
+{
+    blockCache &bbc = mach.bbcache;
+    for (unordered_map<uint32_t, moxieBlock *>::iterator it = bbc.blocks.begin();
+         it != bbc.blocks.end(); ++it) {
+        it->second->native = NULL;
+        it->second->hits = 0;
+    }
+    jitProtect(mach.jit, 0, mach.jit.used, PROT_NONE);
+    mach.jit.used = 0;
+}
+
+/* The code buffer is never writable and executable at once: only the
+   pages a block is emitted into are made writable, and only while it is
+   translated.  Pages not yet used stay inaccessible.  */
+bool jitTranslate(machine &mach, moxieBlock *blk)
+{
+    jitBuffer &jb = mach.jit;
+    if (!jb.base) {
+        void *p = mmap(NULL, JIT_BUFFER_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+        jb.base = (uint8_t *) p;
+        jb.size = JIT_BUFFER_SIZE;
+        jb.used = 0;
+    }
+
+    if (jb.size - jb.used < JIT_BLOCK_MAX)
+        jitFlush(mach);
+
+    size_t start = jb.used;
+    jitProtect(jb, start, start + JIT_BLOCK_MAX, PROT_READ | PROT_WRITE);
+
+    jitTranslator tr(mach, blk, jb.base + jb.used);
+    if (tr.count > 0) {
+        blk->native = (jitCode) tr.translate();
+        blk->nativeInsns = tr.count;
+        jb.used = tr.end() - jb.base;
+    }
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t codeEnd = (jb.used + pageSize - 1) & ~(pageSize - 1);
+    jitProtect(jb, start, codeEnd, PROT_READ | PROT_EXEC);
+    jitProtect(jb, codeEnd, start + JIT_BLOCK_MAX, PROT_NONE);
+    return tr.count > 0;
+}
+
+#else
+
+bool jitTranslate(machine &mach, moxieBlock *blk)
+{
+    (void) mach;
+    (void) blk;
+    return false;
+}
+
+#endif // MOXIE_JIT
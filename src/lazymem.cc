@@ -0,0 +1,85 @@
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* Lazily mapped data files (--lazy-data).  The file mapping of a data
+   range starts out inaccessible, and the SIGSEGV handler opens each page
+   the first time it is read, guest or host side, so only those pages are
+   read from the file.  The pages opened are counted in lazyTouched.  */
+
+// the machine running on this thread, if it has lazy ranges
+static __thread machine *lazyCurrent;
+static size_t lazyPageSize;
+
+static void lazySegv(int sig, siginfo_t *si, void *ctx)
+{
+    machine *mach = lazyCurrent;
+    char *addr = (char *) si->si_addr;
+    (void) ctx;
+
+    for (unsigned int i = 0; mach && i < mach->memmap.size(); i++) {
+        addressRange *ar = mach->memmap[i];
+        if (!ar->lazy)
+            continue;
+
+        fileMapping *fm = ar->mapping.get();
+        char *base = (char *) fm->addr;
+        if (addr < base || addr >= base + fm->len)
+            continue;
+
+        char *page = addr - ((addr - base) & (lazyPageSize - 1));
+        if (mprotect(page, lazyPageSize, PROT_READ) == 0) {
+            mach->lazyTouched++;
+            return;
+        }
+
+        // out of kernel mappings for split ranges: open all of it
+        if (mprotect(base, fm->len, PROT_READ) == 0) {
+            ar->lazy = false;
+            return;
+        }
+        break;
+    }
+
+    // not a lazy page: crash as usual
+    signal(sig, SIG_DFL);
+}
+
+/* Make the file mapping of read-only range ar inaccessible, to be opened
+   page by page.  Returns false if ar stays as it is.  */
+bool machine::lazyMap(addressRange *ar)
+{
+    fileMapping *fm = ar->mapping.get();
+    if (!fm || !ar->readOnly)
+        return false;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = lazySegv;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL) < 0)
+        return false;
+
+    lazyPageSize = sysconf(_SC_PAGESIZE);
+
+    // read just the pages touched, not what follows them
+    madvise(fm->addr, fm->len, MADV_RANDOM);
+    if (mprotect(fm->addr, fm->len, PROT_NONE) < 0)
+        return false;
+
+    ar->lazy = true;
+    lazyPages += fm->len / lazyPageSize;
+    lazyCurrent = this;
+    return true;
+}
+
+void machine::lazyRelease()
+{
+    if (lazyCurrent == this)
+        lazyCurrent = NULL;
+}
@@ -1,23 +1,145 @@
 #include <algorithm>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "sandbox.h"
 
-void *machine::physaddr(uint32_t addr, size_t objLen, bool wantWrite)
+void pageTable::map(addressRange *ar)
 {
-    for (unsigned int i = 0; i < memmap.size(); i++) {
-        addressRange *mr = memmap[i];
-        if (mr->inRange(addr, objLen)) {
-            if (wantWrite && mr->readOnly)
-                return NULL;
-            return mr->physaddr(addr);
+    if (ar->end <= ar->start)
+        return;
+
+    uint32_t last = (ar->end - 1) >> MACH_PAGE_SHIFT;
+    for (uint32_t page = ar->start >> MACH_PAGE_SHIFT; page <= last; page++) {
+        struct pageEntry *&pt = dir[page >> PT_BITS];
+        if (!pt) {
+            pt = new pageEntry[PT_ENTRIES];
+            memset(pt, 0, sizeof(pageEntry) * PT_ENTRIES);
         }
+
+        struct pageEntry &pe = pt[page & (PT_ENTRIES - 1)];
+        if (pe.shared || pe.ar == ar)
+            continue;
+        if (pe.ar) {
+            pe.ar = NULL;
+            pe.shared = true;
+        } else
+            pe.ar = ar;
     }
+}
+
+void pageTable::clear()
+{
+    for (unsigned int i = 0; i < PT_ENTRIES; i++) {
+        delete[] dir[i];
+        dir[i] = NULL;
+    }
+}
+
+static bool startsAfter(uint32_t addr, const addressRange *ar)
+{
+    return addr < ar->start;
+}
+
+addressRange *machine::findRange(uint32_t addr, size_t objLen)
+{
+    const struct pageEntry *pe = pages.lookup(addr);
+    if (!pe)
+        return NULL;
+    if (pe->ar)
+        return pe->ar->inRange(addr, objLen) ? pe->ar : NULL;
+    if (!pe->shared)
+        return NULL;
+
+    // memmap is sorted and its ranges do not overlap: only the last one
+    // starting at or below addr can hold it
+    std::vector<addressRange *>::const_iterator it =
+        std::upper_bound(memmap.begin(), memmap.end(), addr, startsAfter);
+    if (it == memmap.begin())
+        return NULL;
 
-    return NULL;
+    addressRange *mr = *--it;
+    return mr->inRange(addr, objLen) ? mr : NULL;
+}
+
+/* TLB miss, or a store that needs the permission and code checks.  */
+void *machine::physaddrSlow(uint32_t addr, size_t objLen, bool wantWrite)
+{
+    addressRange *mr = findRange(addr, objLen);
+    if (!mr)
+        return NULL;
+
+    struct tlbEntry &te = tlb[(addr >> MACH_PAGE_SHIFT) & (TLB_SIZE - 1)];
+    te.ar = mr;
+    te.root = (char *) mr->root;
+    te.start = mr->start;
+    te.end = mr->end;
+    te.readOnly = mr->readOnly;
+
+    if (wantWrite) {
+        if (mr->readOnly)
+            return NULL;
+
+        // stores into decoded code must drop the stale translation
+        if (mr->hasCode)
+            bbcache.invalidate(addr, objLen);
+    }
+
+    return mr->physaddr(addr);
+}
+
+/* Host address of guest [addr, addr + len), for the host code that
+   works on guest buffers in place: NULL if the buffer is not within a
+   single range (or not writable, for wantWrite).  */
+void *machine::hostRange(uint32_t addr, uint32_t len, bool wantWrite)
+{
+    if ((uint64_t) addr + len > (1ULL << 32))
+        return NULL;
+    return physaddr(addr, len ? len : 1, wantWrite);
+}
+
+/* Flat mode: access base + addr directly.  Accesses that cross a page,
+   fall in a page only partly covered by a range, or fault are left to
+   the checked path.  */
+template <typename T>
+static inline bool flatRead(machine &mach, uint32_t addr, uint32_t &val_out)
+{
+    if ((addr & MACH_PAGE_MASK) > MACH_PAGE_SIZE - sizeof(T) ||
+        mach.flat.partial[addr >> MACH_PAGE_SHIFT])
+        return false;
+
+    T val = *(volatile T *) (mach.flat.base + addr);
+    if (mach.flat.fault) {
+        mach.flatRecover();
+        return false;
+    }
+
+    val_out = val;
+    return true;
+}
+
+template <typename T>
+static inline bool flatWrite(machine &mach, uint32_t addr, uint32_t val)
+{
+    if ((addr & MACH_PAGE_MASK) > MACH_PAGE_SIZE - sizeof(T) ||
+        mach.flat.partial[addr >> MACH_PAGE_SHIFT])
+        return false;
+
+    *(volatile T *) (mach.flat.base + addr) = (T) val;
+    if (mach.flat.fault) {
+        mach.flatRecover();
+        return false;
+    }
+
+    return true;
 }
 
 bool machine::read8(uint32_t addr, uint32_t &val_out)
 {
+    if (flat.base && flatRead<uint8_t>(*this, addr, val_out))
+        return true;
+
     uint8_t *paddr = (uint8_t *) physaddr(addr, 1);
     if (!paddr)
         return false;
@@ -28,6 +150,9 @@ bool machine::read8(uint32_t addr, uint32_t &val_out)
 
 bool machine::read16(uint32_t addr, uint32_t &val_out)
 {
+    if (flat.base && flatRead<uint16_t>(*this, addr, val_out))
+        return true;
+
     uint16_t *paddr = (uint16_t *) physaddr(addr, 2);
     if (!paddr)
         return false;
@@ -38,6 +163,9 @@ bool machine::read16(uint32_t addr, uint32_t &val_out)
 
 bool machine::read32(uint32_t addr, uint32_t &val_out)
 {
+    if (flat.base && flatRead<uint32_t>(*this, addr, val_out))
+        return true;
+
     uint32_t *paddr = (uint32_t *) physaddr(addr, 4);
     if (!paddr)
         return false;
@@ -48,6 +176,9 @@ bool machine::read32(uint32_t addr, uint32_t &val_out)
 
 bool machine::write8(uint32_t addr, uint32_t val)
 {
+    if (flat.base && flatWrite<uint8_t>(*this, addr, val))
+        return true;
+
     uint8_t *paddr = (uint8_t *) physaddr(addr, 1, true);
     if (!paddr)
         return false;
@@ -58,6 +189,9 @@ bool machine::write8(uint32_t addr, uint32_t val)
 
 bool machine::write16(uint32_t addr, uint32_t val)
 {
+    if (flat.base && flatWrite<uint16_t>(*this, addr, val))
+        return true;
+
     uint16_t *paddr = (uint16_t *) physaddr(addr, 2, true);
     if (!paddr)
         return false;
@@ -68,6 +202,9 @@ bool machine::write16(uint32_t addr, uint32_t val)
 
 bool machine::write32(uint32_t addr, uint32_t val)
 {
+    if (flat.base && flatWrite<uint32_t>(*this, addr, val))
+        return true;
+
     uint32_t *paddr = (uint32_t *) physaddr(addr, 4, true);
     if (!paddr)
         return false;
@@ -76,6 +213,75 @@ bool machine::write32(uint32_t addr, uint32_t val)
     return true;
 }
 
+/* Back the range with fileLen bytes of fd from offset, followed by
+   zeroes up to the range length, instead of copying them into buf.  */
+bool addressRange::mapFile(int fd, off_t offset, size_t fileLen)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t skip = offset & (pageSize - 1);
+    size_t len = (skip + length + pageSize - 1) & ~(pageSize - 1);
+    int prot = readOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+
+    if (fileLen > length)
+        fileLen = length;
+
+    std::shared_ptr<fileMapping> fm = std::make_shared<fileMapping>();
+    fm->addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fm->addr == MAP_FAILED) {
+        fm->addr = NULL;
+        return false;
+    }
+    fm->len = len;
+    fm->data = (char *) fm->addr + skip;
+
+    if (fileLen &&
+        mmap(fm->addr, skip + fileLen, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, offset - skip) == MAP_FAILED)
+        return false;
+
+    // the rest of the last file page holds whatever follows in the file
+    size_t fileEnd = skip + fileLen;
+    size_t tail = std::min(len, (fileEnd + pageSize - 1) & ~(pageSize - 1));
+    if (fileLen < length && fileEnd < tail)
+        memset((char *) fm->addr + fileEnd, 0, tail - fileEnd);
+
+    if (readOnly && mprotect(fm->addr, len, prot) < 0)
+        return false;
+
+    // kept to copy output from read-only ranges within the kernel, and to
+    // map writable ones afresh for each --serve job
+    fm->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    fm->offset = offset;
+    fm->fileLen = fileLen;
+
+    buf.clear();
+    mapping = fm;
+    updateRoot();
+    return true;
+}
+
+bool addressRange::mapAnonymous()
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t len = (length + pageSize - 1) & ~(pageSize - 1);
+
+    std::shared_ptr<fileMapping> fm = std::make_shared<fileMapping>();
+    fm->addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (fm->addr == MAP_FAILED) {
+        fm->addr = NULL;
+        return false;
+    }
+    fm->len = len;
+    fm->data = (char *) fm->addr;
+
+    buf.clear();
+    mapping = fm;
+    updateRoot();
+    return true;
+}
+
 static bool memmapCmp(addressRange *a, addressRange *b)
 {
     return (a->start < b->start);
@@ -84,6 +290,15 @@ static bool memmapCmp(addressRange *a, addressRange *b)
 void machine::sortMemMap()
 {
     std::sort(memmap.begin(), memmap.end(), memmapCmp);
+
+    pages.clear();
+    for (unsigned int i = 0; i < memmap.size(); i++)
+        pages.map(memmap[i]);
+    tlbFlush();
+
+    if (flat.base)
+        for (unsigned int i = 0; i < memmap.size(); i++)
+            flatMap(memmap[i]);
 }
 
 bool machine::mapInsert(addressRange *rdr)
@@ -92,10 +307,31 @@ bool machine::mapInsert(addressRange *rdr)
     rdr->start = ar->end + MACH_PAGE_SIZE;
     rdr->end = rdr->start + rdr->length;
     memmap.push_back(rdr);
+    pages.map(rdr);
+    tlbFlush();
+
+    if (flat.base)
+        flatMap(rdr);
 
     return true;
 }
 
+void machine::markCode(addressRange *ar, uint32_t addr, uint32_t len)
+{
+    ar->hasCode = true;
+
+    if (!flat.base)
+        return;
+
+    // direct stores must fault, so the checked path drops stale blocks
+    uint32_t last = (addr + len - 1) >> MACH_PAGE_SHIFT;
+    for (uint32_t page = addr >> MACH_PAGE_SHIFT; page <= last; page++)
+        if (!flat.code[page]) {
+            flat.code[page] = true;
+            flatProtect(page);
+        }
+}
+
 void machine::fillDescriptors(std::vector<struct mach_memmap_ent> &desc)
 {
     for (unsigned int i = 0; i < memmap.size(); i++) {
@@ -112,3 +348,183 @@ void machine::fillDescriptors(std::vector<struct mach_memmap_ent> &desc)
         desc.push_back(mme);
     }
 }
+
+/* Make ar a writable range of zeroes that takes no memory until it is
+   touched.  The flat space is zero already, so it needs no memory of
+   its own there.  */
+void allocZeroed(machine &mach, addressRange *ar)
+{
+    ar->readOnly = false;
+    if (!mach.flat.base && !ar->mapAnonymous())
+        ar->buf.resize(ar->length);
+    ar->updateRoot();
+}
+
+static bool loadRawFile(machine &mach, mfile &pf)
+{
+    char tmpstr[32];
+
+    // alloc new data memory range
+    sprintf(tmpstr, "data%u", mach.dataCount++);
+    size_t sz = pf.st.st_size;
+    addressRange *rdr = new addressRange(tmpstr, sz);
+
+    // map the file in place, or copy it if it cannot be mapped
+    if (!sz || !rdr->mapFile(pf.fd, 0, sz)) {
+        rdr->buf.assign((char *) pf.data, sz);
+        rdr->updateRoot();
+    } else if (mach.lazyData)
+        mach.lazyMap(rdr);
+
+    // add to global memory map
+    return mach.mapInsert(rdr);
+}
+
+bool loadRawData(machine &mach, const std::string &filename)
+{
+    // open and mmap input file
+    mfile pf(filename);
+    if (!pf.open(O_RDONLY))
+        return false;
+
+    return loadRawFile(mach, pf);
+}
+
+/* Load the data of an open file; fd is closed.  */
+bool loadRawDataFd(machine &mach, int fd)
+{
+    mfile pf;
+    if (!pf.attach(fd, O_RDONLY))
+        return false;
+
+    return loadRawFile(mach, pf);
+}
+
+void addStackMem(machine &mach)
+{
+    // alloc r/w memory range
+    addressRange *rdr = new addressRange("stack", mach.stackSize);
+    allocZeroed(mach, rdr);
+
+    // add memory range to global memory map
+    mach.mapInsert(rdr);
+
+    // set SR #7 to now-initialized stack vaddr
+    mach.cpu.asregs.sregs[7] = rdr->end;
+}
+
+void addMapDescriptor(machine &mach)
+{
+    // fill list from existing memory map
+    std::vector<struct mach_memmap_ent> desc;
+    mach.fillDescriptors(desc);
+
+    // add entry for the mapdesc range to be added to memory map
+    struct mach_memmap_ent mme_self;
+    memset(&mme_self, 0, sizeof(mme_self));
+    desc.push_back(mme_self);
+
+    // add blank entry for list terminator
+    struct mach_memmap_ent mme_end;
+    memset(&mme_end, 0, sizeof(mme_end));
+    desc.push_back(mme_end);
+
+    // calc total region size
+    size_t sz = sizeof(mme_end) * desc.size();
+
+    // manually fill in mapdesc range descriptor
+    mme_self.length = sz;
+    strcpy(mme_self.tags, "ro,mapdesc,");
+
+    // build entry for global memory map
+    addressRange *ar = new addressRange("mapdesc", sz);
+
+    // allocate space for descriptor array
+    ar->buf.resize(sz);
+    ar->updateRoot();
+
+    // copy 'desc' array into allocated memory space
+    unsigned int i = 0;
+    for (std::vector<struct mach_memmap_ent>::iterator it = desc.begin();
+         it != desc.end(); it++, i++) {
+        struct mach_memmap_ent &mme = (*it);
+        memcpy(&ar->buf[i * sizeof(mme)], &mme, sizeof(mme));
+    }
+
+    // add memory range to global memory map
+    mach.mapInsert(ar);
+
+    // set SR #6 to now-initialized mapdesc start vaddr
+    mach.cpu.asregs.sregs[6] = ar->start;
+}
+
+/* Write guest [addr, addr + length) to fd, avoiding copies through user
+   space where the kernel can: output that lies in a read-only range
+   mapped from a file is copied, or reflinked, into a regular file with
+   copy_file_range.  If the guest memory stays untouched until the
+   process exits (untilExit), output in a range mapped with mmap goes
+   into a pipe with vmsplice, which passes the pages by reference.
+   Anything else, or whatever the kernel refuses, is written.  Returns false with errno set on failure.  */
+bool writeGuestOutput(machine &mach,
+                      uint32_t addr,
+                      uint32_t length,
+                      int fd,
+                      bool untilExit)
+{
+    addressRange *ar = NULL;
+    if ((uint64_t) addr + length <= (1ULL << 32))
+        ar = mach.findRange(addr, length);
+    if (!ar) {
+        errno = EFAULT;
+        return false;
+    }
+
+    const char *p = (const char *) ar->physaddr(addr);
+    uint32_t done = 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return false;
+
+    // only read-only ranges still match their file
+    if (S_ISREG(st.st_mode) && ar->readOnly && ar->mapping &&
+        ar->mapping->fd >= 0 &&
+        addr - ar->start + (uint64_t) length <= ar->mapping->fileLen) {
+        loff_t off = ar->mapping->offset + (addr - ar->start);
+        while (done < length) {
+            ssize_t bytes = copy_file_range(ar->mapping->fd, &off, fd, NULL,
+                                            length - done, 0);
+            if (bytes <= 0)
+                break;  // the rest is written below
+            done += bytes;
+        }
+    }
+
+    // vmsplice and write do not open lazy pages
+    if (ar->lazy && done < length) {
+        for (uint32_t ofs = done; ofs < length; ofs += MACH_PAGE_SIZE)
+            (void) *(volatile const char *) (p + ofs);
+        (void) *(volatile const char *) (p + length - 1);
+    }
+
+    // pages from the heap outlive munmap in the pipe, but not free()
+    bool mapped = mach.flat.owns(ar) ||
+                  (ar->mapping && ar->root == ar->mapping->data);
+    if (S_ISFIFO(st.st_mode) && untilExit && mapped) {
+        while (done < length) {
+            struct iovec iov = {(void *) (p + done), length - done};
+            ssize_t bytes = vmsplice(fd, &iov, 1, 0);
+            if (bytes <= 0)
+                break;
+            done += bytes;
+        }
+    }
+
+    while (done < length) {
+        ssize_t bytes = write(fd, p + done, length - done);
+        if (bytes < 0)
+            return false;
+        done += bytes;
+    }
+
+    return true;
+}
@@ -0,0 +1,503 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "sandbox.h"
+
+using namespace std;
+
+/* A basic block of the program as sim_resume decodes it, and how many of
+   its instructions can be translated.  */
+struct aotBlock {
+    uint32_t end;
+    vector<struct moxie_insn> insns;
+    size_t count;
+};
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [-o <file.c>] <elf>\n"
+            "\n"
+            "Translate the code of a Moxie executable into C, to be built\n"
+            "as a shared object and loaded by sandbox --aot.\n",
+            progname);
+}
+
+static bool isCode(machine &mach, uint32_t addr, uint32_t len)
+{
+    addressRange *ar = mach.findRange(addr, len);
+    return ar && ar->readOnly && ar->executable;
+}
+
+/* Instructions that must run in sim_resume; a block is translated up to
+   the first of them.  */
+static bool translatable(uint8_t op)
+{
+    switch (op) {
+    case OP_BAD:
+    case OP_SWI:
+    case OP_SSR:
+    case OP_BRK:
+    case OP_ILL:
+    case OP_ILL3:
+    case OP_FETCHBUS:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static bool decodeBlock(machine &mach, uint32_t pc, aotBlock &blk)
+{
+    bool last = false;
+
+    blk.end = pc;
+    while (!last && blk.insns.size() < BB_MAX_INSNS) {
+        struct moxie_insn ins;
+        last = sim_decode(mach, blk.end, ins);
+        blk.insns.push_back(ins);
+        blk.end += ins.len;
+    }
+
+    blk.count = 0;
+    while (blk.count < blk.insns.size() &&
+           translatable(blk.insns[blk.count].op))
+        blk.count++;
+
+    return isCode(mach, pc, blk.end - pc);
+}
+
+/* Find the blocks reachable from the entry point, and those that follow
+   each block in memory, which covers functions only called indirectly.  */
+static void findBlocks(machine &mach, map<uint32_t, aotBlock> &blocks)
+{
+    vector<uint32_t> todo;
+
+    todo.push_back(mach.startAddr);
+    for (unsigned int i = 0; i < mach.memmap.size(); i++) {
+        addressRange *ar = mach.memmap[i];
+        if (ar->readOnly && ar->executable)
+            todo.push_back(ar->start);
+    }
+
+    while (!todo.empty()) {
+        uint32_t pc = todo.back();
+        todo.pop_back();
+        if ((pc & 1) || blocks.count(pc) || !isCode(mach, pc, 2))
+            continue;
+
+        aotBlock &blk = blocks[pc];
+        if (!decodeBlock(mach, pc, blk)) {
+            blk.count = 0;
+            continue;
+        }
+
+        const struct moxie_insn &ins = blk.insns.back();
+        if ((ins.op >= OP_BEQ && ins.op <= OP_BLEU) || ins.op == OP_JSRA ||
+            ins.op == OP_JMPA)
+            todo.push_back(ins.imm);
+        todo.push_back(blk.end);
+    }
+}
+
+static const char prelude[] =
+    "#include <stdint.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <signal.h>\n"
+    "\n"
+    "struct moxie_regset {\n"
+    "    int32_t regs[18];\n"
+    "    int32_t sregs[256];\n"
+    "    int32_t cc;\n"
+    "    int32_t cca, ccb;\n"
+    "    int ccLazy;\n"
+    "    int exception;\n"
+    "    unsigned long long insts;\n"
+    "};\n"
+    "\n"
+    "struct aotContext {\n"
+    "    struct moxie_regset *regs;\n"
+    "    void *mach;\n"
+    "    const bool *modified;\n"
+    "    int (*read8)(void *mach, uint32_t addr, uint32_t *val);\n"
+    "    int (*read16)(void *mach, uint32_t addr, uint32_t *val);\n"
+    "    int (*read32)(void *mach, uint32_t addr, uint32_t *val);\n"
+    "    int (*write8)(void *mach, uint32_t addr, uint32_t val);\n"
+    "    int (*write16)(void *mach, uint32_t addr, uint32_t val);\n"
+    "    int (*write32)(void *mach, uint32_t addr, uint32_t val);\n"
+    "};\n"
+    "\n"
+    "struct aotEntry {\n"
+    "    uint32_t addr;\n"
+    "    uint32_t end;\n"
+    "    uint32_t insns;\n"
+    "    uint64_t (*code)(struct aotContext *ctx);\n"
+    "};\n"
+    "\n"
+    "#define LD(n)                                                  \\\n"
+    "    static inline uint32_t ld##n(struct aotContext *c, uint32_t a) \\\n"
+    "    {                                                          \\\n"
+    "        uint32_t v = 0;                                        \\\n"
+    "        if (!c->read##n(c->mach, a, &v))                       \\\n"
+    "            c->regs->exception = SIGBUS;                       \\\n"
+    "        return v;                                              \\\n"
+    "    }\n"
+    "#define ST(n)                                                  \\\n"
+    "    static inline void st##n(struct aotContext *c, uint32_t a, \\\n"
+    "                             uint32_t v)                       \\\n"
+    "    {                                                          \\\n"
+    "        if (!c->write##n(c->mach, a, v))                       \\\n"
+    "            c->regs->exception = SIGBUS;                       \\\n"
+    "    }\n"
+    "LD(8) LD(16) LD(32) ST(8) ST(16) ST(32)\n"
+    "\n"
+    "/* Leave the block after n instructions, to continue at pc.  */\n"
+    "#define EXIT(n, pc)       \\\n"
+    "    do {                  \\\n"
+    "        done = (n);       \\\n"
+    "        next = (pc);      \\\n"
+    "        goto out;         \\\n"
+    "    } while (0)\n"
+    "#define CHECK(n, pc)                      \\\n"
+    "    if (r->exception || *c->modified)     \\\n"
+    "    EXIT(n, pc)\n"
+    "\n"
+    "/* The call frame of jsra and jsr.  */\n"
+    "#define PUSH_FRAME(ret)             \\\n"
+    "    do {                            \\\n"
+    "        uint32_t sp_ = g1 - 8;      \\\n"
+    "        st32(c, sp_, (ret));        \\\n"
+    "        sp_ -= 4;                   \\\n"
+    "        st32(c, sp_, g0);           \\\n"
+    "        g1 = g0 = sp_;              \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define S(x) ((int32_t) (x))\n";
+
+/* C condition of a Form 3 branch on the operands of the last cmp, and
+   the condition codes it tests when cc was set otherwise.  */
+static const char *const branchConds[10][2] = {
+    {"ca == cb", "CC_EQ"},
+    {"ca != cb", "~CC_EQ"},
+    {"S(ca) < S(cb)", "CC_LT"},
+    {"S(ca) > S(cb)", "CC_GT"},
+    {"ca < cb", "CC_LTU"},
+    {"ca > cb", "CC_GTU"},
+    {"S(ca) >= S(cb)", "CC_GT | CC_EQ"},
+    {"S(ca) <= S(cb)", "CC_LT | CC_EQ"},
+    {"ca >= cb", "CC_GTU | CC_EQ"},
+    {"ca <= cb", "CC_LTU | CC_EQ"},
+};
+
+/* Emit one instruction.  n is the number retired once it completes.
+   Returns true if it leaves the block.  */
+static bool emitInsn(FILE *f,
+                     const struct moxie_insn &ins,
+                     uint32_t pc,
+                     size_t n,
+                     uint16_t &used)
+{
+    unsigned a = ins.a, b = ins.b;
+    uint32_t npc = pc + ins.len;
+    uint32_t imm = ins.imm;
+
+    used |= (1 << a) | (1 << b);
+    fprintf(f, "    /* %08x */\n", pc);
+
+    switch (ins.op) {
+    case OP_LDI_L:
+    case OP_LDI_B:
+    case OP_LDI_S:
+        fprintf(f, "    g%u = 0x%xu;\n", a, imm);
+        break;
+    case OP_MOV:
+        fprintf(f, "    g%u = g%u;\n", a, b);
+        break;
+    case OP_JSRA:
+        fprintf(f, "    PUSH_FRAME(0x%xu);\n", npc);
+        fprintf(f, "    EXIT(%zu, 0x%xu);\n", n, imm);
+        used |= 3;
+        return true;
+    case OP_JSR:
+        fprintf(f, "    { uint32_t fn = g%u;\n", a);
+        fprintf(f, "      PUSH_FRAME(0x%xu);\n", npc);
+        fprintf(f, "      EXIT(%zu, fn); }\n", n);
+        used |= 3;
+        return true;
+    case OP_RET:
+        fprintf(f, "    { uint32_t sp = g0, to;\n");
+        fprintf(f, "      g0 = ld32(c, sp);\n");
+        fprintf(f, "      to = ld32(c, sp + 4);\n");
+        fprintf(f, "      g1 = sp + 12;\n");
+        fprintf(f, "      EXIT(%zu, to); }\n", n);
+        used |= 3;
+        return true;
+    case OP_JMPA:
+        fprintf(f, "    EXIT(%zu, 0x%xu);\n", n, imm);
+        return true;
+    case OP_JMP:
+        fprintf(f, "    EXIT(%zu, g%u);\n", n, a);
+        return true;
+    case OP_PUSH:
+        fprintf(f, "    { uint32_t sp = g%u - 4;\n", a);
+        fprintf(f, "      st32(c, sp, g%u);\n", b);
+        fprintf(f, "      g%u = sp; }\n", a);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_POP:
+        fprintf(f, "    { uint32_t sp = g%u;\n", a);
+        fprintf(f, "      g%u = ld32(c, sp);\n", b);
+        fprintf(f, "      g%u = sp + 4; }\n", a);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_LDA_L:
+    case OP_LDA_S:
+    case OP_LDA_B:
+        fprintf(f, "    g%u = ld%d(c, 0x%xu);\n", a,
+                ins.op == OP_LDA_L ? 32 : ins.op == OP_LDA_S ? 16 : 8, imm);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_STA_L:
+    case OP_STA_S:
+    case OP_STA_B:
+        fprintf(f, "    st%d(c, 0x%xu, g%u);\n",
+                ins.op == OP_STA_L ? 32 : ins.op == OP_STA_S ? 16 : 8, imm,
+                a);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_LD_L:
+    case OP_LD_S:
+    case OP_LD_B:
+        fprintf(f, "    g%u = ld%d(c, g%u);\n", a,
+                ins.op == OP_LD_L ? 32 : ins.op == OP_LD_S ? 16 : 8, b);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_ST_L:
+    case OP_ST_S:
+    case OP_ST_B:
+        fprintf(f, "    st%d(c, g%u, g%u);\n",
+                ins.op == OP_ST_L ? 32 : ins.op == OP_ST_S ? 16 : 8, a, b);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_LDO_L:
+    case OP_LDO_S:
+    case OP_LDO_B:
+        fprintf(f, "    g%u = ld%d(c, g%u + 0x%xu);\n", a,
+                ins.op == OP_LDO_L ? 32 : ins.op == OP_LDO_S ? 16 : 8, b,
+                imm);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_STO_L:
+    case OP_STO_S:
+    case OP_STO_B:
+        fprintf(f, "    st%d(c, g%u + 0x%xu, g%u);\n",
+                ins.op == OP_STO_L ? 32 : ins.op == OP_STO_S ? 16 : 8, a,
+                imm, b);
+        fprintf(f, "    CHECK(%zu, 0x%xu);\n", n, npc);
+        break;
+    case OP_CMP:
+        fprintf(f, "    ca = g%u; cb = g%u; lazy = 1;\n", a, b);
+        break;
+    case OP_NOP:
+        break;
+    case OP_SEX_B:
+        fprintf(f, "    g%u = (uint32_t) (int8_t) g%u;\n", a, b);
+        break;
+    case OP_SEX_S:
+        fprintf(f, "    g%u = (uint32_t) (int16_t) g%u;\n", a, b);
+        break;
+    case OP_ZEX_B:
+        fprintf(f, "    g%u = g%u & 0xff;\n", a, b);
+        break;
+    case OP_ZEX_S:
+        fprintf(f, "    g%u = g%u & 0xffff;\n", a, b);
+        break;
+    case OP_UMUL_X:
+    case OP_MUL_X: /* both operands are zero-extended, as in sim_resume */
+        fprintf(f, "    g%u = ((uint64_t) g%u * g%u) >> 32;\n", a, a, b);
+        break;
+    case OP_ADD:
+        fprintf(f, "    g%u += g%u;\n", a, b);
+        break;
+    case OP_SUB:
+        fprintf(f, "    g%u -= g%u;\n", a, b);
+        break;
+    case OP_MUL:
+        fprintf(f, "    g%u *= g%u;\n", a, b);
+        break;
+    case OP_AND:
+        fprintf(f, "    g%u &= g%u;\n", a, b);
+        break;
+    case OP_OR:
+        fprintf(f, "    g%u |= g%u;\n", a, b);
+        break;
+    case OP_XOR:
+        fprintf(f, "    g%u ^= g%u;\n", a, b);
+        break;
+    case OP_NEG:
+        fprintf(f, "    g%u = -g%u;\n", a, b);
+        break;
+    case OP_NOT:
+        fprintf(f, "    g%u = ~g%u;\n", a, b);
+        break;
+    /* Shift counts wrap as on the x86 hosts sim_resume runs on.  */
+    case OP_LSHR:
+        fprintf(f, "    g%u >>= g%u & 31;\n", a, b);
+        break;
+    case OP_ASHL:
+        fprintf(f, "    g%u <<= g%u & 31;\n", a, b);
+        break;
+    case OP_ASHR:
+        fprintf(f, "    g%u = S(g%u) >> (g%u & 31);\n", a, a, b);
+        break;
+    case OP_DIV:
+        fprintf(f, "    g%u = S(g%u) / S(g%u);\n", a, a, b);
+        break;
+    case OP_MOD:
+        fprintf(f, "    g%u = S(g%u) %% S(g%u);\n", a, a, b);
+        break;
+    case OP_UDIV:
+        fprintf(f, "    g%u /= g%u;\n", a, b);
+        break;
+    case OP_UMOD:
+        fprintf(f, "    g%u %%= g%u;\n", a, b);
+        break;
+    case OP_INC:
+        fprintf(f, "    g%u += 0x%xu;\n", a, imm);
+        break;
+    case OP_DEC:
+        fprintf(f, "    g%u -= 0x%xu;\n", a, imm);
+        break;
+    case OP_GSR:
+        fprintf(f, "    g%u = r->sregs[%u];\n", a, imm);
+        break;
+    default: { /* Form 3 branches */
+        const char *const *cond = branchConds[ins.op - OP_BEQ];
+        fprintf(f, "    if (lazy ? %s : (r->cc & (%s)))\n", cond[0], cond[1]);
+        fprintf(f, "        EXIT(%zu, 0x%xu);\n", n, imm);
+        fprintf(f, "    EXIT(%zu, 0x%xu);\n", n, npc);
+        return true;
+    }
+    }
+
+    return false;
+}
+
+static void emitBlock(FILE *f, uint32_t addr, const aotBlock &blk)
+{
+    /* Guest registers live in locals, loaded on entry and stored on
+       exit, so the host compiler can keep them in host registers.  */
+    char *body;
+    size_t bodySize;
+    FILE *bf = open_memstream(&body, &bodySize);
+    uint16_t used = 0;
+    uint32_t pc = addr;
+    bool exited = false;
+
+    for (size_t i = 0; i < blk.count && !exited; i++) {
+        exited = emitInsn(bf, blk.insns[i], pc, i + 1, used);
+        pc += blk.insns[i].len;
+    }
+    if (!exited)
+        fprintf(bf, "    EXIT(%zu, 0x%xu);\n", blk.count, pc);
+    fclose(bf);
+
+    fprintf(f, "\nstatic uint64_t b_%08x(struct aotContext *c)\n{\n", addr);
+    fprintf(f, "    struct moxie_regset *r = c->regs;\n");
+    fprintf(f, "    uint32_t done, next;\n");
+    fprintf(f, "    uint32_t ca = r->cca, cb = r->ccb;\n");
+    fprintf(f, "    int lazy = r->ccLazy;\n");
+    for (unsigned i = 0; i < 16; i++)
+        if (used & (1 << i))
+            fprintf(f, "    uint32_t g%u = r->regs[%u];\n", i, i);
+    fputs(body, f);
+    free(body);
+    fprintf(f, "out:\n");
+    for (unsigned i = 0; i < 16; i++)
+        if (used & (1 << i))
+            fprintf(f, "    r->regs[%u] = g%u;\n", i, i);
+    fprintf(f, "    r->cca = ca;\n    r->ccb = cb;\n    r->ccLazy = lazy;\n");
+    fprintf(f, "    return (uint64_t) done << 32 | next;\n}\n");
+}
+
+static void emitProgram(FILE *f,
+                        const string &hash,
+                        const map<uint32_t, aotBlock> &blocks)
+{
+    size_t count = 0;
+
+    fprintf(f, "/* Generated by moxie-aot.  */\n");
+    fputs(prelude, f);
+    fprintf(f, "\nenum { CC_GT = %d, CC_LT = %d, CC_EQ = %d, CC_GTU = %d, "
+               "CC_LTU = %d };\n",
+            CC_GT, CC_LT, CC_EQ, CC_GTU, CC_LTU);
+
+    map<uint32_t, aotBlock>::const_iterator it;
+    for (it = blocks.begin(); it != blocks.end(); it++)
+        if (it->second.count) {
+            emitBlock(f, it->first, it->second);
+            count++;
+        }
+
+    fprintf(f, "\nconst unsigned moxie_aot_abi = %d;\n", AOT_ABI_VERSION);
+    fprintf(f, "const unsigned moxie_aot_regset_size = "
+               "sizeof(struct moxie_regset);\n");
+    fprintf(f, "const char moxie_aot_hash[] = \"%s\";\n", hash.c_str());
+    fprintf(f, "const unsigned moxie_aot_count = %zu;\n", count);
+    fprintf(f, "const struct aotEntry moxie_aot_blocks[] = {\n");
+    for (it = blocks.begin(); it != blocks.end(); it++)
+        if (it->second.count)
+            fprintf(f, "    {0x%08x, 0x%08x, %zu, b_%08x},\n", it->first,
+                    it->second.end, it->second.count, it->first);
+    fprintf(f, "    {0, 0, 0, 0},\n};\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outFilename = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            outFilename = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *filename = argv[optind];
+    machine mach;
+    string hash;
+    if (!loadElfProgram(mach, filename) || !sha256File(filename, hash)) {
+        fprintf(stderr, "ELF load failed for %s\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    map<uint32_t, aotBlock> blocks;
+    findBlocks(mach, blocks);
+
+    FILE *f = stdout;
+    if (outFilename && !(f = fopen(outFilename, "w"))) {
+        perror(outFilename);
+        return EXIT_FAILURE;
+    }
+    emitProgram(f, hash, blocks);
+    if (fclose(f) != 0) {
+        perror(outFilename ? outFilename : "stdout");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%s\n", hash.c_str());
+    return EXIT_SUCCESS;
+}
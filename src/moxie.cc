@@ -14,35 +14,11 @@
 
 #define INLINE inline
 
-static FILE *tracefile = stderr;
-
 /* Extract the signed 10-bit offset from a 16-bit branch
    instruction.  */
 #define INST2OFFSET(o) \
     ((((signed short) ((o & ((1 << 10) - 1)) << 6)) >> 6) << 1)
 
-#define EXTRACT_WORD(addr) extract_word32(mach, addr)
-#define EXTRACT_WORD16(addr) extract_word16(mach, addr)
-#define EXTRACT_OFFSET(addr) (((int32_t) EXTRACT_WORD16(addr) << 16) >> 16)
-
-static inline uint16_t extract_word16(machine &mach, uint32_t addr)
-{
-    uint32_t ret;
-    if (!mach.read16(addr, ret))
-        mach.cpu.asregs.exception = SIGBUS;
-
-    uint16_t ret16 = (uint16_t) ret;
-    return le16toh(ret16);
-}
-
-static inline uint32_t extract_word32(machine &mach, uint32_t addr)
-{
-    uint32_t ret;
-    if (!mach.read32(addr, ret))
-        mach.cpu.asregs.exception = SIGBUS;
-    return le32toh(ret);
-}
-
 /* Write a 1 byte value to memory.  */
 
 static void INLINE wbat(machine &mach, word addr, word v)
@@ -71,7 +47,7 @@ static void INLINE wlat(machine &mach, word addr, word v)
 
 static int INLINE rsat(machine &mach, word addr)
 {
-    uint32_t ret;
+    uint32_t ret = 0;
     if (!mach.read16(addr, ret))
         mach.cpu.asregs.exception = SIGBUS;
     return (int32_t) ret;
@@ -81,7 +57,7 @@ static int INLINE rsat(machine &mach, word addr)
 
 static int INLINE rbat(machine &mach, word addr)
 {
-    uint32_t ret;
+    uint32_t ret = 0;
     if (!mach.read8(addr, ret))
         mach.cpu.asregs.exception = SIGBUS;
     return (int32_t) ret;
@@ -91,16 +67,117 @@ static int INLINE rbat(machine &mach, word addr)
 
 static int INLINE rlat(machine &mach, word addr)
 {
-    uint32_t ret;
+    uint32_t ret = 0;
     if (!mach.read32(addr, ret))
         mach.cpu.asregs.exception = SIGBUS;
     return (int32_t) ret;
 }
 
-#if 0
+/* Condition codes set by cmp.  */
+
+static int INLINE compare(int va, int vb)
+{
+    int cc = 0;
+
+    if (va == vb)
+        cc = CC_EQ;
+    else {
+        cc |= (va < vb ? CC_LT : 0);
+        cc |= (va > vb ? CC_GT : 0);
+        cc |= ((unsigned int) va < (unsigned int) vb ? CC_LTU : 0);
+        cc |= ((unsigned int) va > (unsigned int) vb ? CC_GTU : 0);
+    }
+
+    return cc;
+}
+
+/* Condition codes tested by the Form 3 branches.  */
+
+static const word branch_flags[10] = {
+    CC_EQ,         ~CC_EQ,        CC_LT,
+    CC_GT,         CC_LTU,        CC_GTU,
+    CC_GT | CC_EQ, CC_LT | CC_EQ, CC_GTU | CC_EQ,
+    CC_LTU | CC_EQ};
+
+/* Whether a branch is taken after a cmp of va and vb.  cmp only records
+   its operands, and each branch computes just the flags it tests.  */
+
+static bool INLINE branch_cond(int op, word va, word vb)
+{
+    switch (op) {
+    case OP_BEQ:
+        return va == vb;
+    case OP_BNE:
+        return va != vb;
+    case OP_BLT:
+        return va < vb;
+    case OP_BGT:
+        return va > vb;
+    case OP_BLTU:
+        return (uword) va < (uword) vb;
+    case OP_BGTU:
+        return (uword) va > (uword) vb;
+    case OP_BGE:
+        return va >= vb;
+    case OP_BLE:
+        return va <= vb;
+    case OP_BGEU:
+        return (uword) va >= (uword) vb;
+    default: /* OP_BLEU */
+        return (uword) va <= (uword) vb;
+    }
+}
+
+/* Push register b on the stack addressed by register a.  */
+
+static void INLINE push_reg(machine &mach, int a, int b)
+{
+    int sp = mach.cpu.asregs.regs[a] - 4;
+
+    wlat(mach, sp, mach.cpu.asregs.regs[b]);
+    mach.cpu.asregs.regs[a] = sp;
+}
+
+/* Build the call frame of jsra and jsr.  */
+
+static void INLINE push_frame(machine &mach, word retaddr)
+{
+    cpuState &cpu = mach.cpu;
+    unsigned int sp = cpu.asregs.regs[1];
+
+    /* Save a slot for the static chain.  */
+    sp -= 4;
+
+    /* Push the return address.  */
+    sp -= 4;
+    wlat(mach, sp, retaddr);
+
+    /* Push the current frame pointer.  */
+    sp -= 4;
+    wlat(mach, sp, cpu.asregs.regs[0]);
+
+    /* Uncache the stack pointer and set $fp.  */
+    cpu.asregs.regs[1] = sp;
+    cpu.asregs.regs[0] = sp;
+}
+
+/* Instrumentation compiled into an instance of run_blocks.  sim_resume
+   picks the instance once per call, so plain runs never test for it.  */
+enum {
+    POLICY_BUDGET = 1 << 0,  /* stop at the instruction budget */
+    POLICY_TRACE = 1 << 1,   /* print every instruction (-t) */
+    POLICY_PROFILE = 1 << 2, /* count taken branches for gprof (-p) */
+    POLICY_STEP = 1 << 3,    /* stop with SIGTRAP after one instruction */
+    POLICY_FUSIONS = 1 << 4, /* count superinstructions (--fusion-report) */
+    POLICY_COUNT = 1 << 5,
+
+    /* Instrumented runs always use the switch core.  */
+    POLICY_INSTRUMENT = POLICY_TRACE | POLICY_PROFILE | POLICY_STEP,
+};
+
 #define TRACE(str)                                                             \
-    if (mach.tracing)                                                          \
-        fprintf(tracefile,                                                     \
+    if (policy & POLICY_TRACE)                                                 \
+        fprintf(mach.tracefile,                                                \
                 "0x%08x, %s, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, " \
                 "0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x\n",            \
                 opc, str, cpu.asregs.regs[0], cpu.asregs.regs[1],              \
@@ -109,9 +186,6 @@ static int INLINE rlat(machine &mach, word addr)
                 cpu.asregs.regs[8], cpu.asregs.regs[9], cpu.asregs.regs[10],   \
                 cpu.asregs.regs[11], cpu.asregs.regs[12], cpu.asregs.regs[13], \
                 cpu.asregs.regs[14], cpu.asregs.regs[15]);
-#else
-#define TRACE(str)
-#endif
 
 static void sim_mmap(machine &mach)
 {
@@ -136,14 +210,11 @@ static void sim_mmap(machine &mach)
         return;
     }
 
-    static unsigned int heapCount = 0;
     char tmpstr[32];
 
-    sprintf(tmpstr, "heap%u", heapCount++);
+    sprintf(tmpstr, "heap%u", mach.heapCount++);
     addressRange *rdr = new addressRange(tmpstr, length);
-    rdr->buf.resize(length);
-    rdr->updateRoot();
-    rdr->readOnly = false;
+    allocZeroed(mach, rdr);
 
     if (!mach.mapInsert(rdr)) {
         delete rdr;
@@ -154,722 +225,1377 @@ static void sim_mmap(machine &mach)
     }
 }
 
-int sim_resume(machine &mach, unsigned long long cpu_budget)
+/* Instructions charged for a SHA-256 system call, plus per 64-byte
+   block it compresses, whatever the host hashes with.  */
+enum {
+    SHA256_CALL_COST = 8,
+    SHA256_BLOCK_COST = 64,
+};
+
+/* SYS_sha256_init, _update and _final on the sha256_context at $r0, with
+   the effect runtime/sha256.c has on it.  Returns the instructions
+   charged, or ~0ULL without running the call if they exceed left.  A
+   context, data or digest outside a single range raises SIGBUS.  */
+static unsigned long long sim_sha256(machine &mach,
+                                     unsigned inum,
+                                     unsigned long long left)
+{
+    cpuState &cpu = mach.cpu;
+    struct sha256GuestCtx ctx;
+
+    uint32_t ctxAddr = cpu.asregs.regs[2];
+    uint32_t addr = cpu.asregs.regs[3];
+    uint32_t len = cpu.asregs.regs[4];
+    unsigned long long cost = SHA256_CALL_COST;
+    const unsigned char *data = NULL;
+    unsigned char *digest = NULL;
+
+    // the guest ignores a NULL context, or NULL data to hash
+    if (!ctxAddr || (inum == 0x101 && !addr))
+        return cost <= left ? cost : ~0ULL;
+
+    void *pctx = mach.hostRange(ctxAddr, sizeof(ctx), true);
+    if (!pctx) {
+        cpu.asregs.exception = SIGBUS;
+        return 0;
+    }
+    memcpy(&ctx, pctx, sizeof(ctx));
+
+    if (inum != 0x100 && le32toh(ctx.len) >= sizeof(ctx.buf)) {
+        cpu.asregs.exception = SIGBUS;
+        return 0;
+    }
+
+    if (inum == 0x101 && len) {
+        data = (const unsigned char *) mach.hostRange(addr, len);
+        if (!data) {
+            cpu.asregs.exception = SIGBUS;
+            return 0;
+        }
+        cost += SHA256_BLOCK_COST * ((le32toh(ctx.len) + (uint64_t) len) /
+                                     sizeof(ctx.buf));
+    } else if (inum == 0x102) {
+        if (addr && !(digest = (unsigned char *) mach.hostRange(
+                          addr, SHA256_SIZE, true))) {
+            cpu.asregs.exception = SIGBUS;
+            return 0;
+        }
+        cost += SHA256_BLOCK_COST * (le32toh(ctx.len) > 55 ? 2 : 1);
+    }
+
+    if (cost > left)
+        return ~0ULL;
+
+    unsigned char hash[SHA256_SIZE];
+    switch (inum) {
+    case 0x100:
+        sha256GuestInit(&ctx);
+        break;
+    case 0x101:
+        sha256GuestUpdate(&ctx, data, len);
+        break;
+    case 0x102:
+        sha256GuestFinal(&ctx, hash);
+        break;
+    }
+
+    // the stores may have replaced decoded code
+    memcpy(mach.hostRange(ctxAddr, sizeof(ctx), true), &ctx, sizeof(ctx));
+    if (digest)
+        memcpy(mach.hostRange(addr, SHA256_SIZE, true), hash, SHA256_SIZE);
+    return cost;
+}
+
+/* Instructions charged for a bulk memory system call, plus one per
+   BULK_BYTES_PER_INSN bytes of its length.  */
+enum {
+    BULK_CALL_COST = 8,
+    BULK_BYTES_PER_INSN = 16,
+};
+
+/* SYS_bulk_copy, _fill, _compare and _move on $r0-$r2, as memcpy,
+   memset, memcmp and memmove: $r0 gets the destination, or for compare
+   the difference of the first unequal bytes.  Returns the instructions
+   charged, or ~0ULL without running the call if they exceed left.  An
+   operand outside a single range raises SIGBUS before anything is
+   stored.  */
+static unsigned long long sim_bulk(machine &mach,
+                                   unsigned inum,
+                                   unsigned long long left)
+{
+    cpuState &cpu = mach.cpu;
+
+    uint32_t a0 = cpu.asregs.regs[2];
+    uint32_t a1 = cpu.asregs.regs[3];
+    uint32_t len = cpu.asregs.regs[4];
+    unsigned long long cost = BULK_CALL_COST + len / BULK_BYTES_PER_INSN;
+    const char *src = NULL;
+    char *dst = NULL;
+
+    if (len) {
+        bool ok;
+        switch (inum) {
+        case 0x111: /* SYS_bulk_fill */
+            ok = (dst = (char *) mach.hostRange(a0, len, true));
+            break;
+        case 0x112: /* SYS_bulk_compare */
+            ok = (src = (const char *) mach.hostRange(a1, len)) &&
+                 (dst = (char *) mach.hostRange(a0, len));
+            break;
+        default:
+            ok = (src = (const char *) mach.hostRange(a1, len)) &&
+                 (dst = (char *) mach.hostRange(a0, len, true));
+            break;
+        }
+        if (!ok) {
+            cpu.asregs.exception = SIGBUS;
+            return 0;
+        }
+    }
+
+    if (cost > left)
+        return ~0ULL;
+
+    uint32_t ret = a0;
+    if (len) {
+        switch (inum) {
+        case 0x110: /* SYS_bulk_copy */
+        case 0x113: /* SYS_bulk_move */
+            memmove(dst, src, len);
+            break;
+        case 0x111: /* SYS_bulk_fill */
+            memset(dst, a1, len);
+            break;
+        case 0x112: /* SYS_bulk_compare */
+            ret = 0;
+            if (memcmp(dst, src, len)) {
+                uint32_t i = 0;
+                while (dst[i] == src[i])
+                    i++;
+                ret = (unsigned char) dst[i] - (unsigned char) src[i];
+            }
+            break;
+        }
+    } else if (inum == 0x112)
+        ret = 0;
+
+    cpu.asregs.regs[2] = ret;
+    return cost;
+}
+
+/* Every first instruction word predecoded at compile time: the handler
+   id, the register fields and where the immediate comes from.  */
+
+enum {
+    DECODE_NONE,     /* no immediate */
+    DECODE_FORM2,    /* low 8 bits of the instruction word */
+    DECODE_BRANCH,   /* Form 3 branch target */
+    DECODE_OFFSET16, /* signed 16-bit word that follows */
+    DECODE_IMM32,    /* 32-bit word that follows */
+    DECODE_ENDS = 0x80, /* ends a basic block */
+};
+
+struct moxie_decoding {
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t imm; /* DECODE_*, maybe with DECODE_ENDS */
+};
+
+static constexpr moxie_decoding decode_word(unsigned inst)
+{
+    if (inst & (1 << 15)) {
+        if (inst & (1 << 14)) {
+            /* This is a Form 3 instruction.  */
+            unsigned opcode = inst >> 10 & 0xf;
+            if (opcode < 10)
+                return {uint8_t(OP_BEQ + opcode), 0, 0,
+                        DECODE_BRANCH | DECODE_ENDS};
+            return {OP_ILL3, 0, 0, DECODE_NONE | DECODE_ENDS};
+        }
+
+        /* This is a Form 2 instruction.  */
+        return {uint8_t(OP_INC + (inst >> 12 & 0x3)), uint8_t(inst >> 8 & 0xf),
+                0, DECODE_FORM2};
+    }
+
+    /* This is a Form 1 instruction.  */
+    unsigned opcode = inst >> 8;
+    uint8_t a = inst >> 4 & 0xf;
+    uint8_t b = inst & 0xf;
+
+    switch (opcode) {
+    case OP_LDI_L:
+    case OP_LDA_L:
+    case OP_STA_L:
+    case OP_LDI_B:
+    case OP_LDA_B:
+    case OP_STA_B:
+    case OP_LDI_S:
+    case OP_LDA_S:
+    case OP_STA_S:
+        return {uint8_t(opcode), a, b, DECODE_IMM32};
+
+    case OP_JSRA:
+    case OP_JMPA:
+    case OP_SWI:
+        return {uint8_t(opcode), a, b, DECODE_IMM32 | DECODE_ENDS};
+
+    case OP_LDO_L:
+    case OP_STO_L:
+    case OP_LDO_B:
+    case OP_STO_B:
+    case OP_LDO_S:
+    case OP_STO_S:
+        return {uint8_t(opcode), a, b, DECODE_OFFSET16};
+
+    case OP_RET:
+    case OP_JSR:
+    case OP_JMP:
+    case OP_BRK:
+        return {uint8_t(opcode), a, b, DECODE_NONE | DECODE_ENDS};
+
+    case OP_BAD:
+    case 0x16:
+    case 0x17:
+    case 0x18:
+        return {OP_ILL, a, b, DECODE_NONE | DECODE_ENDS};
+
+    default:
+        if (opcode > OP_STO_S)
+            return {OP_ILL, a, b, DECODE_NONE | DECODE_ENDS};
+        return {uint8_t(opcode), a, b, DECODE_NONE};
+    }
+}
+
+struct decodeTable {
+    moxie_decoding word[1 << 16];
+};
+
+static constexpr decodeTable make_decode_table()
+{
+    decodeTable t = {};
+    for (unsigned inst = 0; inst < (1 << 16); inst++)
+        t.word[inst] = decode_word(inst);
+    return t;
+}
+
+static constexpr decodeTable decode_table = make_decode_table();
+
+/* Decode the instruction at pc.  Returns true if it ends a basic
+   block.  */
+static bool decode_insn(machine &mach, uint32_t pc, struct moxie_insn &ins)
+{
+    ins.a = 0;
+    ins.b = 0;
+    ins.len = 2;
+    ins.imm = 0;
+
+    uint32_t val;
+    if (!mach.read16(pc, val)) {
+        ins.op = OP_FETCHBUS;
+        return true;
+    }
+    unsigned short inst = le16toh((uint16_t) val);
+
+    const moxie_decoding &d = decode_table.word[inst];
+    ins.op = d.op;
+    ins.a = d.a;
+    ins.b = d.b;
+
+    switch (d.imm & ~DECODE_ENDS) {
+    case DECODE_FORM2:
+        ins.imm = inst & 0xff;
+        break;
+
+    case DECODE_BRANCH:
+        ins.imm = pc + INST2OFFSET(inst) + 2;
+        break;
+
+    case DECODE_OFFSET16:
+        ins.len = 4;
+        if (!mach.read16(pc + 2, val))
+            goto fetchbus;
+        ins.imm = (int16_t) le16toh((uint16_t) val);
+        break;
+
+    case DECODE_IMM32:
+        ins.len = 6;
+        if (!mach.read32(pc + 2, val))
+            goto fetchbus;
+        ins.imm = le32toh(val);
+        break;
+    }
+
+    return d.imm & DECODE_ENDS;
+
+fetchbus:
+    /* The immediate operand could not be fetched.  */
+    ins.op = OP_FETCHBUS;
+    return true;
+}
+
+static bool is_branch(uint8_t op)
+{
+    return op >= OP_BEQ && op <= OP_BLEU;
+}
+
+/* Fuse common instruction sequences of a block into superinstructions.
+   Only the first instruction of a sequence changes its handler id; the
+   fused handler executes the ones after it from their own decoding.  A
+   cmp fused with its branch keeps the branch test in its immediate, so
+   the handler needs no dispatch on the branch opcode.  */
+static void fuse_block(moxieBlock *blk)
+{
+    std::vector<struct moxie_insn> &v = blk->insns;
+
+    for (size_t i = 0; i + 1 < v.size();) {
+        struct moxie_insn &x = v[i];
+        const struct moxie_insn &y = v[i + 1];
+        size_t n = 2;
+
+        if (x.op == OP_LDI_L && y.op == OP_CMP && y.b == x.a &&
+            i + 2 < v.size() && is_branch(v[i + 2].op)) {
+            x.op = OP_FUSE_LDI_CMP_BCC;
+            v[i + 1].imm = moxie_branch_test(v[i + 2].op);
+            n = 3;
+        } else if (x.op == OP_CMP && is_branch(y.op)) {
+            x.op = OP_FUSE_CMP_BCC;
+            x.imm = moxie_branch_test(y.op);
+        } else if (x.op == OP_LDI_L && y.op == OP_ADD && y.b == x.a)
+            x.op = OP_FUSE_LDI_ADD;
+        else if (x.op == OP_LDI_L && y.op == OP_AND && y.b == x.a)
+            x.op = OP_FUSE_LDI_AND;
+        else if (x.op == OP_LDO_L && x.b == 0 && y.op == OP_LDO_L && y.b == 0)
+            x.op = OP_FUSE_LDO_LDO;
+        else if (x.op == OP_LDO_L && x.b == 0 && y.op == OP_STO_L && y.a == 0)
+            x.op = OP_FUSE_LDO_STO;
+        else if (x.op == OP_PUSH && y.op == OP_PUSH)
+            x.op = OP_FUSE_PUSH_PUSH;
+        else if (x.op == OP_PUSH && y.op == OP_JSRA)
+            x.op = OP_FUSE_PUSH_JSRA;
+        else
+            n = 1;
+
+        i += n;
+    }
+}
+
+/* Decode the basic block starting at pc and add it to the cache.  */
+static moxieBlock *decode_block(machine &mach, uint32_t pc)
+{
+    moxieBlock *blk = new moxieBlock(pc);
+
+    bool last = false;
+    while (!last && blk->insns.size() < BB_MAX_INSNS) {
+        struct moxie_insn ins;
+        last = decode_insn(mach, blk->end, ins);
+
+        // remember which ranges must invalidate the cache when written
+        if (ins.op != OP_FETCHBUS) {
+            addressRange *ar = mach.findRange(blk->end, ins.len);
+            if (ar)
+                mach.markCode(ar, blk->end, ins.len);
+        }
+
+        blk->insns.push_back(ins);
+        blk->end += ins.len;
+    }
+
+    fuse_block(blk);
+    blk->aot = mach.aot.lookup(mach, pc, blk->end);
+    blk->hle = hleFind(mach, pc);
+    mach.bbcache.insert(blk);
+    return blk;
+}
+
+/* Decode one instruction for moxie-aot.  Returns true if it ends a basic
+   block.  */
+bool sim_decode(machine &mach, uint32_t pc, struct moxie_insn &ins)
+{
+    return decode_insn(mach, pc, ins);
+}
+
+#if defined(__GNUC__)
+#define HAVE_COMPUTED_GOTO 1
+#endif
+
+/* The instruction handlers below are shared by both interpreter cores.
+   The switch core returns to a common tail after every handler.  The
+   threaded core (GCC labels-as-values) replicates that tail into each
+   handler, which then jumps straight to the handler of the next
+   instruction, giving the host branch predictor one indirect branch
+   per handler instead of one for the whole interpreter.  */
+#ifdef HAVE_COMPUTED_GOTO
+#define LABEL(op) &&L_##op
+#define INSN(op) \
+    case op:     \
+    L_##op:
+#define GOTO_HANDLER() goto *handlers[ins->op]
+#else
+#define INSN(op) case op:
+#define GOTO_HANDLER() goto dispatch
+#endif
+
+#define DISPATCH()                  \
+    do {                            \
+        opc = pc;                   \
+        npc = pc + ins->len;        \
+        a = ins->a;                 \
+        b = ins->b;                 \
+        if (threaded)               \
+            GOTO_HANDLER();         \
+        goto dispatch;              \
+    } while (0)
+
+/* Retire the current instruction and move on to the next one.  Only
+   handlers that access memory or raise exceptions need to check for an
+   exception or for a store that replaced the code of this block.  */
+#define RETIRE(check)                                                      \
+    do {                                                                   \
+        insts++;                                                           \
+        pc = npc;                                                          \
+        if (++ins == end ||                                                \
+            (check && (cpu.asregs.exception || bbc.modified)))             \
+            goto next_block;                                               \
+        DISPATCH();                                                        \
+    } while (0)
+
+/* Retire one instruction of a superinstruction and step to the next one,
+   which is in the same block but may lie past a block cut short by the
+   budget.  */
+#define STEP(check)                                                        \
+    do {                                                                   \
+        insts++;                                                           \
+        pc = npc;                                                          \
+        if (ins + 1 == end)                                                \
+            goto next_block;                                               \
+        if (check && (cpu.asregs.exception || bbc.modified))               \
+            goto next_block;                                               \
+        ins++;                                                             \
+        opc = pc;                                                          \
+        npc = pc + ins->len;                                               \
+    } while (0)
+
+#define BRANCH_IF(cond)                                           \
+    do {                                                          \
+        if (cond) {                                               \
+            TRACE("BRANCH");                                      \
+            npc = ins->imm;                                       \
+            /* Increment basic block count */                     \
+            if (policy & POLICY_PROFILE)                          \
+                mach.gprof_bb_data[npc]++;                        \
+        }                                                         \
+    } while (0)
+
+/* cc only holds the flags when no cmp has been run yet.  */
+#define BRANCH(op)                                                     \
+    BRANCH_IF(cpu.asregs.ccLazy                                        \
+                  ? branch_cond(op, cpu.asregs.cca, cpu.asregs.ccb)    \
+                  : (cpu.asregs.cc & branch_flags[op - OP_BEQ]))
+
+#define FUSED(op)                               \
+    do {                                        \
+        if (policy & POLICY_FUSIONS)            \
+            mach.fusions[op - OP_FUSE_FIRST]++; \
+    } while (0)
+
+#define NEXT             \
+    do {                 \
+        if (threaded)    \
+            RETIRE(0);   \
+        goto retire;     \
+    } while (0)
+
+#define NEXT_CHECK         \
+    do {                   \
+        if (threaded)      \
+            RETIRE(1);     \
+        goto retire_check; \
+    } while (0)
+
+template <moxie_engine engine, unsigned policy>
+static int run_blocks(machine &mach, unsigned long long cpu_budget)
 {
-    int step = 0;
+    const bool threaded = (engine != ENGINE_SWITCH);
+
+#ifdef HAVE_COMPUTED_GOTO
+    static void *const handlers[OP_COUNT] = {
+        LABEL(OP_ILL), LABEL(OP_LDI_L), LABEL(OP_MOV), LABEL(OP_JSRA),
+        LABEL(OP_RET), LABEL(OP_ADD), LABEL(OP_PUSH), LABEL(OP_POP),
+        LABEL(OP_LDA_L), LABEL(OP_STA_L), LABEL(OP_LD_L), LABEL(OP_ST_L),
+        LABEL(OP_LDO_L), LABEL(OP_STO_L), LABEL(OP_CMP), LABEL(OP_NOP),
+        LABEL(OP_SEX_B), LABEL(OP_SEX_S), LABEL(OP_ZEX_B), LABEL(OP_ZEX_S),
+        LABEL(OP_UMUL_X), LABEL(OP_MUL_X), LABEL(OP_ILL), LABEL(OP_ILL),
+        LABEL(OP_ILL), LABEL(OP_JSR), LABEL(OP_JMPA), LABEL(OP_LDI_B),
+        LABEL(OP_LD_B), LABEL(OP_LDA_B), LABEL(OP_ST_B), LABEL(OP_STA_B),
+        LABEL(OP_LDI_S), LABEL(OP_LD_S), LABEL(OP_LDA_S), LABEL(OP_ST_S),
+        LABEL(OP_STA_S), LABEL(OP_JMP), LABEL(OP_AND), LABEL(OP_LSHR),
+        LABEL(OP_ASHL), LABEL(OP_SUB), LABEL(OP_NEG), LABEL(OP_OR),
+        LABEL(OP_NOT), LABEL(OP_ASHR), LABEL(OP_XOR), LABEL(OP_MUL),
+        LABEL(OP_SWI), LABEL(OP_DIV), LABEL(OP_UDIV), LABEL(OP_MOD),
+        LABEL(OP_UMOD), LABEL(OP_BRK), LABEL(OP_LDO_B), LABEL(OP_STO_B),
+        LABEL(OP_LDO_S), LABEL(OP_STO_S), LABEL(OP_INC), LABEL(OP_DEC),
+        LABEL(OP_GSR), LABEL(OP_SSR), LABEL(OP_BEQ), LABEL(OP_BNE),
+        LABEL(OP_BLT), LABEL(OP_BGT), LABEL(OP_BLTU), LABEL(OP_BGTU),
+        LABEL(OP_BGE), LABEL(OP_BLE), LABEL(OP_BGEU), LABEL(OP_BLEU),
+        LABEL(OP_ILL), LABEL(OP_ILL3), LABEL(OP_FETCHBUS),
+        LABEL(OP_FUSE_CMP_BCC), LABEL(OP_FUSE_LDI_CMP_BCC),
+        LABEL(OP_FUSE_LDI_ADD), LABEL(OP_FUSE_LDI_AND),
+        LABEL(OP_FUSE_LDO_LDO), LABEL(OP_FUSE_LDO_STO),
+        LABEL(OP_FUSE_PUSH_PUSH), LABEL(OP_FUSE_PUSH_JSRA),
+    };
+#endif
 
-    word pc, opc;
+    word pc, opc, npc;
+    int a, b;
     unsigned long long insts;
-    unsigned short inst;
     cpuState &cpu = mach.cpu;
+    blockCache &bbc = mach.bbcache;
+    moxieBlock *blk;
+    const struct moxie_insn *ins, *end;
+    std::vector<moxieBlock *> rec; /* blocks of the loop being recorded */
+    moxieBlock *recHead = NULL;
 
-    cpu.asregs.exception = step ? SIGTRAP : 0;
+    cpu.asregs.exception = 0;
     pc = cpu.asregs.regs[PC_REGNO];
+    opc = 0;
     insts = cpu.asregs.insts;
 
-    /* Run instructions here. */
-    do {
-        opc = pc;
-
-        /* Fetch the instruction at pc.  */
-        inst = EXTRACT_WORD16(pc);
-
-        /* Decode instruction.  */
-        if (inst & (1 << 15)) {
-            if (inst & (1 << 14)) {
-                /* This is a Form 3 instruction.  */
-                int opcode = (inst >> 10 & 0xf);
-                word flags[10] = {CC_EQ,         ~CC_EQ,        CC_LT,
-                                  CC_GT,         CC_LTU,        CC_GTU,
-                                  CC_GT | CC_EQ, CC_LT | CC_EQ, CC_GTU | CC_EQ,
-                                  CC_LTU | CC_EQ};
-                if (opcode < 10) {
-                    if (cpu.asregs.cc & flags[opcode]) {
-                        TRACE("BRANCH");
-                        pc += INST2OFFSET(inst);
-                        /* Increment basic block count */
-                        if (mach.profiling)
-                            mach.gprof_bb_data[pc + 2]++;
-                    }
-                } else {
-                    TRACE("SIGILL3");
-                    cpu.asregs.exception = SIGILL;
-                    break;
-                }
-            } else {
-                /* This is a Form 2 instruction.  */
-                int opcode = (inst >> 12 & 0x3);
-                switch (opcode) {
-                case 0x00: /* inc */
-                {
-                    int a = (inst >> 8) & 0xf;
-                    unsigned av = cpu.asregs.regs[a];
-                    unsigned v = (inst & 0xff);
-
-                    TRACE("inc");
-                    cpu.asregs.regs[a] = av + v;
-                } break;
-                case 0x01: /* dec */
-                {
-                    int a = (inst >> 8) & 0xf;
-                    unsigned av = cpu.asregs.regs[a];
-                    unsigned v = (inst & 0xff);
-
-                    TRACE("dec");
-                    cpu.asregs.regs[a] = av - v;
-                } break;
-                case 0x02: /* gsr */
-                {
-                    int a = (inst >> 8) & 0xf;
-                    unsigned v = (inst & 0xff);
-
-                    TRACE("gsr");
-                    cpu.asregs.regs[a] = cpu.asregs.sregs[v];
-                } break;
-                case 0x03: /* ssr */
-                {
-                    int a = (inst >> 8) & 0xf;
-                    unsigned sreg = (inst & 0xff);
-                    int32_t sval = cpu.asregs.regs[a];
-
-                    TRACE("ssr");
-                    switch (sreg) {
-                    case 6: /* sim return buf addr */
-                        if (!mach.physaddr(sval, 1))
-                            cpu.asregs.exception = SIGBUS;
-                        else
-                            cpu.asregs.sregs[sreg] = sval;
-                        break;
-                    case 7: /* sim return buf length */
-                        if (!cpu.asregs.sregs[6] ||
-                            !mach.physaddr(cpu.asregs.sregs[6], sval))
-                            cpu.asregs.exception = SIGBUS;
-                        else
-                            cpu.asregs.sregs[sreg] = sval;
-                        break;
-                    default:
-                        cpu.asregs.sregs[sreg] = sval;
-                        break;
-                    }
-                } break;
-                default:
-                    TRACE("SIGILL2");
-                    cpu.asregs.exception = SIGILL;
-                    break;
-                }
+    /* Run instructions here.  The first block skips the budget check,
+       so at least one instruction is always run.  */
+    goto lookup;
+
+next_block:
+    if (cpu.asregs.exception)
+        goto out;
+
+    if (policy & POLICY_STEP) {
+        cpu.asregs.exception = SIGTRAP;
+        goto out;
+    }
+
+    /* The budget is only checked between blocks; a block that would
+       cross it is cut short below so the stop point is exact.  */
+    if ((policy & POLICY_BUDGET) && (insts >= cpu_budget))
+        goto out;
+
+lookup:
+    /* Release blocks invalidated by guest or debugger stores.  */
+    if (bbc.modified) {
+        recHead = NULL;
+        bbc.reclaim();
+    }
+
+    /* Find the predecoded block at pc.  */
+    blk = bbc.lookup(pc);
+    if (!blk)
+        blk = decode_block(mach, pc);
+
+    /* Calls of runtime functions bound by --hle run natively.  A call
+       that does not fit in the budget ends the run before it.  */
+    if (!(policy & POLICY_INSTRUMENT) && blk->hle >= 0) {
+        unsigned long long limit = ~0ULL, cost;
+        uint32_t to;
+        if (policy & POLICY_BUDGET)
+            limit = insts < cpu_budget ? cpu_budget - insts : 0;
+
+        switch (hleCall(mach, blk->hle, limit, to, cost)) {
+        case HLE_DONE:
+            pc = to;
+            insts += cost;
+            recHead = NULL;
+            opc = 0;
+            goto next_block;
+        case HLE_BUDGET:
+            goto out;
+        }
+    }
+
+    /* Run blocks translated ahead of time, unless that could overrun
+       the budget.  */
+    if (!(policy & POLICY_INSTRUMENT) && blk->aot &&
+        (!(policy & POLICY_BUDGET) ||
+         (insts < cpu_budget && cpu_budget - insts >= blk->aot->insns))) {
+        uint64_t r = blk->aot->code(&mach.aot.ctx);
+        pc = (uint32_t) r;
+        insts += r >> 32;
+        recHead = NULL;
+        opc = 0;
+        goto next_block;
+    }
+
+#ifdef MOXIE_JIT
+    /* Run hot blocks as host code, unless that could overrun the
+       budget; the interpreter then finishes them exactly.  */
+    if (engine == ENGINE_JIT) {
+        if (!blk->native && ++blk->hits == JIT_HOT_BLOCK)
+            jitTranslate(mach, blk);
+
+        if (blk->native) {
+            unsigned long long limit = JIT_MAX_RUN;
+            if (policy & POLICY_BUDGET)
+                limit = insts < cpu_budget ? cpu_budget - insts : 0;
+            if (limit > JIT_MAX_RUN)
+                limit = JIT_MAX_RUN;
+
+            if (limit >= blk->nativeInsns) {
+                uint64_t r = blk->native(&cpu.asregs, limit);
+                pc = (uint32_t) r;
+                insts += r >> 32;
+                goto next_block;
             }
-        } else {
-            /* This is a Form 1 instruction.  */
-            int opcode = inst >> 8;
-            switch (opcode) {
-            case 0x00: /* bad */
-                opc = opcode;
-
-                TRACE("SIGILL0");
-                cpu.asregs.exception = SIGILL;
-                break;
-            case 0x01: /* ldi.l (immediate) */
-            {
-                int reg = (inst >> 4) & 0xf;
-
-                TRACE("ldi.l");
-                unsigned int val = EXTRACT_WORD(pc + 2);
-                cpu.asregs.regs[reg] = val;
-                pc += 4;
-            } break;
-            case 0x02: /* mov (register-to-register) */
-            {
-                int dest = (inst >> 4) & 0xf;
-                int src = (inst) &0xf;
-
-                TRACE("mov");
-                cpu.asregs.regs[dest] = cpu.asregs.regs[src];
-            } break;
-            case 0x03: /* jsra */
-            {
-                unsigned int fn = EXTRACT_WORD(pc + 2);
-                unsigned int sp = cpu.asregs.regs[1];
-
-                TRACE("jsra");
-                /* Save a slot for the static chain.  */
-                sp -= 4;
-
-                /* Push the return address.  */
-                sp -= 4;
-                wlat(mach, sp, pc + 6);
-
-                /* Push the current frame pointer.  */
-                sp -= 4;
-                wlat(mach, sp, cpu.asregs.regs[0]);
-
-                /* Uncache the stack pointer and set the pc and $fp.  */
-                cpu.asregs.regs[1] = sp;
-                cpu.asregs.regs[0] = sp;
-                pc = fn - 2;
-            } break;
-            case 0x04: /* ret */
-            {
-                unsigned int sp = cpu.asregs.regs[0];
-
-                TRACE("ret");
-
-                /* Pop the frame pointer.  */
-                cpu.asregs.regs[0] = rlat(mach, sp);
-                sp += 4;
-
-                /* Pop the return address.  */
-                pc = rlat(mach, sp) - 2;
-                sp += 4;
-
-                /* Skip over the static chain slot.  */
-                sp += 4;
-
-                /* Uncache the stack pointer.  */
-                cpu.asregs.regs[1] = sp;
-            } break;
-            case 0x05: /* add */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned av = cpu.asregs.regs[a];
-                unsigned bv = cpu.asregs.regs[b];
-
-                TRACE("add");
-                cpu.asregs.regs[a] = av + bv;
-            } break;
-            case 0x06: /* push */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int sp = cpu.asregs.regs[a] - 4;
-
-                TRACE("push");
-                wlat(mach, sp, cpu.asregs.regs[b]);
-                cpu.asregs.regs[a] = sp;
-            } break;
-            case 0x07: /* pop */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int sp = cpu.asregs.regs[a];
-
-                TRACE("pop");
-                cpu.asregs.regs[b] = rlat(mach, sp);
-                cpu.asregs.regs[a] = sp + 4;
-            } break;
-            case 0x08: /* lda.l */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int addr = EXTRACT_WORD(pc + 2);
-
-                TRACE("lda.l");
-                cpu.asregs.regs[reg] = rlat(mach, addr);
-                pc += 4;
-            } break;
-            case 0x09: /* sta.l */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int addr = EXTRACT_WORD(pc + 2);
-
-                TRACE("sta.l");
-                wlat(mach, addr, cpu.asregs.regs[reg]);
-                pc += 4;
-            } break;
-            case 0x0a: /* ld.l (register indirect) */
-            {
-                int src = inst & 0xf;
-                int dest = (inst >> 4) & 0xf;
-                int xv;
-
-                TRACE("ld.l");
-                xv = cpu.asregs.regs[src];
-                cpu.asregs.regs[dest] = rlat(mach, xv);
-            } break;
-            case 0x0b: /* st.l */
-            {
-                int dest = (inst >> 4) & 0xf;
-                int val = inst & 0xf;
-
-                TRACE("st.l");
-                wlat(mach, cpu.asregs.regs[dest], cpu.asregs.regs[val]);
-            } break;
-            case 0x0c: /* ldo.l */
-            {
-                unsigned int addr = EXTRACT_OFFSET(pc + 2);
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-
-                TRACE("ldo.l");
-                addr += cpu.asregs.regs[b];
-                cpu.asregs.regs[a] = rlat(mach, addr);
-                pc += 2;
-            } break;
-            case 0x0d: /* sto.l */
-            {
-                unsigned int addr = EXTRACT_OFFSET(pc + 2);
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-
-                TRACE("sto.l");
-                addr += cpu.asregs.regs[a];
-                wlat(mach, addr, cpu.asregs.regs[b]);
-                pc += 2;
-            } break;
-            case 0x0e: /* cmp */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int cc = 0;
-                int va = cpu.asregs.regs[a];
-                int vb = cpu.asregs.regs[b];
-
-                TRACE("cmp");
-
-                if (va == vb)
-                    cc = CC_EQ;
-                else {
-                    cc |= (va < vb ? CC_LT : 0);
-                    cc |= (va > vb ? CC_GT : 0);
-                    cc |= ((unsigned int) va < (unsigned int) vb ? CC_LTU : 0);
-                    cc |= ((unsigned int) va > (unsigned int) vb ? CC_GTU : 0);
-                }
-
-                cpu.asregs.cc = cc;
-            } break;
-            case 0x0f: /* nop */
-                break;
-            case 0x10: /* sex.b */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                signed char bv = cpu.asregs.regs[b];
-
-                TRACE("sex.b");
-                cpu.asregs.regs[a] = (int) bv;
-            } break;
-            case 0x11: /* sex.s */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                signed short bv = cpu.asregs.regs[b];
-
-                TRACE("sex.s");
-                cpu.asregs.regs[a] = (int) bv;
-            } break;
-            case 0x12: /* zex.b */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                signed char bv = cpu.asregs.regs[b];
-
-                TRACE("zex.b");
-                cpu.asregs.regs[a] = (int) bv & 0xff;
-            } break;
-            case 0x13: /* zex.s */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                signed short bv = cpu.asregs.regs[b];
-
-                TRACE("zex.s");
-                cpu.asregs.regs[a] = (int) bv & 0xffff;
-            } break;
-            case 0x14: /* umul.x */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned av = cpu.asregs.regs[a];
-                unsigned bv = cpu.asregs.regs[b];
-                unsigned long long r =
-                    (unsigned long long) av * (unsigned long long) bv;
-
-                TRACE("umul.x");
-                cpu.asregs.regs[a] = r >> 32;
-            } break;
-            case 0x15: /* mul.x */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned av = cpu.asregs.regs[a];
-                unsigned bv = cpu.asregs.regs[b];
-                signed long long r =
-                    (signed long long) av * (signed long long) bv;
-
-                TRACE("mul.x");
-                cpu.asregs.regs[a] = r >> 32;
-            } break;
-            case 0x16: /* bad */
-            case 0x17: /* bad */
-            case 0x18: /* bad */
-            {
-                opc = opcode;
-
-                TRACE("SIGILL0");
-                cpu.asregs.exception = SIGILL;
-                break;
+        }
+    }
+#endif
+
+    /* Record the blocks of a loop from its head back to it, and run
+       recorded loops as traces while the budget allows whole
+       iterations.  */
+    if (engine == ENGINE_TRACE) {
+        if (recHead) {
+            if (blk == recHead) {
+                recHead->trace = traceBuild(mach, rec);
+                recHead = NULL;
+            } else if (rec.size() == TRACE_MAX_BLOCKS || blk->trace)
+                recHead = NULL;
+            else
+                rec.push_back(blk);
+        }
+
+        if (blk->trace && blk->trace->epoch != bbc.epoch) {
+            delete blk->trace;
+            blk->trace = NULL;
+            blk->loops = 0;
+        }
+
+        if (blk->trace) {
+            unsigned long long limit = JIT_MAX_RUN;
+            if (policy & POLICY_BUDGET)
+                limit = insts < cpu_budget ? cpu_budget - insts : 0;
+            if (limit > JIT_MAX_RUN)
+                limit = JIT_MAX_RUN;
+
+            uint64_t r = traceRun(mach, blk->trace, limit);
+            if (r >> 32) {
+                pc = (uint32_t) r;
+                insts += r >> 32;
+                opc = 0;
+                goto next_block;
             }
-            case 0x19: /* jsr */
-            {
-                unsigned int fn = cpu.asregs.regs[(inst >> 4) & 0xf];
-                unsigned int sp = cpu.asregs.regs[1];
-
-                TRACE("jsr");
-
-                /* Save a slot for the static chain.  */
-                sp -= 4;
-
-                /* Push the return address.  */
-                sp -= 4;
-                wlat(mach, sp, pc + 2);
-
-                /* Push the current frame pointer.  */
-                sp -= 4;
-                wlat(mach, sp, cpu.asregs.regs[0]);
-
-                /* Uncache the stack pointer and set the fp & pc.  */
-                cpu.asregs.regs[1] = sp;
-                cpu.asregs.regs[0] = sp;
-                pc = fn - 2;
-            } break;
-            case 0x1a: /* jmpa */
-            {
-                unsigned int tgt = EXTRACT_WORD(pc + 2);
-
-                TRACE("jmpa");
-                pc = tgt - 2;
-            } break;
-            case 0x1b: /* ldi.b (immediate) */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int val = EXTRACT_WORD(pc + 2);
-
-                TRACE("ldi.b");
-                cpu.asregs.regs[reg] = val;
-                pc += 4;
-            } break;
-            case 0x1c: /* ld.b (register indirect) */
-            {
-                int src = inst & 0xf;
-                int dest = (inst >> 4) & 0xf;
-                int xv;
-
-                TRACE("ld.b");
-                xv = cpu.asregs.regs[src];
-                cpu.asregs.regs[dest] = rbat(mach, xv);
-            } break;
-            case 0x1d: /* lda.b */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int addr = EXTRACT_WORD(pc + 2);
-
-                TRACE("lda.b");
-                cpu.asregs.regs[reg] = rbat(mach, addr);
-                pc += 4;
-            } break;
-            case 0x1e: /* st.b */
-            {
-                int dest = (inst >> 4) & 0xf;
-                int val = inst & 0xf;
-
-                TRACE("st.b");
-                wbat(mach, cpu.asregs.regs[dest], cpu.asregs.regs[val]);
-            } break;
-            case 0x1f: /* sta.b */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int addr = EXTRACT_WORD(pc + 2);
-
-                TRACE("sta.b");
-                wbat(mach, addr, cpu.asregs.regs[reg]);
-                pc += 4;
-            } break;
-            case 0x20: /* ldi.s (immediate) */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int val = EXTRACT_WORD(pc + 2);
-
-                TRACE("ldi.s");
-                cpu.asregs.regs[reg] = val;
-                pc += 4;
-            } break;
-            case 0x21: /* ld.s (register indirect) */
-            {
-                int src = inst & 0xf;
-                int dest = (inst >> 4) & 0xf;
-                int xv;
-
-                TRACE("ld.s");
-                xv = cpu.asregs.regs[src];
-                cpu.asregs.regs[dest] = rsat(mach, xv);
-            } break;
-            case 0x22: /* lda.s */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int addr = EXTRACT_WORD(pc + 2);
-
-                TRACE("lda.s");
-                cpu.asregs.regs[reg] = rsat(mach, addr);
-                pc += 4;
-            } break;
-            case 0x23: /* st.s */
-            {
-                int dest = (inst >> 4) & 0xf;
-                int val = inst & 0xf;
-
-                TRACE("st.s");
-                wsat(mach, cpu.asregs.regs[dest], cpu.asregs.regs[val]);
-            } break;
-            case 0x24: /* sta.s */
-            {
-                int reg = (inst >> 4) & 0xf;
-                unsigned int addr = EXTRACT_WORD(pc + 2);
-
-                TRACE("sta.s");
-                wsat(mach, addr, cpu.asregs.regs[reg]);
-                pc += 4;
-            } break;
-            case 0x25: /* jmp */
-            {
-                int reg = (inst >> 4) & 0xf;
-
-                TRACE("jmp");
-                pc = cpu.asregs.regs[reg] - 2;
-            } break;
-            case 0x26: /* and */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av, bv;
-
-                TRACE("and");
-                av = cpu.asregs.regs[a];
-                bv = cpu.asregs.regs[b];
-                cpu.asregs.regs[a] = av & bv;
-            } break;
-            case 0x27: /* lshr */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av = cpu.asregs.regs[a];
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("lshr");
-                cpu.asregs.regs[a] = (unsigned) ((unsigned) av >> bv);
-            } break;
-            case 0x28: /* ashl */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av = cpu.asregs.regs[a];
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("ashl");
-                cpu.asregs.regs[a] = av << bv;
-            } break;
-            case 0x29: /* sub */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned av = cpu.asregs.regs[a];
-                unsigned bv = cpu.asregs.regs[b];
-
-                TRACE("sub");
-                cpu.asregs.regs[a] = av - bv;
-            } break;
-            case 0x2a: /* neg */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("neg");
-                cpu.asregs.regs[a] = -bv;
-            } break;
-            case 0x2b: /* or */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av, bv;
-
-                TRACE("or");
-                av = cpu.asregs.regs[a];
-                bv = cpu.asregs.regs[b];
-                cpu.asregs.regs[a] = av | bv;
-            } break;
-            case 0x2c: /* not */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("not");
-                cpu.asregs.regs[a] = 0xffffffff ^ bv;
-            } break;
-            case 0x2d: /* ashr */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av = cpu.asregs.regs[a];
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("ashr");
-                cpu.asregs.regs[a] = av >> bv;
-            } break;
-            case 0x2e: /* xor */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av, bv;
-
-                TRACE("xor");
-                av = cpu.asregs.regs[a];
-                bv = cpu.asregs.regs[b];
-                cpu.asregs.regs[a] = av ^ bv;
-            } break;
-            case 0x2f: /* mul */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned av = cpu.asregs.regs[a];
-                unsigned bv = cpu.asregs.regs[b];
-
-                TRACE("mul");
-                cpu.asregs.regs[a] = av * bv;
-            } break;
-            case 0x30: /* swi */
-            {
-                unsigned int inum = EXTRACT_WORD(pc + 2);
-
-                TRACE("swi");
-                /* Set the special registers appropriately.  */
-                cpu.asregs.sregs[2] = 3; /* MOXIE_EX_SWI */
-                cpu.asregs.sregs[3] = inum;
-                switch (inum) {
-                case 0x1: /* SYS_exit */
-                {
-                    cpu.asregs.exception = SIGQUIT;
-                    break;
-                }
-
-                case 90: /* SYS_mmap */
-                {
-                    sim_mmap(mach);
-                    break;
-                }
-
-                default:
-                    break;
-                }
-                pc += 4;
-            } break;
-            case 0x31: /* div */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av = cpu.asregs.regs[a];
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("div");
-                cpu.asregs.regs[a] = av / bv;
-            } break;
-            case 0x32: /* udiv */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned int av = cpu.asregs.regs[a];
-                unsigned int bv = cpu.asregs.regs[b];
-
-                TRACE("udiv");
-                cpu.asregs.regs[a] = (av / bv);
-            } break;
-            case 0x33: /* mod */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                int av = cpu.asregs.regs[a];
-                int bv = cpu.asregs.regs[b];
-
-                TRACE("mod");
-                cpu.asregs.regs[a] = av % bv;
-            } break;
-            case 0x34: /* umod */
-            {
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-                unsigned int av = cpu.asregs.regs[a];
-                unsigned int bv = cpu.asregs.regs[b];
-
-                TRACE("umod");
-                cpu.asregs.regs[a] = (av % bv);
-            } break;
-            case 0x35: /* brk */
-                TRACE("brk");
-                cpu.asregs.exception = SIGTRAP;
-                pc -= 2; /* Adjust pc */
-                break;
-            case 0x36: /* ldo.b */
-            {
-                unsigned int addr = EXTRACT_OFFSET(pc + 2);
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-
-                TRACE("ldo.b");
-                addr += cpu.asregs.regs[b];
-                cpu.asregs.regs[a] = rbat(mach, addr);
-                pc += 2;
-            } break;
-            case 0x37: /* sto.b */
-            {
-                unsigned int addr = EXTRACT_OFFSET(pc + 2);
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-
-                TRACE("sto.b");
-                addr += cpu.asregs.regs[a];
-                wbat(mach, addr, cpu.asregs.regs[b]);
-                pc += 2;
-            } break;
-            case 0x38: /* ldo.s */
-            {
-                unsigned int addr = EXTRACT_OFFSET(pc + 2);
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-
-                TRACE("ldo.s");
-                addr += cpu.asregs.regs[b];
-                cpu.asregs.regs[a] = rsat(mach, addr);
-                pc += 2;
-            } break;
-            case 0x39: /* sto.s */
-            {
-                unsigned int addr = EXTRACT_OFFSET(pc + 2);
-                int a = (inst >> 4) & 0xf;
-                int b = inst & 0xf;
-
-                TRACE("sto.s");
-                addr += cpu.asregs.regs[a];
-                wsat(mach, addr, cpu.asregs.regs[b]);
-                pc += 2;
-            } break;
-            default:
-                opc = opcode;
-                TRACE("SIGILL1");
-                cpu.asregs.exception = SIGILL;
-                break;
+        } else if (!recHead && (uword) pc <= (uword) opc &&
+                   ++blk->loops == TRACE_HOT_LOOP) {
+            recHead = blk;
+            rec.assign(1, blk);
+        }
+    }
+
+    ins = &blk->insns[0];
+    end = ins + blk->insns.size();
+    if (policy & POLICY_STEP)
+        end = ins + 1;
+    else if (policy & POLICY_BUDGET) {
+        unsigned long long left = insts < cpu_budget ? cpu_budget - insts : 1;
+        if (left < blk->insns.size()) {
+            end = ins + left;
+            recHead = NULL;
+        }
+    }
+    DISPATCH();
+
+retire:
+    RETIRE(0);
+
+retire_check:
+    RETIRE(1);
+
+dispatch:
+    /* Trace superinstructions as their parts.  */
+    switch ((policy & POLICY_TRACE) ? moxie_unfused_op(ins->op) : ins->op) {
+    INSN(OP_BEQ)
+        BRANCH(OP_BEQ);
+        NEXT;
+    INSN(OP_BNE)
+        BRANCH(OP_BNE);
+        NEXT;
+    INSN(OP_BLT)
+        BRANCH(OP_BLT);
+        NEXT;
+    INSN(OP_BGT)
+        BRANCH(OP_BGT);
+        NEXT;
+    INSN(OP_BLTU)
+        BRANCH(OP_BLTU);
+        NEXT;
+    INSN(OP_BGTU)
+        BRANCH(OP_BGTU);
+        NEXT;
+    INSN(OP_BGE)
+        BRANCH(OP_BGE);
+        NEXT;
+    INSN(OP_BLE)
+        BRANCH(OP_BLE);
+        NEXT;
+    INSN(OP_BGEU)
+        BRANCH(OP_BGEU);
+        NEXT;
+    INSN(OP_BLEU)
+        BRANCH(OP_BLEU);
+        NEXT;
+    INSN(OP_ILL3)
+        TRACE("SIGILL3");
+        cpu.asregs.exception = SIGILL;
+        goto out;
+    INSN(OP_INC) {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned v = ins->imm;
+
+        TRACE("inc");
+        cpu.asregs.regs[a] = av + v;
+        NEXT;
+    }
+    INSN(OP_DEC) {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned v = ins->imm;
+
+        TRACE("dec");
+        cpu.asregs.regs[a] = av - v;
+        NEXT;
+    }
+    INSN(OP_GSR) {
+        unsigned v = ins->imm;
+
+        TRACE("gsr");
+        cpu.asregs.regs[a] = cpu.asregs.sregs[v];
+        NEXT;
+    }
+    INSN(OP_SSR) {
+        unsigned sreg = ins->imm;
+        int32_t sval = cpu.asregs.regs[a];
+
+        TRACE("ssr");
+        switch (sreg) {
+        case 6: /* sim return buf addr */
+            if (!mach.physaddr(sval, 1))
+                cpu.asregs.exception = SIGBUS;
+            else
+                cpu.asregs.sregs[sreg] = sval;
+            break;
+        case 7: /* sim return buf length */
+            if (!cpu.asregs.sregs[6] ||
+                !mach.physaddr(cpu.asregs.sregs[6], sval))
+                cpu.asregs.exception = SIGBUS;
+            else
+                cpu.asregs.sregs[sreg] = sval;
+            break;
+        default:
+            cpu.asregs.sregs[sreg] = sval;
+            break;
+        }
+        NEXT_CHECK;
+    }
+    INSN(OP_ILL)
+        TRACE("SIGILL");
+        cpu.asregs.exception = SIGILL;
+        NEXT_CHECK;
+    INSN(OP_FETCHBUS)
+        TRACE("SIGBUS");
+        cpu.asregs.exception = SIGBUS;
+        npc = pc;
+        NEXT_CHECK;
+    INSN(OP_LDI_L) /* ldi.l (immediate) */
+        TRACE("ldi.l");
+        cpu.asregs.regs[a] = ins->imm;
+        NEXT;
+    INSN(OP_MOV) /* mov (register-to-register) */
+        TRACE("mov");
+        cpu.asregs.regs[a] = cpu.asregs.regs[b];
+        NEXT;
+    INSN(OP_JSRA) /* jsra */
+        TRACE("jsra");
+        push_frame(mach, npc);
+        npc = ins->imm;
+        NEXT_CHECK;
+    INSN(OP_RET) /* ret */
+    {
+        unsigned int sp = cpu.asregs.regs[0];
+
+        TRACE("ret");
+
+        /* Pop the frame pointer.  */
+        cpu.asregs.regs[0] = rlat(mach, sp);
+        sp += 4;
+
+        /* Pop the return address.  */
+        npc = rlat(mach, sp);
+        sp += 4;
+
+        /* Skip over the static chain slot.  */
+        sp += 4;
+
+        /* Uncache the stack pointer.  */
+        cpu.asregs.regs[1] = sp;
+        NEXT_CHECK;
+    }
+    INSN(OP_ADD) /* add */
+    {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned bv = cpu.asregs.regs[b];
+
+        TRACE("add");
+        cpu.asregs.regs[a] = av + bv;
+        NEXT;
+    }
+    INSN(OP_PUSH) /* push */
+        TRACE("push");
+        push_reg(mach, a, b);
+        NEXT_CHECK;
+    INSN(OP_POP) /* pop */
+    {
+        int sp = cpu.asregs.regs[a];
+
+        TRACE("pop");
+        cpu.asregs.regs[b] = rlat(mach, sp);
+        cpu.asregs.regs[a] = sp + 4;
+        NEXT_CHECK;
+    }
+    INSN(OP_LDA_L) /* lda.l */
+        TRACE("lda.l");
+        cpu.asregs.regs[a] = rlat(mach, ins->imm);
+        NEXT_CHECK;
+    INSN(OP_STA_L) /* sta.l */
+        TRACE("sta.l");
+        wlat(mach, ins->imm, cpu.asregs.regs[a]);
+        NEXT_CHECK;
+    INSN(OP_LD_L) /* ld.l (register indirect) */
+        TRACE("ld.l");
+        cpu.asregs.regs[a] = rlat(mach, cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    INSN(OP_ST_L) /* st.l */
+        TRACE("st.l");
+        wlat(mach, cpu.asregs.regs[a], cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    INSN(OP_LDO_L) /* ldo.l */
+    {
+        unsigned int addr = ins->imm + cpu.asregs.regs[b];
+
+        TRACE("ldo.l");
+        cpu.asregs.regs[a] = rlat(mach, addr);
+        NEXT_CHECK;
+    }
+    INSN(OP_STO_L) /* sto.l */
+    {
+        unsigned int addr = ins->imm + cpu.asregs.regs[a];
+
+        TRACE("sto.l");
+        wlat(mach, addr, cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    }
+    INSN(OP_CMP) /* cmp */
+        TRACE("cmp");
+        cpu.asregs.cca = cpu.asregs.regs[a];
+        cpu.asregs.ccb = cpu.asregs.regs[b];
+        cpu.asregs.ccLazy = 1;
+        NEXT;
+    INSN(OP_NOP) /* nop */
+        NEXT;
+    INSN(OP_SEX_B) /* sex.b */
+    {
+        signed char bv = cpu.asregs.regs[b];
+
+        TRACE("sex.b");
+        cpu.asregs.regs[a] = (int) bv;
+        NEXT;
+    }
+    INSN(OP_SEX_S) /* sex.s */
+    {
+        signed short bv = cpu.asregs.regs[b];
+
+        TRACE("sex.s");
+        cpu.asregs.regs[a] = (int) bv;
+        NEXT;
+    }
+    INSN(OP_ZEX_B) /* zex.b */
+    {
+        signed char bv = cpu.asregs.regs[b];
+
+        TRACE("zex.b");
+        cpu.asregs.regs[a] = (int) bv & 0xff;
+        NEXT;
+    }
+    INSN(OP_ZEX_S) /* zex.s */
+    {
+        signed short bv = cpu.asregs.regs[b];
+
+        TRACE("zex.s");
+        cpu.asregs.regs[a] = (int) bv & 0xffff;
+        NEXT;
+    }
+    INSN(OP_UMUL_X) /* umul.x */
+    {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned bv = cpu.asregs.regs[b];
+        unsigned long long r =
+            (unsigned long long) av * (unsigned long long) bv;
+
+        TRACE("umul.x");
+        cpu.asregs.regs[a] = r >> 32;
+        NEXT;
+    }
+    INSN(OP_MUL_X) /* mul.x */
+    {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned bv = cpu.asregs.regs[b];
+        signed long long r =
+            (signed long long) av * (signed long long) bv;
+
+        TRACE("mul.x");
+        cpu.asregs.regs[a] = r >> 32;
+        NEXT;
+    }
+    INSN(OP_JSR) /* jsr */
+    {
+        unsigned int fn = cpu.asregs.regs[a];
+
+        TRACE("jsr");
+        push_frame(mach, npc);
+        npc = fn;
+        NEXT_CHECK;
+    }
+    INSN(OP_JMPA) /* jmpa */
+        TRACE("jmpa");
+        npc = ins->imm;
+        NEXT;
+    INSN(OP_LDI_B) /* ldi.b (immediate) */
+        TRACE("ldi.b");
+        cpu.asregs.regs[a] = ins->imm;
+        NEXT;
+    INSN(OP_LD_B) /* ld.b (register indirect) */
+        TRACE("ld.b");
+        cpu.asregs.regs[a] = rbat(mach, cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    INSN(OP_LDA_B) /* lda.b */
+        TRACE("lda.b");
+        cpu.asregs.regs[a] = rbat(mach, ins->imm);
+        NEXT_CHECK;
+    INSN(OP_ST_B) /* st.b */
+        TRACE("st.b");
+        wbat(mach, cpu.asregs.regs[a], cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    INSN(OP_STA_B) /* sta.b */
+        TRACE("sta.b");
+        wbat(mach, ins->imm, cpu.asregs.regs[a]);
+        NEXT_CHECK;
+    INSN(OP_LDI_S) /* ldi.s (immediate) */
+        TRACE("ldi.s");
+        cpu.asregs.regs[a] = ins->imm;
+        NEXT;
+    INSN(OP_LD_S) /* ld.s (register indirect) */
+        TRACE("ld.s");
+        cpu.asregs.regs[a] = rsat(mach, cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    INSN(OP_LDA_S) /* lda.s */
+        TRACE("lda.s");
+        cpu.asregs.regs[a] = rsat(mach, ins->imm);
+        NEXT_CHECK;
+    INSN(OP_ST_S) /* st.s */
+        TRACE("st.s");
+        wsat(mach, cpu.asregs.regs[a], cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    INSN(OP_STA_S) /* sta.s */
+        TRACE("sta.s");
+        wsat(mach, ins->imm, cpu.asregs.regs[a]);
+        NEXT_CHECK;
+    INSN(OP_JMP) /* jmp */
+        TRACE("jmp");
+        npc = cpu.asregs.regs[a];
+        NEXT;
+    INSN(OP_AND) /* and */
+    {
+        int av, bv;
+
+        TRACE("and");
+        av = cpu.asregs.regs[a];
+        bv = cpu.asregs.regs[b];
+        cpu.asregs.regs[a] = av & bv;
+        NEXT;
+    }
+    INSN(OP_LSHR) /* lshr */
+    {
+        int av = cpu.asregs.regs[a];
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("lshr");
+        cpu.asregs.regs[a] = (unsigned) ((unsigned) av >> bv);
+        NEXT;
+    }
+    INSN(OP_ASHL) /* ashl */
+    {
+        int av = cpu.asregs.regs[a];
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("ashl");
+        cpu.asregs.regs[a] = av << bv;
+        NEXT;
+    }
+    INSN(OP_SUB) /* sub */
+    {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned bv = cpu.asregs.regs[b];
+
+        TRACE("sub");
+        cpu.asregs.regs[a] = av - bv;
+        NEXT;
+    }
+    INSN(OP_NEG) /* neg */
+    {
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("neg");
+        cpu.asregs.regs[a] = -bv;
+        NEXT;
+    }
+    INSN(OP_OR) /* or */
+    {
+        int av, bv;
+
+        TRACE("or");
+        av = cpu.asregs.regs[a];
+        bv = cpu.asregs.regs[b];
+        cpu.asregs.regs[a] = av | bv;
+        NEXT;
+    }
+    INSN(OP_NOT) /* not */
+    {
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("not");
+        cpu.asregs.regs[a] = 0xffffffff ^ bv;
+        NEXT;
+    }
+    INSN(OP_ASHR) /* ashr */
+    {
+        int av = cpu.asregs.regs[a];
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("ashr");
+        cpu.asregs.regs[a] = av >> bv;
+        NEXT;
+    }
+    INSN(OP_XOR) /* xor */
+    {
+        int av, bv;
+
+        TRACE("xor");
+        av = cpu.asregs.regs[a];
+        bv = cpu.asregs.regs[b];
+        cpu.asregs.regs[a] = av ^ bv;
+        NEXT;
+    }
+    INSN(OP_MUL) /* mul */
+    {
+        unsigned av = cpu.asregs.regs[a];
+        unsigned bv = cpu.asregs.regs[b];
+
+        TRACE("mul");
+        cpu.asregs.regs[a] = av * bv;
+        NEXT;
+    }
+    INSN(OP_SWI) /* swi */
+    {
+        unsigned int inum = ins->imm;
+
+        TRACE("swi");
+        switch (inum) {
+        case 0x1: /* SYS_exit */
+        {
+            cpu.asregs.exception = SIGQUIT;
+            break;
+        }
+
+        case 90: /* SYS_mmap */
+        {
+            sim_mmap(mach);
+            break;
+        }
+
+        case 0x120: /* SYS_snapshot */
+        {
+            /* The sandbox snapshots the machine here and attaches the
+               data of each job; the guest gets the new memory map.  */
+            cpu.asregs.regs[2] = cpu.asregs.sregs[6];
+            if (mach.snapshotStop) {
+                mach.snapshotStop = false;
+                cpu.asregs.exception = SIGSTOP;
             }
+            break;
         }
 
-        insts++;
-        pc += 2;
+        case 0x100: /* SYS_sha256_init */
+        case 0x101: /* SYS_sha256_update */
+        case 0x102: /* SYS_sha256_final */
+        case 0x110: /* SYS_bulk_copy */
+        case 0x111: /* SYS_bulk_fill */
+        case 0x112: /* SYS_bulk_compare */
+        case 0x113: /* SYS_bulk_move */
+        {
+            /* Calls that do not fit in the budget end the run before
+               the swi, which is left unexecuted.  */
+            unsigned long long left = ~0ULL, cost;
+            if (policy & POLICY_BUDGET)
+                left = insts < cpu_budget ? cpu_budget - insts - 1 : 0;
+            if (inum >= 0x110)
+                cost = sim_bulk(mach, inum, left);
+            else
+                cost = sim_sha256(mach, inum, left);
+            if (cost == ~0ULL)
+                goto out;
+            insts += cost;
+            break;
+        }
 
-        if (cpu_budget && (insts >= cpu_budget))
+        default:
             break;
+        }
+
+        /* Set the special registers appropriately.  */
+        cpu.asregs.sregs[2] = 3; /* MOXIE_EX_SWI */
+        cpu.asregs.sregs[3] = inum;
+        NEXT_CHECK;
+    }
+    INSN(OP_DIV) /* div */
+    {
+        int av = cpu.asregs.regs[a];
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("div");
+        cpu.asregs.regs[a] = av / bv;
+        NEXT;
+    }
+    INSN(OP_UDIV) /* udiv */
+    {
+        unsigned int av = cpu.asregs.regs[a];
+        unsigned int bv = cpu.asregs.regs[b];
+
+        TRACE("udiv");
+        cpu.asregs.regs[a] = (av / bv);
+        NEXT;
+    }
+    INSN(OP_MOD) /* mod */
+    {
+        int av = cpu.asregs.regs[a];
+        int bv = cpu.asregs.regs[b];
+
+        TRACE("mod");
+        cpu.asregs.regs[a] = av % bv;
+        NEXT;
+    }
+    INSN(OP_UMOD) /* umod */
+    {
+        unsigned int av = cpu.asregs.regs[a];
+        unsigned int bv = cpu.asregs.regs[b];
+
+        TRACE("umod");
+        cpu.asregs.regs[a] = (av % bv);
+        NEXT;
+    }
+    INSN(OP_BRK) /* brk */
+        TRACE("brk");
+        cpu.asregs.exception = SIGTRAP;
+        npc = pc; /* Adjust pc */
+        NEXT_CHECK;
+    INSN(OP_LDO_B) /* ldo.b */
+    {
+        unsigned int addr = ins->imm + cpu.asregs.regs[b];
+
+        TRACE("ldo.b");
+        cpu.asregs.regs[a] = rbat(mach, addr);
+        NEXT_CHECK;
+    }
+    INSN(OP_STO_B) /* sto.b */
+    {
+        unsigned int addr = ins->imm + cpu.asregs.regs[a];
+
+        TRACE("sto.b");
+        wbat(mach, addr, cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    }
+    INSN(OP_LDO_S) /* ldo.s */
+    {
+        unsigned int addr = ins->imm + cpu.asregs.regs[b];
+
+        TRACE("ldo.s");
+        cpu.asregs.regs[a] = rsat(mach, addr);
+        NEXT_CHECK;
+    }
+    INSN(OP_STO_S) /* sto.s */
+    {
+        unsigned int addr = ins->imm + cpu.asregs.regs[a];
 
-    } while (!cpu.asregs.exception);
+        TRACE("sto.s");
+        wsat(mach, addr, cpu.asregs.regs[b]);
+        NEXT_CHECK;
+    }
+
+    /* Superinstructions.  Each part is retired on its own, so budgets,
+       exceptions and code invalidation stop them between parts.  */
+    INSN(OP_FUSE_LDI_CMP_BCC) /* ldi.l; cmp; bcc */
+        FUSED(OP_FUSE_LDI_CMP_BCC);
+        cpu.asregs.regs[a] = ins->imm;
+        STEP(0);
+        goto cmp_bcc;
+    INSN(OP_FUSE_CMP_BCC) /* cmp; bcc */
+        FUSED(OP_FUSE_CMP_BCC);
+    cmp_bcc: {
+        word va = cpu.asregs.regs[ins->a];
+        word vb = cpu.asregs.regs[ins->b];
+        uword test = ins->imm;
+
+        cpu.asregs.cca = va;
+        cpu.asregs.ccb = vb;
+        cpu.asregs.ccLazy = 1;
+        STEP(0);
+        BRANCH_IF(moxie_test(test, va, vb));
+        NEXT;
+    }
+    INSN(OP_FUSE_LDI_ADD) /* ldi.l; add */
+        FUSED(OP_FUSE_LDI_ADD);
+        cpu.asregs.regs[a] = ins->imm;
+        STEP(0);
+        cpu.asregs.regs[ins->a] =
+            (unsigned) cpu.asregs.regs[ins->a] + cpu.asregs.regs[ins->b];
+        NEXT;
+    INSN(OP_FUSE_LDI_AND) /* ldi.l; and */
+        FUSED(OP_FUSE_LDI_AND);
+        cpu.asregs.regs[a] = ins->imm;
+        STEP(0);
+        cpu.asregs.regs[ins->a] &= cpu.asregs.regs[ins->b];
+        NEXT;
+    INSN(OP_FUSE_LDO_LDO) /* ldo.l; ldo.l */
+        FUSED(OP_FUSE_LDO_LDO);
+        cpu.asregs.regs[a] = rlat(mach, ins->imm + cpu.asregs.regs[b]);
+        STEP(1);
+        cpu.asregs.regs[ins->a] =
+            rlat(mach, ins->imm + cpu.asregs.regs[ins->b]);
+        NEXT_CHECK;
+    INSN(OP_FUSE_LDO_STO) /* ldo.l; sto.l */
+        FUSED(OP_FUSE_LDO_STO);
+        cpu.asregs.regs[a] = rlat(mach, ins->imm + cpu.asregs.regs[b]);
+        STEP(1);
+        wlat(mach, ins->imm + cpu.asregs.regs[ins->a],
+             cpu.asregs.regs[ins->b]);
+        NEXT_CHECK;
+    INSN(OP_FUSE_PUSH_PUSH) /* push; push */
+        FUSED(OP_FUSE_PUSH_PUSH);
+        push_reg(mach, a, b);
+        STEP(1);
+        push_reg(mach, ins->a, ins->b);
+        NEXT_CHECK;
+    INSN(OP_FUSE_PUSH_JSRA) /* push; jsra */
+        FUSED(OP_FUSE_PUSH_JSRA);
+        push_reg(mach, a, b);
+        STEP(1);
+        push_frame(mach, npc);
+        npc = ins->imm;
+        NEXT_CHECK;
+    }
+    goto retire;
 
+out:
     /* Hide away the things we've cached while executing.  */
     cpu.asregs.regs[PC_REGNO] = pc;
-    cpu.asregs.insts += insts; /* instructions done ... */
+    cpu.asregs.insts = insts; /* instructions done ... */
 
     return cpu.asregs.exception;
 }
+
+template <unsigned policy>
+static int run_engine(machine &mach, unsigned long long cpu_budget)
+{
+#ifdef MOXIE_JIT
+    if (mach.engine == ENGINE_JIT)
+        return run_blocks<ENGINE_JIT, policy>(mach, cpu_budget);
+#endif
+#ifdef HAVE_COMPUTED_GOTO
+    if (mach.engine == ENGINE_THREADED)
+        return run_blocks<ENGINE_THREADED, policy>(mach, cpu_budget);
+#endif
+    if (mach.engine == ENGINE_TRACE)
+        return run_blocks<ENGINE_TRACE, policy>(mach, cpu_budget);
+
+    return run_blocks<ENGINE_SWITCH, policy>(mach, cpu_budget);
+}
+
+#define SWITCH_POLICIES(p)                                            \
+    run_blocks<ENGINE_SWITCH, p>, run_blocks<ENGINE_SWITCH, p + 1>,   \
+        run_blocks<ENGINE_SWITCH, p + 2>, run_blocks<ENGINE_SWITCH, p + 3>
+
+static int run_policy(machine &mach,
+                      unsigned long long cpu_budget,
+                      unsigned policy)
+{
+    static int (*const instrumented[POLICY_COUNT])(
+        machine &, unsigned long long) = {
+        SWITCH_POLICIES(0),  SWITCH_POLICIES(4),  SWITCH_POLICIES(8),
+        SWITCH_POLICIES(12), SWITCH_POLICIES(16), SWITCH_POLICIES(20),
+        SWITCH_POLICIES(24), SWITCH_POLICIES(28),
+    };
+
+    if (mach.flat.base)
+        mach.flat.activate();
+
+    if (cpu_budget)
+        policy |= POLICY_BUDGET;
+    if (mach.tracing)
+        policy |= POLICY_TRACE;
+    if (mach.profiling)
+        policy |= POLICY_PROFILE;
+    if (mach.countFusions)
+        policy |= POLICY_FUSIONS;
+
+    if (policy & POLICY_INSTRUMENT)
+        return instrumented[policy](mach, cpu_budget);
+
+    switch (policy) {
+    case POLICY_BUDGET:
+        return run_engine<POLICY_BUDGET>(mach, cpu_budget);
+    case POLICY_FUSIONS:
+        return run_engine<POLICY_FUSIONS>(mach, cpu_budget);
+    case POLICY_FUSIONS | POLICY_BUDGET:
+        return run_engine<POLICY_FUSIONS | POLICY_BUDGET>(mach, cpu_budget);
+    default:
+        return run_engine<0>(mach, cpu_budget);
+    }
+}
+
+int sim_resume(machine &mach, unsigned long long cpu_budget)
+{
+    return run_policy(mach, cpu_budget, 0);
+}
+
+/* Run a single instruction, stopping with SIGTRAP if it raised
+   nothing else.  */
+int sim_step(machine &mach)
+{
+    return run_policy(mach, 0, POLICY_STEP);
+}
+
+/* The condition code register as the last cmp would have set it.  */
+word sim_cc(const machine &mach)
+{
+    const struct moxie_regset &r = mach.cpu.asregs;
+
+    return r.ccLazy ? compare(r.cca, r.ccb) : r.cc;
+}
+
+void sim_report_fusions(machine &mach)
+{
+    static const char *const names[NUM_FUSIONS] = {
+        "cmp; bcc",     "ldi.l; cmp; bcc", "ldi.l; add",   "ldi.l; and",
+        "ldo.l; ldo.l", "ldo.l; sto.l",    "push; push",   "push; jsra",
+    };
+
+    fprintf(stderr, "Superinstructions executed:\n");
+    for (int i = 0; i < NUM_FUSIONS; i++)
+        fprintf(stderr, "  %-16s %llu\n", names[i], mach.fusions[i]);
+}
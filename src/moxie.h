@@ -42,6 +42,8 @@ struct moxie_regset {
     word regs[NUM_MOXIE_REGS + 1]; /* primary registers */
     word sregs[256];               /* special registers */
     word cc;                       /* the condition code reg */
+    word cca, ccb;                 /* operands of the last cmp ... */
+    int ccLazy;                    /* ... which cc is computed from */
     int exception;
     unsigned long long insts; /* instruction counter */
 };
@@ -0,0 +1,333 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* One line of the manifest, and how its run ended.  */
+struct batchJob {
+    unsigned int line;
+    string progFilename;
+    vector<string> dataFiles;
+    string outFilename;
+    unsigned long long budget;
+
+    string status;
+    int exitCode;
+    unsigned long long insts;
+    unsigned long long usecs;
+};
+
+/* Jobs queued for one worker.  A worker takes jobs from the back of its
+   own queue, and steals from the front of the others once it is empty.  */
+struct batchQueue {
+    mutex lock;
+    deque<size_t> jobs;
+};
+
+static moxie_engine engine = ENGINE_SWITCH;
+static unsigned long long defaultBudget = 0;
+static bool hle = false;
+static uint32_t stackSize = MACH_STACK_SIZE;
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <manifest>\n"
+            "\n"
+            "Each line of <manifest> is a job:\n"
+            "  -e <file> [-d <file>]... [-o <file>] [--budget=<n>]\n"
+            "\n"
+            "options:\n"
+            "-j <n>\t\t\tRun <n> jobs at a time (default: one per CPU)\n"
+            "-s <file>\t\tWrite job status to <file> (default: stdout)\n"
+            "--engine=<name>\t\tInterpreter core: switch (default), "
+            "threaded, jit, trace\n"
+            "--budget=<n>\t\tStop jobs after <n> instructions\n"
+            "--hle\t\t\tRun memcpy, memset, memcmp, strlen, memchr and\n"
+            "\t\t\tstrstr of the programs natively\n"
+            "--stack-size=<n>\tReserve <n> bytes (K or M suffix) of stack "
+            "(default 64K)\n",
+            progname);
+}
+
+static bool readManifest(const char *filename, vector<batchJob> &jobs)
+{
+    FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    bool ok = true;
+    unsigned int lineNo = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    while (ok && getline(&line, &cap, f) >= 0) {
+        batchJob job;
+        job.line = ++lineNo;
+        job.budget = defaultBudget;
+        job.exitCode = 0;
+        job.insts = 0;
+        job.usecs = 0;
+
+        char *save, *tok = strtok_r(line, " \t\r\n", &save);
+        if (!tok || tok[0] == '#')
+            continue;
+
+        for (; tok && ok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (!strncmp(tok, "--budget=", 9)) {
+                ok = parseBudget(tok + 9, job.budget);
+                continue;
+            }
+
+            char *arg = strtok_r(NULL, " \t\r\n", &save);
+            if (!arg || tok[0] != '-' || !tok[1] || tok[2])
+                ok = false;
+            else if (tok[1] == 'e')
+                job.progFilename = arg;
+            else if (tok[1] == 'd')
+                job.dataFiles.push_back(arg);
+            else if (tok[1] == 'o')
+                job.outFilename = arg;
+            else
+                ok = false;
+        }
+
+        if (job.progFilename.empty())
+            ok = false;
+        if (!ok)
+            fprintf(stderr, "%s:%u: invalid job\n", filename, lineNo);
+        else
+            jobs.push_back(job);
+    }
+
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return ok;
+}
+
+static bool writeOutput(machine &mach, const string &outFilename)
+{
+    uint32_t vaddr = mach.cpu.asregs.sregs[6];
+    uint32_t length = mach.cpu.asregs.sregs[7];
+    if (outFilename.empty() || !vaddr || !length)
+        return true;
+
+    if (!mach.findRange(vaddr, length))
+        return false;
+
+    int fd = open(outFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+
+    if (!writeGuestOutput(mach, vaddr, length, fd)) {
+        close(fd);
+        return false;
+    }
+
+    return close(fd) == 0;
+}
+
+static unsigned long long nowUsecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Load and run one job on a machine of its own.  */
+static void runJob(batchJob &job)
+{
+    unsigned long long start = nowUsecs();
+    machine mach;
+    mach.engine = engine;
+    mach.stackSize = stackSize;
+
+    bool loaded = loadElfProgram(mach, job.progFilename);
+    for (unsigned int i = 0; loaded && i < job.dataFiles.size(); i++)
+        loaded = loadRawData(mach, job.dataFiles[i]);
+
+    if (!loaded)
+        job.status = "load-failed";
+    else {
+        addStackMem(mach);
+        addMapDescriptor(mach);
+        mach.cpu.asregs.regs[PC_REGNO] = mach.startAddr;
+        if (hle)
+            hleInit(mach);
+
+        sim_resume(mach, job.budget);
+        job.insts = mach.cpu.asregs.insts;
+
+        int sig = mach.cpu.asregs.exception;
+        if (!sig)
+            job.status = "budget";
+        else if (sig != SIGQUIT)
+            job.status = "exception-" + to_string(sig);
+        else if (!writeOutput(mach, job.outFilename))
+            job.status = "output-failed";
+        else {
+            job.status = "ok";
+            job.exitCode = mach.cpu.asregs.regs[2] & 0xff;
+        }
+    }
+
+    job.usecs = nowUsecs() - start;
+}
+
+static void worker(unsigned int self,
+                   vector<batchQueue> &queues,
+                   vector<batchJob> &jobs)
+{
+    for (;;) {
+        size_t next = jobs.size();
+
+        for (unsigned int i = 0; i < queues.size() && next == jobs.size();
+             i++) {
+            batchQueue &q = queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(q.lock);
+            if (q.jobs.empty())
+                continue;
+            if (!i) {
+                next = q.jobs.back();
+                q.jobs.pop_back();
+            } else {
+                next = q.jobs.front();
+                q.jobs.pop_front();
+            }
+        }
+
+        // jobs are never requeued, so every queue stays empty
+        if (next == jobs.size())
+            return;
+
+        runJob(jobs[next]);
+    }
+}
+
+enum {
+    OPT_ENGINE = 256,
+    OPT_BUDGET,
+    OPT_HLE,
+    OPT_STACK_SIZE,
+};
+
+static const struct option longOptions[] = {
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"budget", required_argument, NULL, OPT_BUDGET},
+    {"hle", no_argument, NULL, OPT_HLE},
+    {"stack-size", required_argument, NULL, OPT_STACK_SIZE},
+    {NULL, 0, NULL, 0},
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned int nthreads = thread::hardware_concurrency();
+    const char *statusFilename = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "j:s:", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            if (!nthreads) {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 's':
+            statusFilename = optarg;
+            break;
+
+        case OPT_ENGINE:
+            if (!parseEngine(optarg, engine)) {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_BUDGET:
+            if (!parseBudget(optarg, defaultBudget)) {
+                fprintf(stderr, "Invalid budget %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_HLE:
+            hle = true;
+            break;
+
+        case OPT_STACK_SIZE:
+            if (!parseStackSize(optarg, stackSize)) {
+                fprintf(stderr, "Invalid stack size %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    vector<batchJob> jobs;
+    if (!readManifest(argv[optind], jobs))
+        exit(EXIT_FAILURE);
+
+    FILE *status = stdout;
+    if (statusFilename && !(status = fopen(statusFilename, "w"))) {
+        perror(statusFilename);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!nthreads)
+        nthreads = 1;
+    if (nthreads > jobs.size() && !jobs.empty())
+        nthreads = jobs.size();
+
+    // deal the jobs out in turn; idle workers steal the rest
+    vector<batchQueue> queues(nthreads);
+    for (size_t i = 0; i < jobs.size(); i++)
+        queues[i % nthreads].jobs.push_front(i);
+
+    vector<thread> threads;
+    for (unsigned int i = 0; i < nthreads; i++)
+        threads.push_back(thread(worker, i, ref(queues), ref(jobs)));
+    for (unsigned int i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    int ret = EXIT_SUCCESS;
+    fprintf(status, "# line\tstatus\texit\tinstructions\tmicroseconds\n");
+    for (size_t i = 0; i < jobs.size(); i++) {
+        batchJob &job = jobs[i];
+        fprintf(status, "%u\t%s\t%d\t%llu\t%llu\n", job.line,
+                job.status.c_str(), job.exitCode, job.insts, job.usecs);
+        if (job.status != "ok" || job.exitCode)
+            ret = EXIT_FAILURE;
+    }
+
+    if (status != stdout)
+        fclose(status);
+    return ret;
+}
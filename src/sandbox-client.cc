@@ -0,0 +1,266 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* Sends one job to sandbox --serve and reports how it ended, the way
+   sandbox-batch does: a line with the status, exit status and
+   instructions executed.  Exits with the job's exit status, like
+   sandbox.  */
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <socket>\n"
+            "\n"
+            "options:\n"
+            "-e <file>\t\tRun executable <file>, as the server finds it\n"
+            "-d <file>\t\tAttach data <file>; may be repeated\n"
+            "-o <file>\t\tWrite the output to <file>\n"
+            "--budget=<n>\t\tStop after <n> instructions\n"
+            "--seal-input\t\tAttach each data file as a sealed memfd\n"
+            "--seal-output\t\tAsk for a sealed output memfd, and check it\n",
+            progname);
+}
+
+enum {
+    OPT_BUDGET = 256,
+    OPT_SEAL_INPUT,
+    OPT_SEAL_OUTPUT,
+};
+
+static const struct option longOptions[] = {
+    {"budget", required_argument, NULL, OPT_BUDGET},
+    {"seal-input", no_argument, NULL, OPT_SEAL_INPUT},
+    {"seal-output", no_argument, NULL, OPT_SEAL_OUTPUT},
+    {NULL, 0, NULL, 0},
+};
+
+/* Open filename for the server: as it is, or copied into a memfd
+   sealed against any change.  Returns -1 on failure.  */
+static int openInput(const char *filename, bool seal)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || !seal)
+        return fd;
+
+    int copy = memfd_create("moxie-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    char buf[65536];
+    ssize_t bytes;
+    while (copy >= 0 && (bytes = read(fd, buf, sizeof(buf))) != 0)
+        if (bytes < 0 || write(copy, buf, bytes) != bytes) {
+            close(copy);
+            copy = -1;
+        }
+    close(fd);
+
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    if (copy >= 0 && fcntl(copy, F_ADD_SEALS, seals) < 0) {
+        close(copy);
+        copy = -1;
+    }
+    return copy;
+}
+
+/* Copy the output memfd to outFilename.  */
+static bool saveOutput(int fd, uint64_t length, const char *outFilename)
+{
+    int out = open(outFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+        return false;
+
+    char buf[65536];
+    uint64_t done = 0;
+    bool ok = true;
+    while (ok && done < length) {
+        size_t want = min<uint64_t>(sizeof(buf), length - done);
+        ssize_t bytes = pread(fd, buf, want, done);
+        ok = bytes > 0 && write(out, buf, bytes) == bytes;
+        done += want;
+    }
+
+    return close(out) == 0 && ok;
+}
+
+int main(int argc, char *argv[])
+{
+    struct serveRequest req;
+    memset(&req, 0, sizeof(req));
+    req.version = SERVE_VERSION;
+
+    const char *progFilename = NULL, *outFilename = NULL;
+    vector<const char *> dataFiles;
+    bool sealInput = false;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "e:d:o:", longOptions, NULL)) !=
+           -1) {
+        switch (opt) {
+        case 'e':
+            progFilename = optarg;
+            break;
+
+        case 'd':
+            dataFiles.push_back(optarg);
+            break;
+
+        case 'o':
+            outFilename = optarg;
+            break;
+
+        case OPT_BUDGET: {
+            unsigned long long budget;
+            if (!parseBudget(optarg, budget)) {
+                fprintf(stderr, "Invalid budget %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            req.budget = budget;
+            break;
+        }
+
+        case OPT_SEAL_INPUT:
+            sealInput = true;
+            break;
+
+        case OPT_SEAL_OUTPUT:
+            req.flags |= SERVE_SEAL_OUTPUT;
+            break;
+
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1 || !progFilename ||
+        dataFiles.size() > SERVE_MAX_FDS) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strlen(progFilename) >= sizeof(req.program)) {
+        fprintf(stderr, "Pathname too long: %s\n", progFilename);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(req.program, progFilename);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, argv[optind]);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    vector<int> fds;
+    for (unsigned int i = 0; i < dataFiles.size(); i++) {
+        int fd = openInput(dataFiles[i], sealInput);
+        if (fd < 0) {
+            perror(dataFiles[i]);
+            exit(EXIT_FAILURE);
+        }
+        fds.push_back(fd);
+    }
+
+    char cbuf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty()) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(c), fds.data(), fds.size() * sizeof(int));
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req)) {
+        perror("sendmsg");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < fds.size(); i++)
+        close(fds[i]);
+
+    struct serveResponse resp;
+    memset(&resp, 0, sizeof(resp));
+    iov.iov_base = &resp;
+    iov.iov_len = sizeof(resp);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(resp) ||
+        resp.version != SERVE_VERSION) {
+        fprintf(stderr, "Invalid response from %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    close(sock);
+
+    int outFd = -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(&outFd, CMSG_DATA(c), sizeof(int));
+
+    // the server fails a job with an errno before running it, or after,
+    // if it cannot pass the output back
+    string status;
+    if (resp.error && resp.exception == SIGQUIT)
+        status = "output-failed";
+    else if (resp.error)
+        status = "error-" + to_string(resp.error);
+    else if (!resp.exception)
+        status = "budget";
+    else if (resp.exception != SIGQUIT)
+        status = "exception-" + to_string(resp.exception);
+    else if (resp.outputLength && outFd < 0)
+        status = "output-failed";
+    else
+        status = "ok";
+
+    // a sealed output must stay as it is, whoever else holds it
+    int want = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+    int seals = outFd >= 0 ? fcntl(outFd, F_GET_SEALS) : 0;
+    if ((req.flags & SERVE_SEAL_OUTPUT) && outFd >= 0 &&
+        (seals < 0 || (seals & want) != want))
+        status = "output-unsealed";
+
+    if (status == "ok" && outFd >= 0 && outFilename &&
+        !saveOutput(outFd, resp.outputLength, outFilename))
+        status = "output-failed";
+
+    bool ok = status == "ok";
+    printf("%s\t%d\t%llu\n", status.c_str(), ok ? resp.exitCode : 0,
+           (unsigned long long) resp.insts);
+    if (resp.error)
+        fprintf(stderr, "%s: %s\n", progFilename, strerror(resp.error));
+
+    return ok ? resp.exitCode : EXIT_FAILURE;
+}
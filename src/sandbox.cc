@@ -1,13 +1,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <signal.h>
@@ -15,31 +19,6 @@
 
 using namespace std;
 
-static const uint32_t STACK_SIZE = 64 * 1024;
-
-static bool loadRawData(machine &mach, const string &filename)
-{
-    // open and mmap input file
-    mfile pf(filename);
-    if (!pf.open(O_RDONLY))
-        return false;
-
-    static unsigned int dataCount = 0;
-    char tmpstr[32];
-
-    // alloc new data memory range
-    sprintf(tmpstr, "data%u", dataCount++);
-    size_t sz = pf.st.st_size;
-    addressRange *rdr = new addressRange(tmpstr, sz);
-
-    // copy mmap'd data into local buffer
-    rdr->buf.assign((char *) pf.data, sz);
-    rdr->updateRoot();
-
-    // add to global memory map
-    return mach.mapInsert(rdr);
-}
-
 static void usage(const char *progname)
 {
     fprintf(stderr,
@@ -50,11 +29,35 @@ static void usage(const char *progname)
             "-e <hash|pathname>\tLoad specified Moxie executable into address "
             "space\n"
             "-D <directory>\t\tAdd to data hash search path list\n"
-            "-d <file>\t\tLoad data into address space\n"
+            "-d <hash|file>\t\tLoad data into address space\n"
             "-o <file>\t\tOutput data to <file>.  \"-\" for stdout\n"
             "-t\t\t\tEnabling simulator tracing\n"
             "-g <port>\t\tWait for GDB connection on given port\n"
-            "-p <file>\t\tWrite gprof formatted profile data to <file>\n",
+            "-p <file>\t\tWrite gprof formatted profile data to <file>\n"
+            "--engine=<name>\t\tInterpreter core: switch (default), "
+            "threaded, jit, trace\n"
+            "--fusion-report\t\tList the superinstructions executed\n"
+            "--flat-memory\t\tMap guest memory into one 4 GiB host "
+            "reservation\n"
+            "--budget=<n>\t\tStop after <n> instructions\n"
+            "--hle\t\t\tRun memcpy, memset, memcmp, strlen, memchr and\n"
+            "\t\t\tstrstr of the program natively\n"
+            "--aot=<file|dir>\tRun blocks translated by moxie-aot, from\n"
+            "\t\t\t<file> or <dir>/<sha256 of executable>.so\n"
+            "--jobs=<file>\t\tRun each line of <file> (-d and -o options)\n"
+            "\t\t\tas a job forked from one loaded program\n"
+            "--snapshot=<point>\tFork jobs at the program's entry "
+            "(default)\n"
+            "\t\t\tor its moxie_snapshot() marker\n"
+            "--serve=<socket>\tRun jobs sent to the Unix socket <socket>\n"
+            "--threads=<n>\t\tRun <n> --serve jobs at a time (default: one\n"
+            "\t\t\tper CPU)\n"
+            "--image-cache=<dir>\tKeep prepared images of executables in "
+            "<dir>\n"
+            "--lazy-data\t\tRead data files page by page as they are "
+            "used\n"
+            "--stack-size=<n>\tReserve <n> bytes (K or M suffix) of stack "
+            "(default 64K)\n",
             progname);
 }
 
@@ -67,67 +70,6 @@ static void printMemMap(machine &mach)
     }
 }
 
-static void addStackMem(machine &mach)
-{
-    // alloc r/w memory range
-    addressRange *rdr = new addressRange("stack", STACK_SIZE);
-
-    rdr->buf.resize(STACK_SIZE);
-    rdr->updateRoot();
-    rdr->readOnly = false;
-
-    // add memory range to global memory map
-    mach.mapInsert(rdr);
-
-    // set SR #7 to now-initialized stack vaddr
-    mach.cpu.asregs.sregs[7] = rdr->end;
-}
-
-static void addMapDescriptor(machine &mach)
-{
-    // fill list from existing memory map
-    vector<struct mach_memmap_ent> desc;
-    mach.fillDescriptors(desc);
-
-    // add entry for the mapdesc range to be added to memory map
-    struct mach_memmap_ent mme_self;
-    memset(&mme_self, 0, sizeof(mme_self));
-    desc.push_back(mme_self);
-
-    // add blank entry for list terminator
-    struct mach_memmap_ent mme_end;
-    memset(&mme_end, 0, sizeof(mme_end));
-    desc.push_back(mme_end);
-
-    // calc total region size
-    size_t sz = sizeof(mme_end) * desc.size();
-
-    // manually fill in mapdesc range descriptor
-    mme_self.length = sz;
-    strcpy(mme_self.tags, "ro,mapdesc,");
-
-    // build entry for global memory map
-    addressRange *ar = new addressRange("mapdesc", sz);
-
-    // allocate space for descriptor array
-    ar->buf.resize(sz);
-    ar->updateRoot();
-
-    // copy 'desc' array into allocated memory space
-    unsigned int i = 0;
-    for (vector<struct mach_memmap_ent>::iterator it = desc.begin();
-         it != desc.end(); it++, i++) {
-        struct mach_memmap_ent &mme = (*it);
-        memcpy(&ar->buf[i * sizeof(mme)], &mme, sizeof(mme));
-    }
-
-    // add memory range to global memory map
-    mach.mapInsert(ar);
-
-    // set SR #6 to now-initialized mapdesc start vaddr
-    mach.cpu.asregs.sregs[6] = ar->start;
-}
-
 static void gatherOutput(machine &mach, const string &outFilename)
 {
     if (!outFilename.size())
@@ -138,8 +80,7 @@ static void gatherOutput(machine &mach, const string &outFilename)
     if (!vaddr || !length)
         return;
 
-    char *p = (char *) mach.physaddr(vaddr, length);
-    if (!p) {
+    if (!mach.findRange(vaddr, length)) {
         fprintf(stderr, "Sim exception %d (%s) upon output\n", SIGBUS,
                 strsignal(SIGBUS));
         exit(EXIT_FAILURE);
@@ -156,20 +97,22 @@ static void gatherOutput(machine &mach, const string &outFilename)
         }
     }
 
-    while (length > 0) {
-        ssize_t bytes = write(fd, p, length);
-        if (bytes < 0) {
-            perror(outFilename.c_str());
-            exit(EXIT_FAILURE);
-        }
-
-        length -= bytes;
-        p += bytes;
+    // sandbox exits next, so pipes may take the guest pages themselves
+    if (!writeGuestOutput(mach, vaddr, length, fd, true)) {
+        perror(outFilename.c_str());
+        exit(EXIT_FAILURE);
     }
 
     close(fd);
 }
 
+/* Whether an -e or -d argument names a SHA-256, to look up in the -E
+   or -D directories.  */
+static bool isHash(const char *arg)
+{
+    return strlen(arg) == SHA256_SIZE * 2 && IsHex(arg);
+}
+
 static bool isDir(const char *pathname)
 {
     struct stat st;
@@ -180,6 +123,91 @@ static bool isDir(const char *pathname)
     return S_ISDIR(st.st_mode);
 }
 
+enum {
+    OPT_ENGINE = 256,
+    OPT_FUSION_REPORT,
+    OPT_FLAT_MEMORY,
+    OPT_BUDGET,
+    OPT_AOT,
+    OPT_HLE,
+    OPT_JOBS,
+    OPT_SNAPSHOT,
+    OPT_SERVE,
+    OPT_THREADS,
+    OPT_IMAGE_CACHE,
+    OPT_LAZY_DATA,
+    OPT_STACK_SIZE,
+};
+
+static bool fusionReport = false;
+static unsigned long long cpuBudget = 0;
+static string jobsFilename;
+static bool snapshotMarker = false;
+static string servePath;
+static unsigned int serveThreads = 0;
+static bool hle = false;
+
+static const struct option longOptions[] = {
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"fusion-report", no_argument, NULL, OPT_FUSION_REPORT},
+    {"flat-memory", no_argument, NULL, OPT_FLAT_MEMORY},
+    {"budget", required_argument, NULL, OPT_BUDGET},
+    {"aot", required_argument, NULL, OPT_AOT},
+    {"hle", no_argument, NULL, OPT_HLE},
+    {"jobs", required_argument, NULL, OPT_JOBS},
+    {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+    {"serve", required_argument, NULL, OPT_SERVE},
+    {"threads", required_argument, NULL, OPT_THREADS},
+    {"image-cache", required_argument, NULL, OPT_IMAGE_CACHE},
+    {"lazy-data", no_argument, NULL, OPT_LAZY_DATA},
+    {"stack-size", required_argument, NULL, OPT_STACK_SIZE},
+    {NULL, 0, NULL, 0},
+};
+
+/* Load the executable named by arg, a pathname or, with -E directories
+   or an image cache, a SHA-256.  With an image cache, the prepared image
+   of the executable is mapped if there is one, and written otherwise.
+   progHash is set to the executable's SHA-256 when it is known.  */
+static bool loadProgram(machine &mach,
+                        const char *arg,
+                        const vector<string> &pathExec,
+                        const string &imageCache,
+                        string &progHash)
+{
+    bool byHash = isHash(arg) && (!pathExec.empty() || !imageCache.empty());
+    string hash;
+    if (byHash)
+        hash = HexStr(ParseHex(arg).data(), SHA256_SIZE);
+    else if (!imageCache.empty() && !sha256File(arg, hash))
+        return false;
+
+    string imageFile;
+    if (!imageCache.empty()) {
+        imageFile = imageCache + "/" + hash + ".img";
+        if (loadImage(mach, imageFile)) {
+            progHash = hash;
+            return true;
+        }
+    }
+
+    vector<addressRange *> before = mach.memmap;
+    if (!(byHash ? loadElfHash(mach, arg, pathExec)
+                 : loadElfProgram(mach, arg)))
+        return false;
+    progHash = hash;
+
+    if (!imageFile.empty()) {
+        vector<addressRange *> ranges;
+        for (unsigned int i = 0; i < mach.memmap.size(); i++)
+            if (find(before.begin(), before.end(), mach.memmap[i]) ==
+                before.end())
+                ranges.push_back(mach.memmap[i]);
+        if (!saveImage(mach, ranges, imageFile))
+            fprintf(stderr, "Image not saved to %s\n", imageFile.c_str());
+    }
+    return true;
+}
+
 static void sandboxInit(machine &mach,
                         int argc,
                         char **argv,
@@ -191,8 +219,11 @@ static void sandboxInit(machine &mach,
     vector<string> pathData;
 
     bool progLoaded = false;
+    bool flatMemory = false;
+    string progFilename, progHash, aotPath, imageCache;
     int opt;
-    while ((opt = getopt(argc, argv, "E:e:D:d:o:tg:p:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "E:e:D:d:o:tg:p:", longOptions,
+                              NULL)) != -1) {
         switch (opt) {
         case 'E':
             if (!isDir(optarg)) {
@@ -202,13 +233,12 @@ static void sandboxInit(machine &mach,
             pathExec.push_back(optarg);
             break;
         case 'e':
-            bool rc;
-            rc = loadElfProgram(mach, optarg);
-            if (!rc) {
+            if (!loadProgram(mach, optarg, pathExec, imageCache, progHash)) {
                 fprintf(stderr, "ELF load failed for %s\n", optarg);
                 exit(EXIT_FAILURE);
             }
             progLoaded = true;
+            progFilename = optarg;
             break;
         case 'D':
             if (!isDir(optarg)) {
@@ -218,7 +248,9 @@ static void sandboxInit(machine &mach,
             pathData.push_back(optarg);
             break;
         case 'd':
-            if (!loadRawData(mach, optarg)) {
+            if (isHash(optarg) && !pathData.empty()
+                    ? !loadDataHash(mach, optarg, pathData)
+                    : !loadRawData(mach, optarg)) {
                 fprintf(stderr, "Data load failed for %s\n", optarg);
                 exit(EXIT_FAILURE);
             }
@@ -241,23 +273,138 @@ static void sandboxInit(machine &mach,
             gmonFilename = optarg;
             break;
 
+        case OPT_ENGINE:
+            if (!parseEngine(optarg, mach.engine)) {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_FUSION_REPORT:
+            fusionReport = true;
+            mach.countFusions = true;
+            break;
+
+        case OPT_FLAT_MEMORY:
+            flatMemory = true;
+            break;
+
+        case OPT_BUDGET:
+            if (!parseBudget(optarg, cpuBudget)) {
+                fprintf(stderr, "Invalid budget %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_IMAGE_CACHE:
+            if (!isDir(optarg)) {
+                fprintf(stderr, "%s not a directory\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            imageCache = optarg;
+            break;
+
+        case OPT_STACK_SIZE:
+            if (!parseStackSize(optarg, mach.stackSize)) {
+                fprintf(stderr, "Invalid stack size %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_LAZY_DATA:
+            mach.lazyData = true;
+            break;
+
+        case OPT_AOT:
+            aotPath = optarg;
+            break;
+
+        case OPT_HLE:
+            hle = true;
+            break;
+
+        case OPT_JOBS:
+            jobsFilename = optarg;
+            break;
+
+        case OPT_SNAPSHOT:
+            if (!strcmp(optarg, "marker"))
+                snapshotMarker = true;
+            else if (strcmp(optarg, "entry")) {
+                fprintf(stderr, "Unknown snapshot point %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_SERVE:
+            servePath = optarg;
+            break;
+
+        case OPT_THREADS:
+            serveThreads = atoi(optarg);
+            if (!serveThreads) {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         default:
             usage(argv[0]);
             exit(EXIT_FAILURE);
         }
     }
 
+    // programs come with each request
+    if (!servePath.empty()) {
+        if (progLoaded || flatMemory || !aotPath.empty() || mach.lazyData) {
+            fprintf(stderr, "--serve cannot be used with -e, --flat-memory, "
+                            "--aot or --lazy-data\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
     if (!progLoaded) {
         fprintf(stderr, "No Moxie program loaded.\n");
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    // forked jobs would share the flat space's memfd
+    if (flatMemory && !jobsFilename.empty()) {
+        fprintf(stderr, "--flat-memory cannot be used with --jobs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (flatMemory && mach.lazyData) {
+        fprintf(stderr, "--flat-memory cannot be used with --lazy-data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (flatMemory && !mach.flatInit()) {
+        perror("flat address space");
+        exit(EXIT_FAILURE);
+    }
+
     addStackMem(mach);
-    addMapDescriptor(mach);
+
+    // each job adds its data, then the descriptor
+    if (jobsFilename.empty())
+        addMapDescriptor(mach);
 
     mach.cpu.asregs.regs[PC_REGNO] = mach.startAddr;
 
+    if (hle)
+        hleInit(mach);
+
+    // translated code only runs for the exact executable it came from
+    string hash = progHash;
+    if (!aotPath.empty() &&
+        ((hash.empty() && !sha256File(progFilename, hash)) ||
+         !mach.aot.load(mach, aotPath, hash)))
+        fprintf(stderr, "AOT code not loaded, interpreting %s\n",
+                progFilename.c_str());
+
     printMemMap(mach);
 }
 
@@ -363,6 +510,27 @@ static uint32_t readDelimitedHexValue(char *buffer, int *index)
     return n;
 }
 
+/* GDB numbers $cc after $pc.  cmp leaves it to be computed on demand.  */
+enum {
+    GDB_CC_REGNO = NUM_MOXIE_REGS,
+};
+
+static word gdbReadRegister(machine &mach, int r)
+{
+    if (r == GDB_CC_REGNO)
+        return sim_cc(mach);
+    return mach.cpu.asregs.regs[r];
+}
+
+static void gdbWriteRegister(machine &mach, int r, word v)
+{
+    if (r == GDB_CC_REGNO) {
+        mach.cpu.asregs.cc = v;
+        mach.cpu.asregs.ccLazy = 0;
+    } else
+        mach.cpu.asregs.regs[r] = v;
+}
+
 static int gdb_main_loop(uint32_t &gdbPort, machine &mach)
 {
     int sockfd, newsockfd, on;
@@ -426,10 +594,20 @@ static int gdb_main_loop(uint32_t &gdbPort, machine &mach)
                     (void) wrc;
                     break;
                 }
+                case 's': {
+                    wrc = write(newsockfd, "+", 1);
+                    int sig = sim_step(mach);
+                    sprintf(reply, "S%.2d", sig);
+                    sendGdbReply(newsockfd, reply);
+                    i += 4;
+
+                    (void) wrc;
+                    break;
+                }
                 case 'g': {
                     int ri;
-                    for (ri = 0; ri < 17; ri++) {
-                        uint32_t rv = mach.cpu.asregs.regs[ri];
+                    for (ri = 0; ri <= GDB_CC_REGNO; ri++) {
+                        uint32_t rv = gdbReadRegister(mach, ri);
                         sprintf(&reply[ri * 8], "%02x%02x%02x%02x",
                                 (rv >> 0) & 0xff, (rv >> 8) & 0xff,
                                 (rv >> 16) & 0xff, (rv >> 24) & 0xff);
@@ -459,6 +637,9 @@ static int gdb_main_loop(uint32_t &gdbPort, machine &mach)
                     uint32_t addr = readDelimitedHexValue(buffer, &++i);
                     uint32_t length = readDelimitedHexValue(buffer, &i);
                     char *p = (char *) mach.physaddr(addr, length);
+                    mach.bbcache.invalidate(addr, length);
+                    // patched code no longer matches its translation
+                    mach.aot.disable();
                     while (length-- > 0)
                         *p++ = readHexValueFixedLength(buffer, &i, 2);
                     sendGdbReply(newsockfd, "OK");
@@ -468,13 +649,13 @@ static int gdb_main_loop(uint32_t &gdbPort, machine &mach)
                     int r = readDelimitedHexValue(buffer, &++i);
                     char buf[9];
                     sendGdbReply(newsockfd,
-                                 word2hex(buf, mach.cpu.asregs.regs[r]));
+                                 word2hex(buf, gdbReadRegister(mach, r)));
                     i += 2;
                 } break;
                 case 'P': {
                     int r = readDelimitedHexValue(buffer, &++i);
                     word v = readDelimitedHexValue(buffer, &i);
-                    mach.cpu.asregs.regs[r] = v;
+                    gdbWriteRegister(mach, r, v);
                     sendGdbReply(newsockfd, "S05");
                     i += 2;
                 } break;
@@ -495,7 +676,7 @@ static int gdb_main_loop(uint32_t &gdbPort, machine &mach)
     }
 }
 
-static void saveProfileData(machine mach, string gmonFilename)
+static void saveProfileData(machine &mach, const string &gmonFilename)
 {
     FILE *f = fopen(gmonFilename.c_str(), "w");
 
@@ -541,18 +722,24 @@ static void saveProfileData(machine mach, string gmonFilename)
     fclose(f);
 }
 
-int main(int argc, char *argv[])
+/* Check how the run ended and write its output.  Returns the exit
+   status of the program.  */
+static int finishRun(machine &mach,
+                     const string &outFilename,
+                     const string &gmonFilename)
 {
-    machine mach;
-    string outFilename, gmonFilename;
-    uint32_t gdbPort = 0;
+    if (fusionReport)
+        sim_report_fusions(mach);
 
-    sandboxInit(mach, argc, argv, outFilename, gmonFilename, gdbPort);
+    if (mach.lazyData)
+        fprintf(stderr, "Data pages touched: %llu of %llu\n",
+                mach.lazyTouched, mach.lazyPages);
 
-    if (gdbPort)
-        gdb_main_loop(gdbPort, mach);
-    else
-        sim_resume(mach);
+    if (!mach.cpu.asregs.exception) {
+        fprintf(stderr, "CPU budget exhausted after %llu instructions\n",
+                mach.cpu.asregs.insts);
+        exit(EXIT_FAILURE);
+    }
 
     if (mach.cpu.asregs.exception != SIGQUIT) {
         fprintf(stderr, "Sim exception %d (%s)\n", mach.cpu.asregs.exception,
@@ -568,3 +755,139 @@ int main(int argc, char *argv[])
     // return $r0, the exit status passed to _exit()
     return (mach.cpu.asregs.regs[2] & 0xff);
 }
+
+/* Run one job in a child forked from the snapshot.  Guest memory is
+   copy-on-write, so the job starts from the snapshot whatever the jobs
+   before it did.  */
+static int runJob(machine &mach,
+                  FILE *jobsFile,
+                  const vector<string> &dataFiles,
+                  const string &outFilename,
+                  const string &gmonFilename)
+{
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+
+    if (pid == 0) {
+        // exit() would move the parent's read position in the job list
+        close(fileno(jobsFile));
+
+        for (unsigned int i = 0; i < dataFiles.size(); i++)
+            if (!loadRawData(mach, dataFiles[i])) {
+                fprintf(stderr, "Data load failed for %s\n",
+                        dataFiles[i].c_str());
+                exit(EXIT_FAILURE);
+            }
+        addMapDescriptor(mach);
+
+        // moxie_snapshot() returns the new memory map
+        if (snapshotMarker)
+            mach.cpu.asregs.regs[2] = mach.cpu.asregs.sregs[6];
+
+        sim_resume(mach, cpuBudget);
+        exit(finishRun(mach, outFilename, gmonFilename));
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) {
+            perror("waitpid");
+            return EXIT_FAILURE;
+        }
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/* Run the jobs listed in jobsFilename, one per line, from the loaded
+   program.  Returns EXIT_FAILURE if any job failed.  */
+static int runJobs(machine &mach, const string &gmonFilename)
+{
+    FILE *f = jobsFilename == "-" ? stdin : fopen(jobsFilename.c_str(), "r");
+    if (!f) {
+        perror(jobsFilename.c_str());
+        return EXIT_FAILURE;
+    }
+
+    // run the program's setup once, up to its marker
+    if (snapshotMarker) {
+        mach.snapshotStop = true;
+        sim_resume(mach, cpuBudget);
+        if (mach.cpu.asregs.exception != SIGSTOP) {
+            fprintf(stderr, "Program stopped before its snapshot marker\n");
+            finishRun(mach, "", gmonFilename);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int ret = EXIT_SUCCESS;
+    unsigned int jobs = 0, lineNo = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) >= 0) {
+        vector<string> dataFiles;
+        string outFilename;
+        bool valid = true;
+
+        lineNo++;
+        char *save, *tok = strtok_r(line, " \t\r\n", &save);
+        if (!tok || tok[0] == '#')
+            continue;
+
+        for (; tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            char *arg = strtok_r(NULL, " \t\r\n", &save);
+            if (!arg || (strcmp(tok, "-d") && strcmp(tok, "-o"))) {
+                valid = false;
+                break;
+            }
+            if (tok[1] == 'd')
+                dataFiles.push_back(arg);
+            else
+                outFilename = arg;
+        }
+
+        jobs++;
+        int rc = EXIT_FAILURE;
+        if (valid)
+            rc = runJob(mach, f, dataFiles, outFilename, gmonFilename);
+        else
+            fprintf(stderr, "Invalid job at line %u\n", lineNo);
+
+        fprintf(stderr, "job %u: exit %d\n", jobs, rc);
+        if (rc)
+            ret = EXIT_FAILURE;
+    }
+
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    machine mach;
+    string outFilename, gmonFilename;
+    uint32_t gdbPort = 0;
+
+    sandboxInit(mach, argc, argv, outFilename, gmonFilename, gdbPort);
+
+    if (!servePath.empty())
+        return sandboxServe(servePath, serveThreads, mach.engine, cpuBudget,
+                            mach.stackSize, hle);
+
+    if (!jobsFilename.empty())
+        return runJobs(mach, gmonFilename);
+
+    if (gdbPort)
+        gdb_main_loop(gdbPort, mach);
+    else
+        sim_resume(mach, cpuBudget);
+
+    return finishRun(mach, outFilename, gmonFilename);
+}
@@ -5,11 +5,14 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
 #include <vector>
 #include <string>
 #include <string.h>
 #include <stdint.h>
 #include <unordered_map>
+#include <memory>
 #include "moxie.h"
 
 typedef std::unordered_map<uint32_t, uint32_t> gprof_bb_map_t;
@@ -18,6 +21,36 @@ typedef std::unordered_map<uint64_t, uint32_t> gprof_cg_map_t;
 enum {
     MACH_PAGE_SIZE = 4096,
     MACH_PAGE_MASK = (MACH_PAGE_SIZE - 1),
+    MACH_PAGE_SHIFT = 12,
+    MACH_STACK_SIZE = 64 * 1024, // default size of the stack range
+    MACH_MAX_STACK_SIZE = 1 << 28,
+};
+
+enum {
+    PT_BITS = 10, // two levels of 1024 entries map the 4 GiB guest space
+    PT_ENTRIES = (1 << PT_BITS),
+    TLB_SIZE = 256, // direct-mapped software TLB entries
+};
+
+enum {
+    BB_MAX_INSNS = 64,   // longest basic block decoded at once
+    BB_HASH_SIZE = 4096, // direct-mapped block lookup table
+};
+
+#if defined(__x86_64__)
+#define MOXIE_JIT 1
+#endif
+
+enum {
+    JIT_HOT_BLOCK = 16,         // executions before a block is translated
+    JIT_BUFFER_SIZE = 16 << 20, // host code buffer
+    JIT_MAX_RUN = 1 << 30,      // instructions per native call
+};
+
+enum {
+    TRACE_HOT_LOOP = 32,   // backward branches to a block before recording
+    TRACE_MAX_BLOCKS = 16, // longest recorded trace
+    TRACE_MAX_CHECKS = 8,  // range checks hoisted to trace entry
 };
 
 static inline bool eqVec(const std::vector<unsigned char> &a,
@@ -52,6 +85,7 @@ public:
     }
 
     bool open(int flags, mode_t mode = 0, bool map = true);
+    bool attach(int fd_, int flags);
 };
 
 struct mach_memmap_ent {
@@ -68,6 +102,42 @@ public:
     cpuState() { memset(&asregs, 0, sizeof(asregs)); }
 };
 
+/* Part of a file, or anonymous memory, mapped in place of a range
+   buffer.  Read-only ranges share the page cache; writable ones get
+   private copy-on-write pages.  The file must not change while it is
+   mapped.  */
+class fileMapping
+{
+public:
+    void *addr; // the whole mapping
+    size_t len;
+    char *data; // where the range starts
+    int fd;       // the file, kept open to map it again, or -1
+    off_t offset; // in fd of data
+    size_t fileLen; // bytes of the range that come from the file
+
+    fileMapping()
+    {
+        addr = NULL;
+        len = 0;
+        data = NULL;
+        fd = -1;
+        offset = 0;
+        fileLen = 0;
+    }
+    ~fileMapping()
+    {
+        if (addr)
+            munmap(addr, len);
+        if (fd >= 0)
+            close(fd);
+    }
+
+private:
+    fileMapping(const fileMapping &);
+    fileMapping &operator=(const fileMapping &);
+};
+
 class addressRange
 {
 public:
@@ -77,7 +147,11 @@ public:
     uint32_t length;
     void *root;
     bool readOnly;
+    bool hasCode;  // instructions from this range are in the block cache
+    bool executable;  // loaded from an executable ELF segment
+    bool lazy;        // pages are opened on first access (lazymem.cc)
     std::string buf;
+    std::shared_ptr<fileMapping> mapping; // backs the range instead of buf
 
     addressRange(std::string name_, size_t sz)
     {
@@ -87,6 +161,9 @@ public:
         length = sz;
         root = NULL;
         readOnly = true;
+        hasCode = false;
+        executable = false;
+        lazy = false;
     }
 
     void *physaddr(uint32_t addr)
@@ -100,29 +177,519 @@ public:
         return ((addr >= start) && ((addr + len) <= end));  // warn: overflow
     }
 
-    void updateRoot() { root = &buf[0]; }
+    void updateRoot() { root = mapping ? mapping->data : &buf[0]; }
+    bool mapFile(int fd, off_t offset, size_t fileLen);
+    bool mapAnonymous();
+};
+
+/* Handler ids of predecoded instructions.  Form 1 instructions keep
+   their opcode; Form 2 and Form 3 instructions follow densely, so the
+   ids can index a handler table.  */
+enum moxie_op {
+    OP_BAD = 0x00,
+    OP_LDI_L = 0x01,
+    OP_MOV = 0x02,
+    OP_JSRA = 0x03,
+    OP_RET = 0x04,
+    OP_ADD = 0x05,
+    OP_PUSH = 0x06,
+    OP_POP = 0x07,
+    OP_LDA_L = 0x08,
+    OP_STA_L = 0x09,
+    OP_LD_L = 0x0a,
+    OP_ST_L = 0x0b,
+    OP_LDO_L = 0x0c,
+    OP_STO_L = 0x0d,
+    OP_CMP = 0x0e,
+    OP_NOP = 0x0f,
+    OP_SEX_B = 0x10,
+    OP_SEX_S = 0x11,
+    OP_ZEX_B = 0x12,
+    OP_ZEX_S = 0x13,
+    OP_UMUL_X = 0x14,
+    OP_MUL_X = 0x15,
+    OP_JSR = 0x19,
+    OP_JMPA = 0x1a,
+    OP_LDI_B = 0x1b,
+    OP_LD_B = 0x1c,
+    OP_LDA_B = 0x1d,
+    OP_ST_B = 0x1e,
+    OP_STA_B = 0x1f,
+    OP_LDI_S = 0x20,
+    OP_LD_S = 0x21,
+    OP_LDA_S = 0x22,
+    OP_ST_S = 0x23,
+    OP_STA_S = 0x24,
+    OP_JMP = 0x25,
+    OP_AND = 0x26,
+    OP_LSHR = 0x27,
+    OP_ASHL = 0x28,
+    OP_SUB = 0x29,
+    OP_NEG = 0x2a,
+    OP_OR = 0x2b,
+    OP_NOT = 0x2c,
+    OP_ASHR = 0x2d,
+    OP_XOR = 0x2e,
+    OP_MUL = 0x2f,
+    OP_SWI = 0x30,
+    OP_DIV = 0x31,
+    OP_UDIV = 0x32,
+    OP_MOD = 0x33,
+    OP_UMOD = 0x34,
+    OP_BRK = 0x35,
+    OP_LDO_B = 0x36,
+    OP_STO_B = 0x37,
+    OP_LDO_S = 0x38,
+    OP_STO_S = 0x39,
+
+    OP_INC = 0x3a, /* Form 2 */
+    OP_DEC,
+    OP_GSR,
+    OP_SSR,
+
+    OP_BEQ, /* Form 3, in encoding order */
+    OP_BNE,
+    OP_BLT,
+    OP_BGT,
+    OP_BLTU,
+    OP_BGTU,
+    OP_BGE,
+    OP_BLE,
+    OP_BGEU,
+    OP_BLEU,
+
+    OP_ILL,      /* illegal Form 1/2 instruction */
+    OP_ILL3,     /* illegal Form 3 instruction, not retired */
+    OP_FETCHBUS, /* instruction fetch failed, pc is not advanced */
+
+    OP_FUSE_CMP_BCC, /* superinstructions, see fuse_block() */
+    OP_FUSE_LDI_CMP_BCC,
+    OP_FUSE_LDI_ADD,
+    OP_FUSE_LDI_AND,
+    OP_FUSE_LDO_LDO,
+    OP_FUSE_LDO_STO,
+    OP_FUSE_PUSH_PUSH,
+    OP_FUSE_PUSH_JSRA,
+    OP_COUNT,
+};
+
+enum {
+    OP_FUSE_FIRST = OP_FUSE_CMP_BCC,
+    NUM_FUSIONS = OP_COUNT - OP_FUSE_FIRST,
+};
+
+/* A superinstruction replaces the handler id of its first instruction
+   only; the instructions after it keep theirs.  */
+static inline uint8_t moxie_unfused_op(uint8_t op)
+{
+    static const uint8_t first[NUM_FUSIONS] = {
+        OP_CMP,   OP_LDI_L, OP_LDI_L, OP_LDI_L,
+        OP_LDO_L, OP_LDO_L, OP_PUSH,  OP_PUSH,
+    };
+    return op >= OP_FUSE_FIRST ? first[op - OP_FUSE_FIRST] : op;
+}
+
+/* Page table entry.  Ranges need not be page aligned, so a page may be
+   only partly covered by its range, or shared by several ranges.  */
+struct pageEntry {
+    addressRange *ar; // the only range in this page, or NULL
+    bool shared;      // more than one range; search the memory map
+};
+
+class pageTable
+{
+public:
+    pageTable() { memset(dir, 0, sizeof(dir)); }
+    ~pageTable() { clear(); }
+
+    const struct pageEntry *lookup(uint32_t addr) const
+    {
+        const struct pageEntry *pt = dir[addr >> (MACH_PAGE_SHIFT + PT_BITS)];
+        if (!pt)
+            return NULL;
+        return &pt[(addr >> MACH_PAGE_SHIFT) & (PT_ENTRIES - 1)];
+    }
+
+    void map(addressRange *ar);
+    void clear();
+
+private:
+    struct pageEntry *dir[PT_ENTRIES];
+
+    pageTable(const pageTable &);
+    pageTable &operator=(const pageTable &);
+};
+
+/* Software TLB entry: the address range last found for a guest page
+   number that maps to this slot.  Ranges do not overlap, so a bounds
+   check against the cached range is all a hit needs.  */
+struct tlbEntry {
+    addressRange *ar; // NULL if unused
+    char *root;       // host address of start
+    uint32_t start;
+    uint32_t end;
+    bool readOnly;
+};
+
+/* A guest instruction, decoded once when its basic block is first
+   executed.  Branch targets are stored as absolute addresses.  */
+struct moxie_insn {
+    uint8_t op;   // handler id, enum moxie_op
+    uint8_t a;    // first register operand
+    uint8_t b;    // second register operand
+    uint8_t len;  // instruction length in bytes
+    uint32_t imm; // immediate, load/store offset or branch target
+};
+
+/* Outcomes of an unsigned compare for which a Form 3 branch is taken,
+   with the sign bit set for signed compares.  */
+enum {
+    TEST_BELOW = 1 << 0,
+    TEST_EQUAL = 1 << 1,
+    TEST_ABOVE = 1 << 2,
+    TEST_SIGNED = 1U << 31,
+};
+
+static inline uint32_t moxie_branch_test(uint8_t op)
+{
+    static const uint32_t tests[10] = {
+        TEST_EQUAL,
+        TEST_BELOW | TEST_ABOVE,
+        TEST_SIGNED | TEST_BELOW,
+        TEST_SIGNED | TEST_ABOVE,
+        TEST_BELOW,
+        TEST_ABOVE,
+        TEST_SIGNED | TEST_ABOVE | TEST_EQUAL,
+        TEST_SIGNED | TEST_BELOW | TEST_EQUAL,
+        TEST_ABOVE | TEST_EQUAL,
+        TEST_BELOW | TEST_EQUAL,
+    };
+    return tests[op - OP_BEQ];
+}
+
+/* Whether a branch with the given test is taken after a cmp of va and
+   vb.  */
+static inline bool moxie_test(uint32_t test, int32_t va, int32_t vb)
+{
+    uint32_t ua = va ^ (test & TEST_SIGNED);
+    uint32_t ub = vb ^ (test & TEST_SIGNED);
+
+    return (test >> ((ua >= ub) + (ua > ub))) & 1;
+}
+
+/* Guest instruction lowered for the trace interpreter.  */
+struct irOp {
+    uint8_t op;     // trace.cc ir_op
+    uint8_t a;      // destination or base register
+    uint8_t b;      // source or base register
+    uint8_t x;      // operation specific flags
+    uint32_t imm;   // constant operand, offset or recorded target
+    uint32_t aux;   // branch test or range check slot
+    uint32_t exit;  // pc at which a side exit leaves the trace
+    uint32_t count; // guest instructions retired once this op completes
+};
+
+/* Accesses through a register that a trace never writes, checked once
+   on entry: all of them lie in [base + lo, base + hi).  */
+struct irRangeCheck {
+    uint8_t base; // guest register, or 0xff for absolute addresses
+    bool write;
+    int64_t lo, hi;
+};
+
+/* A hot loop recorded across blocks and lowered to IR.  */
+class moxieTrace
+{
+public:
+    uint32_t start;  // guest pc of the loop head
+    uint32_t epoch;  // blockCache::epoch it was recorded in
+    uint32_t insns;  // guest instructions per iteration
+    std::vector<struct irOp> ops;
+    std::vector<struct irRangeCheck> checks;
+};
+
+/* Native code for a block.  Runs at most limit instructions and returns
+   the number retired in the high word and the next pc in the low word.  */
+typedef uint64_t (*jitCode)(struct moxie_regset *regs, uint64_t limit);
+
+/* Interface of the shared objects built from moxie-aot output, which
+   declares the same structures in C.  Blocks reach guest memory only
+   through the accessors, which return nonzero on success.  */
+enum {
+    AOT_ABI_VERSION = 1,
+};
+
+struct aotContext {
+    struct moxie_regset *regs;
+    void *mach;
+    const bool *modified; // blockCache::modified
+    int (*read8)(void *mach, uint32_t addr, uint32_t *val);
+    int (*read16)(void *mach, uint32_t addr, uint32_t *val);
+    int (*read32)(void *mach, uint32_t addr, uint32_t *val);
+    int (*write8)(void *mach, uint32_t addr, uint32_t val);
+    int (*write16)(void *mach, uint32_t addr, uint32_t val);
+    int (*write32)(void *mach, uint32_t addr, uint32_t val);
+};
+
+/* A block translated ahead of time.  code runs its first insns
+   instructions, returning the number retired in the high word and the
+   next pc in the low word; end is where the whole block ends, to check
+   that it was decoded the same way.  */
+struct aotEntry {
+    uint32_t addr;
+    uint32_t end;
+    uint32_t insns;
+    uint64_t (*code)(struct aotContext *ctx);
+};
+
+class moxieBlock
+{
+public:
+    uint32_t start;
+    uint32_t end;
+    std::vector<struct moxie_insn> insns;
+
+    uint32_t hits;        // executions, to find hot blocks
+    jitCode native;       // translated code, or NULL
+    uint32_t nativeInsns; // leading instructions covered by native code
+    uint32_t loops;       // backward branches here, to find hot loops
+    moxieTrace *trace;    // trace of the loop starting here, or NULL
+    const struct aotEntry *aot; // translated ahead of time, or NULL
+    int hle;              // runtime function run natively here, or -1
+
+    moxieBlock(uint32_t start_)
+    {
+        start = start_;
+        end = start_;
+        hits = 0;
+        native = NULL;
+        nativeInsns = 0;
+        loops = 0;
+        trace = NULL;
+        aot = NULL;
+        hle = -1;
+    }
+    ~moxieBlock() { delete trace; }
+
+private:
+    moxieBlock(const moxieBlock &);
+    moxieBlock &operator=(const moxieBlock &);
+};
+
+class blockCache
+{
+public:
+    std::unordered_map<uint32_t, moxieBlock *> blocks;
+    std::unordered_map<uint32_t, std::vector<uint32_t> > pageBlocks;
+    std::vector<moxieBlock *> retired;
+    moxieBlock *hash[BB_HASH_SIZE];
+    bool modified;
+    uint32_t epoch; // bumped when code is invalidated, to drop stale traces
+
+    blockCache()
+    {
+        memset(hash, 0, sizeof(hash));
+        modified = false;
+        epoch = 0;
+    }
+    ~blockCache();
+
+    moxieBlock *lookup(uint32_t pc)
+    {
+        moxieBlock *blk = hash[(pc >> 1) & (BB_HASH_SIZE - 1)];
+        if (blk && blk->start == pc)
+            return blk;
+        return lookupSlow(pc);
+    }
+
+    void insert(moxieBlock *blk);
+    void invalidate(uint32_t addr, uint32_t len);
+    void reclaim();
+
+private:
+    blockCache(const blockCache &);
+    blockCache &operator=(const blockCache &);
+
+    moxieBlock *lookupSlow(uint32_t pc);
+    void retire(moxieBlock *blk);
+};
+
+class jitBuffer
+{
+public:
+    uint8_t *base;
+    size_t size;
+    size_t used;
+
+    jitBuffer()
+    {
+        base = NULL;
+        size = 0;
+        used = 0;
+    }
+    ~jitBuffer()
+    {
+        if (base)
+            munmap(base, size);
+    }
+
+private:
+    jitBuffer(const jitBuffer &);
+    jitBuffer &operator=(const jitBuffer &);
+};
+
+class machine;
+
+/* Runtime library functions that --hle runs natively (hle.cc).  */
+enum hle_func {
+    HLE_MEMCPY,
+    HLE_MEMSET,
+    HLE_MEMCMP,
+    HLE_STRLEN,
+    HLE_MEMCHR,
+    HLE_STRSTR,
+    HLE_COUNT,
+};
+
+/* Outcomes of hleCall.  */
+enum {
+    HLE_DONE,   // returned to the caller
+    HLE_GUEST,  // run the guest code instead
+    HLE_BUDGET, // the call would overrun the budget
+};
+
+/* Blocks of the loaded program translated by moxie-aot (aot.cc).  */
+class aotModule
+{
+public:
+    void *handle; // dlopen handle, or NULL
+    struct aotContext ctx;
+    std::unordered_map<uint32_t, const struct aotEntry *> blocks;
+
+    aotModule() { handle = NULL; }
+    ~aotModule();
+
+    bool load(machine &mach, const std::string &path, const std::string &hash);
+    const struct aotEntry *lookup(machine &mach, uint32_t start, uint32_t end);
+    void disable() { blocks.clear(); }
+
+private:
+    aotModule(const aotModule &);
+    aotModule &operator=(const aotModule &);
+};
+
+/* Flat guest address space (--flat-memory).  Guest memory lives in a
+   sparse 4 GiB memfd that is mapped twice.  Loads and stores go straight
+   to base + addr; there, unmapped pages are inaccessible and pages that
+   are read-only or hold decoded code are write-protected.  The SIGSEGV
+   handler maps a scratch page over a faulting page so the access can
+   finish, and the access is then redone through the checked path.
+   Range buffers live in the shadow view, which is always writable.  */
+class flatSpace
+{
+public:
+    char *base;
+    char *shadow;
+    int fd;
+    volatile sig_atomic_t fault; // set by the SIGSEGV handler
+    char *scratch;               // page the handler mapped
+    std::vector<bool> code;      // pages write-protected for the block cache
+    std::vector<bool> partial;   // pages only partly covered by a range
+
+    flatSpace()
+    {
+        base = NULL;
+        shadow = NULL;
+        fd = -1;
+        fault = 0;
+        scratch = NULL;
+    }
+    ~flatSpace();
+
+    bool owns(const addressRange *ar) const
+    {
+        return shadow && (char *) ar->root >= shadow &&
+               (uint64_t)((char *) ar->root - shadow) < (1ULL << 32);
+    }
+    void activate();
+
+private:
+    flatSpace(const flatSpace &);
+    flatSpace &operator=(const flatSpace &);
+};
+
+enum moxie_engine {
+    ENGINE_SWITCH,   // one switch dispatch per instruction
+    ENGINE_THREADED, // computed-goto dispatch between handlers
+    ENGINE_JIT,      // hot blocks translated to host code
+    ENGINE_TRACE,    // hot loops recorded and run as optimized IR
 };
 
 class machine
 {
 public:
     std::vector<addressRange *> memmap;
+    pageTable pages;
     cpuState cpu;
+    blockCache bbcache;
+    jitBuffer jit;
+    flatSpace flat;
+    aotModule aot;
 
     uint32_t startAddr;
     bool tracing;
     bool profiling;
+    bool countFusions; // count superinstructions for --fusion-report
     uint32_t heapAvail;
+    uint32_t stackSize;
+    moxie_engine engine;
+    bool snapshotStop; // stop at the next SYS_snapshot marker
+    FILE *tracefile;   // where -t writes the trace
+
+    // map data files page by page on first access, and count the pages
+    bool lazyData;
+    unsigned long long lazyPages;
+    unsigned long long lazyTouched;
+
+    // ranges named so far, for elf<n>, data<n> and heap<n>
+    unsigned int elfCount;
+    unsigned int dataCount;
+    unsigned int heapCount;
+
+    // function symbols of the loaded program, and those run natively
+    std::unordered_map<std::string, uint32_t> symbols;
+    std::unordered_map<uint32_t, int> hleFuncs;
 
     gprof_bb_map_t gprof_bb_data;
     gprof_cg_map_t gprof_cg_data;
+    unsigned long long fusions[NUM_FUSIONS]; // superinstructions executed
 
     machine()
     {
         startAddr = 0;
         tracing = false;
         profiling = false;
+        countFusions = false;
         heapAvail = 0xfffffffU;
+        stackSize = MACH_STACK_SIZE;
+        engine = ENGINE_SWITCH;
+        snapshotStop = false;
+        tracefile = stderr;
+        lazyData = false;
+        lazyPages = 0;
+        lazyTouched = 0;
+        elfCount = 0;
+        dataCount = 0;
+        heapCount = 0;
+        memset(fusions, 0, sizeof(fusions));
+        tlbFlush();
+    }
+    ~machine()
+    {
+        if (lazyPages)
+            lazyRelease();
+        for (unsigned int i = 0; i < memmap.size(); i++)
+            delete memmap[i];
     }
 
     bool read8(uint32_t addr, uint32_t &val_out);
@@ -133,23 +700,156 @@ public:
     bool write16(uint32_t addr, uint32_t val);
     bool write32(uint32_t addr, uint32_t val);
 
-    void *physaddr(uint32_t addr, size_t objLen, bool wantWrite = false);
+    addressRange *findRange(uint32_t addr, size_t objLen);
+    void *hostRange(uint32_t addr, uint32_t len, bool wantWrite = false);
     void sortMemMap();
     bool mapInsert(addressRange *ar);
+    void markCode(addressRange *ar, uint32_t addr, uint32_t len);
+
+    bool flatInit();
+    void flatMap(addressRange *ar);
+    void flatProtect(uint32_t page);
+    void flatRecover();
     void fillDescriptors(std::vector<struct mach_memmap_ent> &desc);
+
+    bool lazyMap(addressRange *ar);
+    void lazyRelease();
+
+    void *physaddr(uint32_t addr, size_t objLen, bool wantWrite = false)
+    {
+        struct tlbEntry &te = tlb[(addr >> MACH_PAGE_SHIFT) & (TLB_SIZE - 1)];
+        if (te.ar && addr >= te.start && (addr + objLen) <= te.end &&
+            !(wantWrite && (te.readOnly || te.ar->hasCode)))
+            return te.root + (addr - te.start);
+        return physaddrSlow(addr, objLen, wantWrite);
+    }
+
+    void tlbFlush() { memset(tlb, 0, sizeof(tlb)); }
+
+private:
+    struct tlbEntry tlb[TLB_SIZE];
+
+    void *physaddrSlow(uint32_t addr, size_t objLen, bool wantWrite);
 };
 
 extern int sim_resume(machine &mach, unsigned long long cpu_budget = 0);
+extern int sim_step(machine &mach);
+extern void sim_report_fusions(machine &mach);
+extern word sim_cc(const machine &mach);
+extern bool sim_decode(machine &mach, uint32_t pc, struct moxie_insn &ins);
+extern bool jitTranslate(machine &mach, moxieBlock *blk);
+extern moxieTrace *traceBuild(machine &mach,
+                              const std::vector<moxieBlock *> &blocks);
+extern uint64_t traceRun(machine &mach, moxieTrace *t, uint64_t limit);
+extern void hleInit(machine &mach);
+extern int hleFind(machine &mach, uint32_t pc);
+extern int hleCall(machine &mach,
+                   int func,
+                   unsigned long long limit,
+                   uint32_t &pc,
+                   unsigned long long &cost);
 extern bool loadElfProgram(machine &mach, const std::string &filename);
+extern bool loadRawData(machine &mach, const std::string &filename);
+extern bool loadRawDataFd(machine &mach, int fd);
+extern void addStackMem(machine &mach);
+extern void allocZeroed(machine &mach, addressRange *ar);
+extern void addMapDescriptor(machine &mach);
+extern bool writeGuestOutput(machine &mach,
+                             uint32_t addr,
+                             uint32_t length,
+                             int fd,
+                             bool untilExit = false);
 extern bool loadElfHash(machine &mach,
                         const std::string &hash,
                         const std::vector<std::string> &pathExec);
+extern bool loadImage(machine &mach, const std::string &filename);
+extern bool saveImage(machine &mach,
+                      const std::vector<addressRange *> &ranges,
+                      const std::string &filename);
+extern bool loadDataHash(machine &mach,
+                         const std::string &hash,
+                         const std::vector<std::string> &pathData);
 
 extern signed char HexDigit(char c);
 extern bool IsHex(const std::string &str);
 extern std::vector<unsigned char> ParseHex(const char *psz);
 extern std::vector<unsigned char> ParseHex(const std::string &str);
+extern std::string HexStr(const unsigned char *p, size_t len);
 extern bool ReadDir(const std::string &pathname,
                     std::vector<std::string> &dirNames);
+extern bool parseStackSize(const char *s, uint32_t &size);
+extern bool parseBudget(const char *s, unsigned long long &budget);
+extern bool parseEngine(const char *name, moxie_engine &engine);
+
+enum {
+    SHA256_SIZE = 32,
+};
+
+class sha256Hasher
+{
+public:
+    sha256Hasher();
+    void update(const void *data, size_t len);
+    void final(unsigned char digest[SHA256_SIZE]);
+
+private:
+    uint32_t state[8];
+    uint64_t count;
+    unsigned char buf[64];
+};
+
+/* sha256_context of runtime/sandboxrt_crypto.h, as laid out in guest
+   memory.  Words are little-endian.  */
+struct sha256GuestCtx {
+    unsigned char buf[64];
+    uint32_t hash[8];
+    uint32_t bits[2];
+    uint32_t len;
+};
+
+extern void sha256Blocks(uint32_t state[8],
+                         const unsigned char *data,
+                         size_t nblocks);
+extern bool sha256File(const std::string &filename, std::string &hexOut);
+extern void sha256GuestInit(struct sha256GuestCtx *ctx);
+extern void sha256GuestUpdate(struct sha256GuestCtx *ctx,
+                              const unsigned char *data,
+                              size_t len);
+extern void sha256GuestFinal(struct sha256GuestCtx *ctx,
+                             unsigned char *digest);
+
+/* Messages of sandbox --serve (serve.cc), on a SOCK_SEQPACKET Unix
+   socket.  A request passes up to SERVE_MAX_FDS input files as
+   SCM_RIGHTS descriptors, loaded in order as data0, data1, ...  The
+   response passes the output, if there is any, as a memfd, sealed if
+   the request asks for SERVE_SEAL_OUTPUT.  */
+enum {
+    SERVE_VERSION = 1,
+    SERVE_MAX_FDS = 16,
+    SERVE_SEAL_OUTPUT = 1 << 0, // seal the output memfd against changes
+};
+
+struct serveRequest {
+    uint32_t version;
+    uint32_t flags;     // SERVE_SEAL_OUTPUT
+    uint64_t budget;    // 0 for the server's --budget
+    char program[4096]; // pathname of the executable
+};
+
+struct serveResponse {
+    uint32_t version;
+    int32_t error;         // errno if the job could not be run
+    int32_t exception;     // SIGQUIT after _exit, 0 if the budget ran out
+    int32_t exitCode;      // $r0 passed to _exit
+    uint64_t insts;        // instructions executed
+    uint64_t outputLength; // bytes in the output memfd
+};
+
+extern int sandboxServe(const std::string &socketPath,
+                        unsigned int threads,
+                        moxie_engine engine,
+                        unsigned long long budget,
+                        uint32_t stackSize,
+                        bool hle);
 
 #endif  // __SANDBOX_H__
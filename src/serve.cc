@@ -0,0 +1,400 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* A loaded executable, kept so later requests for it skip libelf.  */
+struct serveProgram {
+    struct stat st; // of the file it was loaded from
+    vector<addressRange> ranges;
+    uint32_t startAddr;
+    unordered_map<string, uint32_t> symbols;
+};
+
+struct serveState {
+    int sock;
+    moxie_engine engine;
+    unsigned long long budget;
+    uint32_t stackSize;
+    bool hle;
+
+    mutex lock; // of programs
+    unordered_map<string, shared_ptr<serveProgram> > programs;
+};
+
+static bool sameFile(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+           a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+/* A sealed memfd holding len bytes of fd from offset, read with pread so
+   that a file shrinking meanwhile leaves zeroes rather than a fault.
+   Returns -1 on failure.  */
+static int sealedCopy(int fd, off_t offset, size_t len)
+{
+    int copy = memfd_create("moxie-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (copy < 0)
+        return -1;
+
+    char buf[65536];
+    size_t done = 0;
+    bool ok = ftruncate(copy, len) == 0;
+    while (ok && done < len) {
+        ssize_t bytes = pread(fd, buf, min(sizeof(buf), len - done),
+                              offset + done);
+        if (bytes <= 0) {
+            ok = bytes == 0;
+            break;
+        }
+        ok = pwrite(copy, buf, bytes, done) == bytes;
+        done += bytes;
+    }
+
+    if (!ok || fcntl(copy, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                            F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        int err = errno;
+        close(copy);
+        errno = err;
+        return -1;
+    }
+    return copy;
+}
+
+/* Load the input file of a request; fd is closed.  Mapped files that
+   shrink make later reads fault, which would kill the server, so only
+   memfds sealed against shrinking and writes are mapped, and anything
+   else is copied into one first.  */
+static bool loadInput(machine &mach, int fd)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) ==
+                          (F_SEAL_SHRINK | F_SEAL_WRITE))
+        return loadRawDataFd(mach, fd);
+
+    struct stat st;
+    int copy = -1;
+    if (fstat(fd, &st) == 0) {
+        if (st.st_size > (1 * 1024 * 1024 * 1024))
+            errno = EFBIG;
+        else
+            copy = sealedCopy(fd, 0, st.st_size);
+    }
+    close(fd);
+    return copy >= 0 && loadRawDataFd(mach, copy);
+}
+
+/* Move the file-backed ranges of a loaded program into sealed memfds,
+   so that jobs keep running, and sharing pages, whatever happens to the
+   executable.  */
+static bool sealProgram(serveProgram &prog)
+{
+    for (unsigned int i = 0; i < prog.ranges.size(); i++) {
+        addressRange &ar = prog.ranges[i];
+        shared_ptr<fileMapping> fm = ar.mapping;
+        if (!fm || fm->fd < 0)
+            continue;
+
+        int copy = sealedCopy(fm->fd, fm->offset, fm->fileLen);
+        if (copy < 0)
+            return false;
+        bool ok = ar.mapFile(copy, 0, fm->fileLen);
+        close(copy);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/* The loaded program at path, loading it again if the file changed.
+   Programs are loaded without holding the lock, so a slow load never
+   holds up requests for programs already loaded.  */
+static shared_ptr<serveProgram> findProgram(serveState &state,
+                                            const string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+        return shared_ptr<serveProgram>();
+
+    {
+        lock_guard<mutex> guard(state.lock);
+        unordered_map<string, shared_ptr<serveProgram> >::iterator it =
+            state.programs.find(path);
+        if (it != state.programs.end() && sameFile(it->second->st, st))
+            return it->second;
+    }
+
+    machine mach;
+    shared_ptr<serveProgram> loaded;
+    if (loadElfProgram(mach, path)) {
+        loaded = make_shared<serveProgram>();
+        loaded->st = st;
+        for (unsigned int i = 0; i < mach.memmap.size(); i++)
+            loaded->ranges.push_back(*mach.memmap[i]);
+        loaded->startAddr = mach.startAddr;
+        loaded->symbols = mach.symbols;
+        if (!sealProgram(*loaded))
+            loaded.reset();
+    }
+
+    lock_guard<mutex> guard(state.lock);
+    shared_ptr<serveProgram> &prog = state.programs[path];
+    // another worker may have loaded it meanwhile
+    if (prog && sameFile(prog->st, st))
+        return prog;
+
+    if (!loaded)
+        state.programs.erase(path);
+    else
+        prog = loaded;
+    return loaded;
+}
+
+/* Copy the guest's output into a memfd, sealed against any change if
+   seal is set.  Returns -1 on failure.  */
+static int outputFd(machine &mach, bool seal, uint64_t &length)
+{
+    uint32_t vaddr = mach.cpu.asregs.sregs[6];
+    uint32_t len = mach.cpu.asregs.sregs[7];
+    length = 0;
+    if (!vaddr || !len)
+        return -2;
+
+    int fd = memfd_create("moxie-output",
+                          MFD_CLOEXEC | (seal ? MFD_ALLOW_SEALING : 0));
+    if (fd < 0)
+        return -1;
+
+    if (!writeGuestOutput(mach, vaddr, len, fd) ||
+        (seal && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                            F_SEAL_WRITE | F_SEAL_SEAL) < 0)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    length = len;
+    return fd;
+}
+
+/* Run the job of one request.  The input descriptors are closed; the
+   output descriptor, if any, is returned in outFd.  */
+static void runRequest(serveState &state,
+                       const struct serveRequest &req,
+                       const vector<int> &fds,
+                       struct serveResponse &resp,
+                       int &outFd)
+{
+    unsigned int i = 0;
+    outFd = -1;
+
+    shared_ptr<serveProgram> prog;
+    if (req.version != SERVE_VERSION)
+        resp.error = EPROTO;
+    else if (!memchr(req.program, 0, sizeof(req.program)))
+        resp.error = ENAMETOOLONG;
+    else if (!(prog = findProgram(state, req.program)))
+        resp.error = errno ? errno : ENOEXEC;
+    if (resp.error)
+        goto out;
+
+    {
+        machine mach;
+        mach.engine = state.engine;
+        mach.stackSize = state.stackSize;
+        for (unsigned int r = 0; r < prog->ranges.size(); r++) {
+            addressRange *ar = new addressRange(prog->ranges[r]);
+            // jobs share read-only pages; writable ones get a
+            // copy-on-write mapping of the program's memfd of their own
+            shared_ptr<fileMapping> fm = ar->mapping;
+            if (fm && !ar->readOnly &&
+                (fm->fd < 0 || !ar->mapFile(fm->fd, fm->offset, fm->fileLen))) {
+                ar->buf.assign(fm->data, ar->length);
+                ar->mapping.reset();
+            }
+            ar->updateRoot();
+            mach.memmap.push_back(ar);
+        }
+        mach.sortMemMap();
+        mach.elfCount = prog->ranges.size();
+        mach.startAddr = prog->startAddr;
+        mach.symbols = prog->symbols;
+
+        for (; i < fds.size(); i++)
+            if (!loadInput(mach, fds[i])) {
+                resp.error = errno ? errno : EINVAL;
+                i++;
+                goto out;
+            }
+
+        addStackMem(mach);
+        addMapDescriptor(mach);
+        mach.cpu.asregs.regs[PC_REGNO] = mach.startAddr;
+        if (state.hle)
+            hleInit(mach);
+
+        sim_resume(mach, req.budget ? req.budget : state.budget);
+        resp.exception = mach.cpu.asregs.exception;
+        resp.insts = mach.cpu.asregs.insts;
+        if (resp.exception == SIGQUIT) {
+            resp.exitCode = mach.cpu.asregs.regs[2] & 0xff;
+            outFd = outputFd(mach, req.flags & SERVE_SEAL_OUTPUT,
+                             resp.outputLength);
+            if (outFd == -1)
+                resp.error = errno;
+        }
+    }
+
+out:
+    for (; i < fds.size(); i++)
+        close(fds[i]);
+}
+
+static void serveConnection(serveState &state, int conn)
+{
+    for (;;) {
+        struct serveRequest req;
+        struct iovec iov = {&req, sizeof(req)};
+        char cbuf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        memset(&req, 0, sizeof(req));
+        ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+            return;
+
+        vector<int> fds;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c;
+             c = CMSG_NXTHDR(&msg, c))
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int *p = (int *) CMSG_DATA(c);
+                fds.insert(fds.end(), p, p + count);
+            }
+
+        struct serveResponse resp;
+        memset(&resp, 0, sizeof(resp));
+        resp.version = SERVE_VERSION;
+
+        int outFd = -1;
+        errno = 0;
+        if ((size_t) n != sizeof(req) || (msg.msg_flags & MSG_CTRUNC)) {
+            resp.error = EPROTO;
+            for (unsigned int i = 0; i < fds.size(); i++)
+                close(fds[i]);
+        } else
+            runRequest(state, req, fds, resp, outFd);
+
+        iov.iov_base = &resp;
+        iov.iov_len = sizeof(resp);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (outFd >= 0) {
+            msg.msg_control = cbuf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int));
+            struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(c), &outFd, sizeof(int));
+        }
+
+        n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+        if (outFd >= 0)
+            close(outFd);
+        if (n < 0)
+            return;
+    }
+}
+
+static void serveWorker(serveState &state)
+{
+    for (;;) {
+        int conn = accept4(state.sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return;
+        }
+
+        serveConnection(state, conn);
+        close(conn);
+    }
+}
+
+/* Serve requests on a Unix socket at socketPath until killed.  Each of
+   threads workers takes one connection at a time.  */
+int sandboxServe(const string &socketPath,
+                 unsigned int threads,
+                 moxie_engine engine,
+                 unsigned long long budget,
+                 uint32_t stackSize,
+                 bool hle)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath.c_str());
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    serveState state;
+    state.engine = engine;
+    state.budget = budget;
+    state.stackSize = stackSize;
+    state.hle = hle;
+    state.sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (state.sock < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    unlink(addr.sun_path);
+    if (bind(state.sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(state.sock, 64) < 0) {
+        perror(socketPath.c_str());
+        close(state.sock);
+        return EXIT_FAILURE;
+    }
+
+    if (!threads)
+        threads = thread::hardware_concurrency();
+    if (!threads)
+        threads = 1;
+
+    vector<thread> workers;
+    for (unsigned int i = 0; i < threads; i++)
+        workers.push_back(thread(serveWorker, ref(state)));
+    for (unsigned int i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    close(state.sock);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,317 @@
+#include <string.h>
+#include <fcntl.h>
+#include <endian.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "sandbox.h"
+
+using namespace std;
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t ror(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256BlocksPortable(uint32_t state[8],
+                                 const unsigned char *chunk,
+                                 size_t nblocks)
+{
+    for (; nblocks; nblocks--, chunk += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t) chunk[4 * i] << 24 | chunk[4 * i + 1] << 16 |
+                   chunk[4 * i + 2] << 8 | chunk[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 =
+                ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 =
+                ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The SHA extensions work on the state as ABEF and CDGH halves, and on
+   the message schedule four words at a time.  */
+__attribute__((target("sha,sse4.1"))) static void sha256BlocksNI(
+    uint32_t state[8],
+    const unsigned char *chunk,
+    size_t nblocks)
+{
+    const __m128i bswap =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *) &state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);          // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1b);    // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+    for (; nblocks; nblocks--, chunk += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i m[4];
+
+        for (int i = 0; i < 16; i++) {
+            __m128i &w = m[i & 3];
+            if (i < 4)
+                w = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *) (chunk + 16 * i)),
+                    bswap);
+            else
+                w = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w, m[(i + 1) & 3]),
+                                  _mm_alignr_epi8(m[(i + 3) & 3],
+                                                  m[(i + 2) & 3], 4)),
+                    m[(i + 3) & 3]);
+
+            __m128i msg = _mm_add_epi32(
+                w, _mm_loadu_si128((const __m128i *) &sha256K[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1,
+                                           _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);       // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);    // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+    _mm_storeu_si128((__m128i *) &state[0], state0);
+    _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+#endif
+
+typedef void (*sha256BlocksFn)(uint32_t *, const unsigned char *, size_t);
+
+static sha256BlocksFn sha256Pick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        return sha256BlocksNI;
+#endif
+    return sha256BlocksPortable;
+}
+
+/* Compress nblocks 64-byte blocks into state, with the SHA extensions
+   when the host has them.  */
+void sha256Blocks(uint32_t state[8], const unsigned char *data, size_t nblocks)
+{
+    static const sha256BlocksFn fn = sha256Pick();
+    fn(state, data, nblocks);
+}
+
+sha256Hasher::sha256Hasher()
+{
+    memcpy(state, sha256IV, sizeof(state));
+    count = 0;
+}
+
+void sha256Hasher::update(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    size_t used = count % 64;
+
+    count += len;
+    if (used) {
+        size_t n = min(len, 64 - used);
+        memcpy(buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        sha256Blocks(state, buf, 1);
+    }
+
+    sha256Blocks(state, p, len / 64);
+    p += len & ~(size_t) 63;
+    memcpy(buf, p, len % 64);
+}
+
+void sha256Hasher::final(unsigned char digest[SHA256_SIZE])
+{
+    uint64_t bits = count * 8;
+    unsigned char pad[72] = {0x80};
+    size_t padLen = (count % 64 < 56 ? 56 : 120) - count % 64;
+
+    for (int i = 0; i < 8; i++)
+        pad[padLen + i] = bits >> (56 - 8 * i);
+    update(pad, padLen + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+/* Hex SHA-256 of a file's contents, as used to name sealed programs.  */
+bool sha256File(const string &filename, string &hexOut)
+{
+    mfile pf(filename);
+    if (!pf.open(O_RDONLY))
+        return false;
+
+    sha256Hasher h;
+    unsigned char digest[SHA256_SIZE];
+    if (pf.data)
+        h.update(pf.data, pf.st.st_size);
+    h.final(digest);
+
+    hexOut = HexStr(digest, sizeof(digest));
+    return true;
+}
+
+/* The guest's sha256_init, sha256_hash and sha256_done (runtime/sha256.c)
+   on a context in guest memory.  They leave the context exactly as the
+   guest code would, including the bytes left in buf, so that guest and
+   host calls can be mixed.  The caller checks that len is below 64.  */
+
+static void loadState(const struct sha256GuestCtx *ctx, uint32_t state[8])
+{
+    for (int i = 0; i < 8; i++)
+        state[i] = le32toh(ctx->hash[i]);
+}
+
+static void storeState(struct sha256GuestCtx *ctx, const uint32_t state[8])
+{
+    for (int i = 0; i < 8; i++)
+        ctx->hash[i] = htole32(state[i]);
+}
+
+static void addBits(struct sha256GuestCtx *ctx, uint64_t n)
+{
+    uint64_t bits = (uint64_t) le32toh(ctx->bits[1]) << 32 |
+                    le32toh(ctx->bits[0]);
+    bits += n;
+    ctx->bits[0] = htole32((uint32_t) bits);
+    ctx->bits[1] = htole32((uint32_t)(bits >> 32));
+}
+
+void sha256GuestInit(struct sha256GuestCtx *ctx)
+{
+    ctx->bits[0] = ctx->bits[1] = 0;
+    ctx->len = 0;
+    storeState(ctx, sha256IV);
+}
+
+void sha256GuestUpdate(struct sha256GuestCtx *ctx,
+                       const unsigned char *data,
+                       size_t len)
+{
+    uint32_t state[8];
+    size_t used = le32toh(ctx->len);
+
+    loadState(ctx, state);
+    if (used) {
+        size_t n = min(len, 64 - used);
+        memcpy(ctx->buf + used, data, n);
+        used += n;
+        data += n;
+        len -= n;
+        if (used == 64) {
+            sha256Blocks(state, ctx->buf, 1);
+            addBits(ctx, 512);
+            used = 0;
+        }
+    }
+
+    // whole blocks are hashed in place; the guest would have left the
+    // last of them in buf
+    size_t nblocks = len / 64;
+    if (nblocks) {
+        sha256Blocks(state, data, nblocks);
+        addBits(ctx, 512 * (uint64_t) nblocks);
+        data += 64 * nblocks;
+        memcpy(ctx->buf, data - 64, 64);
+        len %= 64;
+    }
+
+    if (len) {
+        memcpy(ctx->buf, data, len);
+        used = len;
+    }
+
+    storeState(ctx, state);
+    ctx->len = htole32(used);
+}
+
+void sha256GuestFinal(struct sha256GuestCtx *ctx, unsigned char *digest)
+{
+    uint32_t state[8];
+    uint32_t len = le32toh(ctx->len);
+
+    loadState(ctx, state);
+    ctx->buf[len] = 0x80;
+    memset(ctx->buf + len + 1, 0, 63 - len);
+    if (len > 55) {
+        sha256Blocks(state, ctx->buf, 1);
+        memset(ctx->buf, 0, 64);
+    }
+
+    addBits(ctx, (uint32_t)(len * 8));
+    uint32_t bits0 = le32toh(ctx->bits[0]), bits1 = le32toh(ctx->bits[1]);
+    for (int i = 0; i < 4; i++) {
+        ctx->buf[63 - i] = bits0 >> (8 * i);
+        ctx->buf[59 - i] = bits1 >> (8 * i);
+    }
+    sha256Blocks(state, ctx->buf, 1);
+    storeState(ctx, state);
+
+    // in the guest's order, which matters if digest overlaps ctx
+    if (digest)
+        for (int i = 0; i < 4; i++)
+            for (int k = 0; k < 8; k++)
+                digest[i + 4 * k] = le32toh(ctx->hash[k]) >> (24 - 8 * i);
+}
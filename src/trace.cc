@@ -0,0 +1,947 @@
+#include <string.h>
+#include <signal.h>
+#include "sandbox.h"
+
+using namespace std;
+
+/* A trace is one iteration of a hot loop, recorded block by block along
+   the path it took and lowered to a small register IR.  Lowering folds
+   constants, drops compares whose flags no exit can observe and checks
+   accesses through registers the loop never writes once on entry, rather
+   than on every access.  Conditional branches, indirect jumps and
+   returns become guards that leave the trace when execution takes
+   another path.  Every exit leaves the machine state and instruction
+   count the interpreter would have.  */
+
+enum ir_op {
+    IR_MOVI, // a = imm
+    IR_MOV,  // a = b
+    IR_ADD,
+    IR_ADDI,
+    IR_SUB,
+    IR_AND,
+    IR_ANDI,
+    IR_OR,
+    IR_ORI,
+    IR_XOR,
+    IR_XORI,
+    IR_MUL,
+    IR_MULI,
+    IR_LSHR,
+    IR_LSHRI,
+    IR_ASHL,
+    IR_ASHLI,
+    IR_ASHR,
+    IR_ASHRI,
+    IR_NEG,
+    IR_NOT,
+    IR_SEXB,
+    IR_SEXS,
+    IR_ZEXB,
+    IR_ZEXS,
+    IR_UMULX,
+    IR_MULX,
+    IR_DIV,
+    IR_UDIV,
+    IR_MOD,
+    IR_UMOD,
+    IR_GSR,    // a = sregs[imm]
+    IR_CMP,    // flags from a and b
+    IR_CMPI,   // flags from a and imm
+    IR_CMPBR,  // cmp a, b and guard the branch test aux
+    IR_CMPBRI, // cmp a, imm and guard the branch test aux
+    IR_GUARD,  // guard the branch test aux on the current flags
+    IR_LD8,    // a = [b + imm], b may be IR_NOREG; aux is the check slot
+    IR_LD16,
+    IR_LD32,
+    IR_ST8,    // [a + imm] = b, a may be IR_NOREG; aux is the check slot
+    IR_ST16,
+    IR_ST32,
+    IR_PUSH,   // push b on the stack at a
+    IR_POP,    // pop b from the stack at a
+    IR_CALL,   // jsra imm returning to aux
+    IR_CALLR,  // jsr a returning to aux, guarded to reach imm
+    IR_RET,    // ret, guarded to reach imm
+    IR_JMP,    // jmp a, guarded to reach imm
+    IR_LOOP,   // end of an iteration
+    IR_NUM_OPS,
+};
+
+enum {
+    IR_NOREG = 0xff,
+    IR_NOCHECK = 0xffffffff,
+
+    IR_TAKEN = 1 << 0,      // guards: the branch was taken when recorded
+    IR_FLAGS_DEAD = 1 << 1, // compares: flags only matter on a side exit
+};
+
+/* Condition codes tested by the Form 3 branches, as in moxie.cc.  */
+static const uint32_t branchFlags[10] = {
+    CC_EQ,         (uint32_t) ~CC_EQ, CC_LT,
+    CC_GT,         CC_LTU,            CC_GTU,
+    CC_GT | CC_EQ, CC_LT | CC_EQ,     CC_GTU | CC_EQ,
+    CC_LTU | CC_EQ};
+
+static bool isBranch(uint8_t op)
+{
+    return op >= OP_BEQ && op <= OP_BLEU;
+}
+
+/* Mark the registers an instruction writes.  */
+static void markWritten(const struct moxie_insn &ins, bool *written)
+{
+    switch (ins.op) {
+    case OP_CMP:
+    case OP_NOP:
+    case OP_JMP:
+    case OP_JMPA:
+    case OP_ST_B:
+    case OP_ST_S:
+    case OP_ST_L:
+    case OP_STA_B:
+    case OP_STA_S:
+    case OP_STA_L:
+    case OP_STO_B:
+    case OP_STO_S:
+    case OP_STO_L:
+        break;
+    case OP_JSRA:
+    case OP_JSR:
+    case OP_RET:
+        written[0] = written[1] = true;
+        break;
+    case OP_POP:
+        written[ins.a] = written[ins.b] = true;
+        break;
+    default:
+        if (!isBranch(ins.op))
+            written[ins.a] = true;
+        break;
+    }
+}
+
+/* Lowering state: the IR so far and what is known about registers.  */
+struct traceLowering {
+    moxieTrace *t;
+    bool written[NUM_MOXIE_REGS + 1]; // anywhere in the loop
+    bool known[NUM_MOXIE_REGS + 1];   // constant at this point
+    uint32_t value[NUM_MOXIE_REGS + 1];
+
+    void setConst(uint8_t r, uint32_t v)
+    {
+        known[r] = true;
+        value[r] = v;
+    }
+
+    /* Slot checking [base + off, base + off + size) on trace entry, or
+       IR_NOCHECK if the access is checked where it happens.  */
+    uint32_t check(uint8_t base, uint32_t off, uint32_t size, bool write)
+    {
+        if (base != IR_NOREG && written[base])
+            return IR_NOCHECK;
+
+        int64_t lo = base == IR_NOREG ? (int64_t) off : (int64_t)(int32_t) off;
+        int64_t hi = lo + size;
+
+        vector<struct irRangeCheck> &checks = t->checks;
+        for (size_t i = 0; i < checks.size(); i++) {
+            struct irRangeCheck &c = checks[i];
+            if (c.base != base)
+                continue;
+            int64_t nlo = min(c.lo, lo), nhi = max(c.hi, hi);
+            if (nhi - nlo > MACH_PAGE_SIZE)
+                continue;
+            c.lo = nlo;
+            c.hi = nhi;
+            c.write |= write;
+            return i;
+        }
+
+        if (checks.size() == TRACE_MAX_CHECKS)
+            return IR_NOCHECK;
+        struct irRangeCheck c = {base, write, lo, hi};
+        checks.push_back(c);
+        return checks.size() - 1;
+    }
+
+    /* A load or store of size bytes at [base + off].  */
+    void memory(struct irOp &o,
+                uint8_t &base,
+                uint32_t size,
+                bool write)
+    {
+        if (base != IR_NOREG && known[base]) {
+            o.imm += value[base];
+            base = IR_NOREG;
+        }
+        o.aux = check(base, o.imm, size, write);
+    }
+};
+
+/* Lower the guest instructions of blocks, run in this order and then
+   back to the first, to a trace.  Returns NULL if the path leaves the
+   loop or contains instructions the IR does not cover.  */
+moxieTrace *traceBuild(machine &mach, const vector<moxieBlock *> &blocks)
+{
+    struct traceInsn {
+        struct moxie_insn ins;
+        uint32_t pc;
+        uint32_t next; // recorded pc of the next instruction
+    };
+    vector<traceInsn> code;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        moxieBlock *blk = blocks[i];
+        uint32_t pc = blk->start;
+
+        for (size_t k = 0; k < blk->insns.size(); k++) {
+            traceInsn ti;
+            ti.ins = blk->insns[k];
+            ti.ins.op = moxie_unfused_op(ti.ins.op);
+            ti.pc = pc;
+            pc += ti.ins.len;
+            ti.next = pc;
+            code.push_back(ti);
+        }
+
+        /* The block must have left for the next recorded one.  */
+        traceInsn &last = code.back();
+        uint32_t next = blocks[(i + 1) % blocks.size()]->start;
+        uint32_t npc = last.pc + last.ins.len;
+        bool ok;
+        if (isBranch(last.ins.op))
+            ok = next == npc || next == last.ins.imm;
+        else if (last.ins.op == OP_JSRA || last.ins.op == OP_JMPA)
+            ok = next == last.ins.imm;
+        else if (last.ins.op == OP_JSR || last.ins.op == OP_JMP ||
+                 last.ins.op == OP_RET)
+            ok = true;
+        else
+            ok = next == npc;
+        if (!ok)
+            return NULL;
+        last.next = next;
+    }
+
+    moxieTrace *t = new moxieTrace;
+    struct traceLowering lw;
+    lw.t = t;
+    memset(lw.written, 0, sizeof(lw.written));
+    memset(lw.known, 0, sizeof(lw.known));
+    for (size_t i = 0; i < code.size(); i++)
+        markWritten(code[i].ins, lw.written);
+
+    uint32_t n = 0;
+    for (size_t i = 0; i < code.size(); i++) {
+        const struct moxie_insn &ins = code[i].ins;
+        uint32_t npc = code[i].pc + ins.len;
+        uint8_t a = ins.a, b = ins.b;
+        bool kb = lw.known[b], fold = lw.known[a] && kb;
+        uint32_t va = lw.value[a], vb = lw.value[b];
+
+        struct irOp o;
+        o.op = IR_MOVI;
+        o.a = a;
+        o.b = b;
+        o.x = 0;
+        o.imm = ins.imm;
+        o.aux = IR_NOCHECK;
+        o.exit = npc;
+        o.count = ++n;
+
+        switch (ins.op) {
+        case OP_NOP:
+        case OP_JMPA:
+            continue;
+        case OP_LDI_L:
+        case OP_LDI_B:
+        case OP_LDI_S:
+            lw.setConst(a, ins.imm);
+            break;
+        case OP_MOV:
+            if (kb) {
+                o.imm = vb;
+                lw.setConst(a, vb);
+            } else {
+                o.op = IR_MOV;
+                lw.known[a] = false;
+            }
+            break;
+        case OP_INC:
+        case OP_DEC: {
+            uint32_t v = ins.op == OP_INC ? ins.imm : -ins.imm;
+            if (lw.known[a]) {
+                o.imm = va + v;
+                lw.setConst(a, o.imm);
+            } else {
+                o.op = IR_ADDI;
+                o.imm = v;
+            }
+            break;
+        }
+
+        case OP_XOR:
+        case OP_SUB:
+            if (a == b) {
+                o.imm = 0;
+                lw.setConst(a, 0);
+                break;
+            }
+        /* fall through */
+        case OP_ADD:
+        case OP_AND:
+        case OP_OR:
+        case OP_MUL:
+        case OP_LSHR:
+        case OP_ASHL:
+        case OP_ASHR: {
+            static const uint8_t reg[] = {IR_ADD, IR_SUB, IR_AND, IR_OR,
+                                          IR_XOR, IR_MUL, IR_LSHR, IR_ASHL,
+                                          IR_ASHR};
+            static const uint8_t imm[] = {IR_ADDI, IR_ADDI, IR_ANDI,
+                                          IR_ORI,  IR_XORI, IR_MULI,
+                                          IR_LSHRI, IR_ASHLI, IR_ASHRI};
+            unsigned k;
+            switch (ins.op) {
+            case OP_ADD: k = 0; break;
+            case OP_SUB: k = 1; vb = -vb; break;
+            case OP_AND: k = 2; break;
+            case OP_OR: k = 3; break;
+            case OP_XOR: k = 4; break;
+            case OP_MUL: k = 5; break;
+            case OP_LSHR: k = 6; break;
+            case OP_ASHL: k = 7; break;
+            default: k = 8; break;
+            }
+            bool shift = k >= 6;
+            if (shift && kb && vb >= 32) // left to the host, like the interpreter
+                kb = fold = false;
+
+            if (fold) {
+                uint32_t v;
+                switch (k) {
+                case 0:
+                case 1: v = va + vb; break;
+                case 2: v = va & vb; break;
+                case 3: v = va | vb; break;
+                case 4: v = va ^ vb; break;
+                case 5: v = va * vb; break;
+                case 6: v = va >> vb; break;
+                case 7: v = va << vb; break;
+                default: v = (int32_t) va >> vb; break;
+                }
+                o.imm = v;
+                lw.setConst(a, v);
+            } else if (kb) {
+                o.op = imm[k];
+                o.imm = vb;
+                lw.known[a] = false;
+            } else {
+                o.op = reg[k];
+                lw.known[a] = false;
+            }
+            break;
+        }
+
+        case OP_NEG:
+        case OP_NOT:
+        case OP_SEX_B:
+        case OP_SEX_S:
+        case OP_ZEX_B:
+        case OP_ZEX_S:
+            if (kb) {
+                uint32_t v;
+                switch (ins.op) {
+                case OP_NEG: v = -vb; break;
+                case OP_NOT: v = ~vb; break;
+                case OP_SEX_B: v = (int32_t)(int8_t) vb; break;
+                case OP_SEX_S: v = (int32_t)(int16_t) vb; break;
+                case OP_ZEX_B: v = vb & 0xff; break;
+                default: v = vb & 0xffff; break;
+                }
+                o.imm = v;
+                lw.setConst(a, v);
+                break;
+            }
+            switch (ins.op) {
+            case OP_NEG: o.op = IR_NEG; break;
+            case OP_NOT: o.op = IR_NOT; break;
+            case OP_SEX_B: o.op = IR_SEXB; break;
+            case OP_SEX_S: o.op = IR_SEXS; break;
+            case OP_ZEX_B: o.op = IR_ZEXB; break;
+            default: o.op = IR_ZEXS; break;
+            }
+            lw.known[a] = false;
+            break;
+
+        case OP_UMUL_X:
+        case OP_MUL_X:
+        case OP_DIV:
+        case OP_UDIV:
+        case OP_MOD:
+        case OP_UMOD:
+            switch (ins.op) {
+            case OP_UMUL_X: o.op = IR_UMULX; break;
+            case OP_MUL_X: o.op = IR_MULX; break;
+            case OP_DIV: o.op = IR_DIV; break;
+            case OP_UDIV: o.op = IR_UDIV; break;
+            case OP_MOD: o.op = IR_MOD; break;
+            default: o.op = IR_UMOD; break;
+            }
+            lw.known[a] = false;
+            break;
+        case OP_GSR:
+            o.op = IR_GSR;
+            lw.known[a] = false;
+            break;
+
+        case OP_CMP: {
+            o.op = kb ? IR_CMPI : IR_CMP;
+            o.imm = vb;
+            if (i + 1 == code.size() || !isBranch(code[i + 1].ins.op))
+                break;
+
+            /* Guard the branch after it with the same operands.  */
+            const traceInsn &br = code[++i];
+            uint32_t fall = br.pc + br.ins.len;
+            o.count = ++n;
+            if (br.ins.imm == fall)
+                break;
+            bool taken = br.next == br.ins.imm;
+            o.aux = moxie_branch_test(br.ins.op);
+            if (fold && moxie_test(o.aux, va, vb) == taken)
+                break;
+            o.op = kb ? IR_CMPBRI : IR_CMPBR;
+            o.x = taken ? IR_TAKEN : 0;
+            o.exit = taken ? fall : br.ins.imm;
+            break;
+        }
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BLT:
+        case OP_BGT:
+        case OP_BLTU:
+        case OP_BGTU:
+        case OP_BGE:
+        case OP_BLE:
+        case OP_BGEU:
+        case OP_BLEU: {
+            if (ins.imm == npc)
+                continue;
+            bool taken = code[i].next == ins.imm;
+            o.op = IR_GUARD;
+            o.aux = moxie_branch_test(ins.op);
+            o.imm = branchFlags[ins.op - OP_BEQ];
+            o.x = taken ? IR_TAKEN : 0;
+            o.exit = taken ? npc : ins.imm;
+            break;
+        }
+
+        case OP_LD_B:
+        case OP_LD_S:
+        case OP_LD_L:
+        case OP_LDA_B:
+        case OP_LDA_S:
+        case OP_LDA_L:
+        case OP_LDO_B:
+        case OP_LDO_S:
+        case OP_LDO_L: {
+            uint32_t size;
+            switch (ins.op) {
+            case OP_LD_B: case OP_LDA_B: case OP_LDO_B:
+                o.op = IR_LD8;
+                size = 1;
+                break;
+            case OP_LD_S: case OP_LDA_S: case OP_LDO_S:
+                o.op = IR_LD16;
+                size = 2;
+                break;
+            default:
+                o.op = IR_LD32;
+                size = 4;
+                break;
+            }
+            if (ins.op == OP_LDA_B || ins.op == OP_LDA_S ||
+                ins.op == OP_LDA_L)
+                o.b = IR_NOREG;
+            else if (ins.op == OP_LD_B || ins.op == OP_LD_S ||
+                     ins.op == OP_LD_L)
+                o.imm = 0;
+            lw.memory(o, o.b, size, false);
+            lw.known[a] = false;
+            break;
+        }
+        case OP_ST_B:
+        case OP_ST_S:
+        case OP_ST_L:
+        case OP_STA_B:
+        case OP_STA_S:
+        case OP_STA_L:
+        case OP_STO_B:
+        case OP_STO_S:
+        case OP_STO_L: {
+            uint32_t size;
+            switch (ins.op) {
+            case OP_ST_B: case OP_STA_B: case OP_STO_B:
+                o.op = IR_ST8;
+                size = 1;
+                break;
+            case OP_ST_S: case OP_STA_S: case OP_STO_S:
+                o.op = IR_ST16;
+                size = 2;
+                break;
+            default:
+                o.op = IR_ST32;
+                size = 4;
+                break;
+            }
+            if (ins.op == OP_STA_B || ins.op == OP_STA_S ||
+                ins.op == OP_STA_L) {
+                o.b = a;
+                o.a = IR_NOREG;
+            } else if (ins.op == OP_ST_B || ins.op == OP_ST_S ||
+                       ins.op == OP_ST_L)
+                o.imm = 0;
+            lw.memory(o, o.a, size, true);
+            break;
+        }
+
+        case OP_PUSH:
+            o.op = IR_PUSH;
+            lw.known[a] = false;
+            break;
+        case OP_POP:
+            o.op = IR_POP;
+            lw.known[a] = lw.known[b] = false;
+            break;
+        case OP_JSRA:
+        case OP_JSR:
+            o.op = ins.op == OP_JSRA ? IR_CALL : IR_CALLR;
+            o.aux = npc;
+            o.imm = code[i].next;
+            lw.known[0] = lw.known[1] = false;
+            break;
+        case OP_RET:
+            o.op = IR_RET;
+            o.imm = code[i].next;
+            lw.known[0] = lw.known[1] = false;
+            break;
+        case OP_JMP:
+            if (lw.known[a] && va == code[i].next)
+                continue;
+            o.op = IR_JMP;
+            o.imm = code[i].next;
+            break;
+
+        default: // swi, ssr, brk and faults leave the interpreter anyway
+            delete t;
+            return NULL;
+        }
+
+        t->ops.push_back(o);
+    }
+
+    /* Flags set by a compare are dead if another compare sets them
+       before any exit; a fused compare then writes them only when it
+       exits.  */
+    bool live = true;
+    for (size_t i = t->ops.size(); i-- > 0;) {
+        struct irOp &o = t->ops[i];
+        switch (o.op) {
+        case IR_CMP:
+        case IR_CMPI:
+        case IR_CMPBR:
+        case IR_CMPBRI:
+            if (!live)
+                o.x |= IR_FLAGS_DEAD;
+            live = false;
+            break;
+        case IR_GUARD:
+        case IR_LD8:
+        case IR_LD16:
+        case IR_LD32:
+        case IR_ST8:
+        case IR_ST16:
+        case IR_ST32:
+        case IR_PUSH:
+        case IR_POP:
+        case IR_CALL:
+        case IR_CALLR:
+        case IR_RET:
+        case IR_JMP:
+            live = true;
+            break;
+        }
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < t->ops.size(); i++) {
+        const struct irOp &o = t->ops[i];
+        if ((o.op == IR_CMP || o.op == IR_CMPI) && (o.x & IR_FLAGS_DEAD))
+            continue;
+        t->ops[k++] = o;
+    }
+    t->ops.resize(k);
+
+    struct irOp loop = {IR_LOOP, 0, 0, 0, 0, 0, 0, n};
+    t->ops.push_back(loop);
+
+    t->start = blocks[0]->start;
+    t->epoch = mach.bbcache.epoch;
+    t->insns = n;
+    return t;
+}
+
+/* Run whole iterations of a trace, at most limit instructions, or until
+   a guard or fault leaves it.  Returns the number of instructions
+   retired in the high word and the next pc in the low word.  Like the
+   threaded interpreter, each handler jumps straight to the next one
+   when built with GCC or Clang.  */
+#if defined(__GNUC__)
+#define IR_LABEL(op) &&T_##op
+#define IR_CASE(op) \
+    case op:        \
+    T_##op:
+#define IR_DISPATCH() goto *labels[op->op]
+#else
+#define IR_CASE(op) case op:
+#define IR_DISPATCH() goto dispatch
+#endif
+#define IR_NEXT()      \
+    do {               \
+        op++;          \
+        IR_DISPATCH(); \
+    } while (0)
+
+uint64_t traceRun(machine &mach, moxieTrace *t, uint64_t limit)
+{
+#if defined(__GNUC__)
+    static void *const labels[IR_NUM_OPS] = {
+        IR_LABEL(IR_MOVI),  IR_LABEL(IR_MOV),    IR_LABEL(IR_ADD),
+        IR_LABEL(IR_ADDI),  IR_LABEL(IR_SUB),    IR_LABEL(IR_AND),
+        IR_LABEL(IR_ANDI),  IR_LABEL(IR_OR),     IR_LABEL(IR_ORI),
+        IR_LABEL(IR_XOR),   IR_LABEL(IR_XORI),   IR_LABEL(IR_MUL),
+        IR_LABEL(IR_MULI),  IR_LABEL(IR_LSHR),   IR_LABEL(IR_LSHRI),
+        IR_LABEL(IR_ASHL),  IR_LABEL(IR_ASHLI),  IR_LABEL(IR_ASHR),
+        IR_LABEL(IR_ASHRI), IR_LABEL(IR_NEG),    IR_LABEL(IR_NOT),
+        IR_LABEL(IR_SEXB),  IR_LABEL(IR_SEXS),   IR_LABEL(IR_ZEXB),
+        IR_LABEL(IR_ZEXS),  IR_LABEL(IR_UMULX),  IR_LABEL(IR_MULX),
+        IR_LABEL(IR_DIV),   IR_LABEL(IR_UDIV),   IR_LABEL(IR_MOD),
+        IR_LABEL(IR_UMOD),  IR_LABEL(IR_GSR),    IR_LABEL(IR_CMP),
+        IR_LABEL(IR_CMPI),  IR_LABEL(IR_CMPBR),  IR_LABEL(IR_CMPBRI),
+        IR_LABEL(IR_GUARD), IR_LABEL(IR_LD8),    IR_LABEL(IR_LD16),
+        IR_LABEL(IR_LD32),  IR_LABEL(IR_ST8),    IR_LABEL(IR_ST16),
+        IR_LABEL(IR_ST32),  IR_LABEL(IR_PUSH),   IR_LABEL(IR_POP),
+        IR_LABEL(IR_CALL),  IR_LABEL(IR_CALLR),  IR_LABEL(IR_RET),
+        IR_LABEL(IR_JMP),   IR_LABEL(IR_LOOP),
+    };
+#endif
+    struct moxie_regset &r = mach.cpu.asregs;
+    blockCache &bbc = mach.bbcache;
+    word *regs = r.regs;
+    const bool flat = mach.flat.base != NULL;
+
+    if (limit < t->insns)
+        return t->start;
+
+    /* Host address of guest address 0 for the accesses of each slot
+       that passed its check.  */
+    uintptr_t host[TRACE_MAX_CHECKS];
+    bool direct[TRACE_MAX_CHECKS];
+    for (size_t i = 0; i < t->checks.size(); i++) {
+        const struct irRangeCheck &c = t->checks[i];
+        int64_t base = c.base == IR_NOREG ? 0 : (uint32_t) regs[c.base];
+        int64_t lo = base + c.lo, hi = base + c.hi;
+        addressRange *ar = NULL;
+
+        if (lo >= 0 && hi <= (1LL << 32))
+            ar = mach.findRange(lo, hi - lo);
+        direct[i] = ar && !(c.write && (ar->readOnly || ar->hasCode));
+        if (direct[i])
+            host[i] = (uintptr_t) ar->root - ar->start;
+    }
+
+#define ADDR(reg) (op->imm + ((reg) == IR_NOREG ? 0 : (uint32_t) regs[reg]))
+#define DIRECT() (op->aux != IR_NOCHECK && direct[op->aux])
+#define EXIT_TO(to)     \
+    do {                \
+        exitPc = (to);  \
+        goto side_exit; \
+    } while (0)
+#define EXIT_CHECK()                     \
+    do {                                 \
+        if (r.exception || bbc.modified) \
+            EXIT_TO(op->exit);           \
+    } while (0)
+
+/* Accesses outside the checked slots go through the TLB, or through
+   the accessors of the flat space, exactly as in the interpreter.  */
+#define LOAD(type, read)                                                  \
+    do {                                                                  \
+        uint32_t addr = ADDR(op->b);                                      \
+        type hv;                                                          \
+        if (DIRECT()) {                                                   \
+            memcpy(&hv, (void *) (host[op->aux] + addr), sizeof(hv));     \
+            regs[op->a] = hv;                                             \
+        } else {                                                          \
+            uint32_t v = 0;                                               \
+            void *p;                                                      \
+            if (flat) {                                                   \
+                if (!mach.read(addr, v))                                  \
+                    r.exception = SIGBUS;                                 \
+            } else if ((p = mach.physaddr(addr, sizeof(hv))) != NULL) {   \
+                memcpy(&hv, p, sizeof(hv));                               \
+                v = hv;                                                   \
+            } else                                                        \
+                r.exception = SIGBUS;                                     \
+            regs[op->a] = v;                                              \
+            EXIT_CHECK();                                                 \
+        }                                                                 \
+    } while (0)
+#define STORE(type, write)                                                \
+    do {                                                                  \
+        uint32_t addr = ADDR(op->a);                                      \
+        type hv = regs[op->b];                                            \
+        if (DIRECT())                                                     \
+            memcpy((void *) (host[op->aux] + addr), &hv, sizeof(hv));     \
+        else {                                                            \
+            void *p;                                                      \
+            if (flat) {                                                   \
+                if (!mach.write(addr, hv))                                \
+                    r.exception = SIGBUS;                                 \
+            } else if ((p = mach.physaddr(addr, sizeof(hv), true)) !=     \
+                       NULL)                                              \
+                memcpy(p, &hv, sizeof(hv));                               \
+            else                                                          \
+                r.exception = SIGBUS;                                     \
+            EXIT_CHECK();                                                 \
+        }                                                                 \
+    } while (0)
+#define SET_FLAGS(va, vb) \
+    do {                  \
+        r.cca = (va);     \
+        r.ccb = (vb);     \
+        r.ccLazy = 1;     \
+    } while (0)
+
+    const struct irOp *begin = t->ops.data(), *op = begin;
+    uint64_t done = 0;
+    uint32_t exitPc;
+
+    IR_DISPATCH();
+#if !defined(__GNUC__)
+dispatch:
+#endif
+    switch (op->op) {
+    IR_CASE(IR_MOVI)
+        regs[op->a] = op->imm;
+        IR_NEXT();
+    IR_CASE(IR_MOV)
+        regs[op->a] = regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ADD)
+        regs[op->a] = (uint32_t) regs[op->a] + regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ADDI)
+        regs[op->a] = (uint32_t) regs[op->a] + op->imm;
+        IR_NEXT();
+    IR_CASE(IR_SUB)
+        regs[op->a] = (uint32_t) regs[op->a] - regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_AND)
+        regs[op->a] &= regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ANDI)
+        regs[op->a] &= op->imm;
+        IR_NEXT();
+    IR_CASE(IR_OR)
+        regs[op->a] |= regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ORI)
+        regs[op->a] |= op->imm;
+        IR_NEXT();
+    IR_CASE(IR_XOR)
+        regs[op->a] ^= regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_XORI)
+        regs[op->a] ^= op->imm;
+        IR_NEXT();
+    IR_CASE(IR_MUL)
+        regs[op->a] = (uint32_t) regs[op->a] * (uint32_t) regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_MULI)
+        regs[op->a] = (uint32_t) regs[op->a] * op->imm;
+        IR_NEXT();
+    IR_CASE(IR_LSHR)
+        regs[op->a] = (uint32_t) regs[op->a] >> regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_LSHRI)
+        regs[op->a] = (uint32_t) regs[op->a] >> op->imm;
+        IR_NEXT();
+    IR_CASE(IR_ASHL)
+        regs[op->a] = regs[op->a] << regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ASHLI)
+        regs[op->a] = (uint32_t) regs[op->a] << op->imm;
+        IR_NEXT();
+    IR_CASE(IR_ASHR)
+        regs[op->a] = regs[op->a] >> regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ASHRI)
+        regs[op->a] = regs[op->a] >> op->imm;
+        IR_NEXT();
+    IR_CASE(IR_NEG)
+        regs[op->a] = -regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_NOT)
+        regs[op->a] = ~regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_SEXB)
+        regs[op->a] = (int8_t) regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_SEXS)
+        regs[op->a] = (int16_t) regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_ZEXB)
+        regs[op->a] = regs[op->b] & 0xff;
+        IR_NEXT();
+    IR_CASE(IR_ZEXS)
+        regs[op->a] = regs[op->b] & 0xffff;
+        IR_NEXT();
+    IR_CASE(IR_UMULX)
+        regs[op->a] = ((unsigned long long) (uint32_t) regs[op->a] *
+                       (uint32_t) regs[op->b]) >> 32;
+        IR_NEXT();
+    IR_CASE(IR_MULX) { // operands zero-extended, as in the interpreter
+        unsigned av = regs[op->a], bv = regs[op->b];
+        regs[op->a] = ((signed long long) av * (signed long long) bv) >> 32;
+        IR_NEXT();
+    }
+    IR_CASE(IR_DIV)
+        regs[op->a] = regs[op->a] / regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_UDIV)
+        regs[op->a] = (uint32_t) regs[op->a] / (uint32_t) regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_MOD)
+        regs[op->a] = regs[op->a] % regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_UMOD)
+        regs[op->a] = (uint32_t) regs[op->a] % (uint32_t) regs[op->b];
+        IR_NEXT();
+    IR_CASE(IR_GSR)
+        regs[op->a] = r.sregs[op->imm];
+        IR_NEXT();
+
+    IR_CASE(IR_CMP)
+        SET_FLAGS(regs[op->a], regs[op->b]);
+        IR_NEXT();
+    IR_CASE(IR_CMPI)
+        SET_FLAGS(regs[op->a], op->imm);
+        IR_NEXT();
+    IR_CASE(IR_CMPBR)
+    IR_CASE(IR_CMPBRI) {
+        word va = regs[op->a];
+        word vb = op->op == IR_CMPBR ? regs[op->b] : (word) op->imm;
+        if (!(op->x & IR_FLAGS_DEAD))
+            SET_FLAGS(va, vb);
+        if (moxie_test(op->aux, va, vb) != (op->x & IR_TAKEN)) {
+            SET_FLAGS(va, vb);
+            EXIT_TO(op->exit);
+        }
+        IR_NEXT();
+    }
+    IR_CASE(IR_GUARD) {
+        bool taken = r.ccLazy ? moxie_test(op->aux, r.cca, r.ccb)
+                              : (r.cc & op->imm) != 0;
+        if (taken != (op->x & IR_TAKEN))
+            EXIT_TO(op->exit);
+        IR_NEXT();
+    }
+
+    IR_CASE(IR_LD8)
+        LOAD(uint8_t, read8);
+        IR_NEXT();
+    IR_CASE(IR_LD16)
+        LOAD(uint16_t, read16);
+        IR_NEXT();
+    IR_CASE(IR_LD32)
+        LOAD(uint32_t, read32);
+        IR_NEXT();
+    IR_CASE(IR_ST8)
+        STORE(uint8_t, write8);
+        IR_NEXT();
+    IR_CASE(IR_ST16)
+        STORE(uint16_t, write16);
+        IR_NEXT();
+    IR_CASE(IR_ST32)
+        STORE(uint32_t, write32);
+        IR_NEXT();
+
+    IR_CASE(IR_PUSH) {
+        uint32_t sp = regs[op->a] - 4;
+        if (!mach.write32(sp, regs[op->b]))
+            r.exception = SIGBUS;
+        regs[op->a] = sp;
+        EXIT_CHECK();
+        IR_NEXT();
+    }
+    IR_CASE(IR_POP) {
+        uint32_t sp = regs[op->a], v = 0;
+        if (!mach.read32(sp, v))
+            r.exception = SIGBUS;
+        regs[op->b] = v;
+        regs[op->a] = sp + 4;
+        EXIT_CHECK();
+        IR_NEXT();
+    }
+    IR_CASE(IR_CALL)
+    IR_CASE(IR_CALLR) {
+        uint32_t to = op->op == IR_CALL ? op->imm : regs[op->a];
+        uint32_t sp = regs[1] - 8;
+        if (!mach.write32(sp, op->aux))
+            r.exception = SIGBUS;
+        sp -= 4;
+        if (!mach.write32(sp, regs[0]))
+            r.exception = SIGBUS;
+        regs[1] = regs[0] = sp;
+        if (r.exception || bbc.modified || to != op->imm)
+            EXIT_TO(to);
+        IR_NEXT();
+    }
+    IR_CASE(IR_RET) {
+        uint32_t sp = regs[0], fp = 0, to = 0;
+        if (!mach.read32(sp, fp))
+            r.exception = SIGBUS;
+        regs[0] = fp;
+        if (!mach.read32(sp + 4, to))
+            r.exception = SIGBUS;
+        regs[1] = sp + 12;
+        if (r.exception || bbc.modified || to != op->imm)
+            EXIT_TO(to);
+        IR_NEXT();
+    }
+    IR_CASE(IR_JMP)
+        if ((uint32_t) regs[op->a] != op->imm)
+            EXIT_TO(regs[op->a]);
+        IR_NEXT();
+
+    IR_CASE(IR_LOOP)
+        done += op->count;
+        if (limit - done < op->count)
+            return (done << 32) | t->start;
+        op = begin;
+        IR_DISPATCH();
+    }
+
+side_exit:
+    return ((done + op->count) << 32) | exitPc;
+
+#undef ADDR
+#undef DIRECT
+#undef EXIT_TO
+#undef EXIT_CHECK
+#undef LOAD
+#undef STORE
+#undef SET_FLAGS
+}
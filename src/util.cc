@@ -1,6 +1,7 @@
 #include <sys/mman.h>
 #include <string>
 #include <ctype.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -60,6 +61,15 @@ signed char HexDigit(char c)
     return p_util_hexdigit[(unsigned char) c];
 }
 
+bool IsHex(const string &str)
+{
+    for (string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        if (HexDigit(*it) < 0)
+            return false;
+    }
+    return (str.size() > 0) && (str.size() % 2 == 0);
+}
+
 vector<unsigned char> ParseHex(const char *psz)
 {
     // convert hex dump to vector
@@ -85,14 +95,35 @@ vector<unsigned char> ParseHex(const string &str)
     return ParseHex(str.c_str());
 }
 
+string HexStr(const unsigned char *p, size_t len)
+{
+    static const char hexmap[] = "0123456789abcdef";
+    string s(len * 2, ' ');
+    for (size_t i = 0; i < len; i++) {
+        s[2 * i] = hexmap[p[i] >> 4];
+        s[2 * i + 1] = hexmap[p[i] & 15];
+    }
+    return s;
+}
+
 bool mfile::open(int flags, mode_t mode, bool map)
 {
-    fd = ::open(pathname.c_str(), flags, mode);
-    if (fd < 0)
+    int fd_ = ::open(pathname.c_str(), flags, mode);
+    if (fd_ < 0)
         return false;
 
-    if (!map)
+    if (!map) {
+        fd = fd_;
         return true;
+    }
+
+    return attach(fd_, flags);
+}
+
+/* Map the file open as fd_, which the mfile then owns.  */
+bool mfile::attach(int fd_, int flags)
+{
+    fd = fd_;
 
     if (fstat(fd, &st) < 0)
         return false;
@@ -155,3 +186,52 @@ bool ReadDir(const std::string &pathname, std::vector<std::string> &dirNames)
 
     return true;
 }
+
+/* Parse a stack size: bytes, or KiB or MiB with a K or M suffix, rounded
+   up to whole pages.  */
+bool parseStackSize(const char *s, uint32_t &size)
+{
+    char *endp;
+    errno = 0;
+    unsigned long long n = strtoull(s, &endp, 0);
+    if (errno || endp == s)
+        return false;
+
+    if (*endp == 'K' || *endp == 'k')
+        n <<= 10, endp++;
+    else if (*endp == 'M' || *endp == 'm')
+        n <<= 20, endp++;
+    if (*endp || !n || n > MACH_MAX_STACK_SIZE)
+        return false;
+
+    size = (n + MACH_PAGE_MASK) & ~(unsigned long long) MACH_PAGE_MASK;
+    return true;
+}
+
+/* Parse an instruction budget, a positive count.  */
+bool parseBudget(const char *s, unsigned long long &budget)
+{
+    char *endp;
+    errno = 0;
+    budget = strtoull(s, &endp, 0);
+    return !errno && endp != s && !*endp && budget;
+}
+
+/* Parse the name of an interpreter core.  */
+bool parseEngine(const char *name, moxie_engine &engine)
+{
+    if (!strcmp(name, "switch"))
+        engine = ENGINE_SWITCH;
+    else if (!strcmp(name, "threaded"))
+        engine = ENGINE_THREADED;
+    else if (!strcmp(name, "trace"))
+        engine = ENGINE_TRACE;
+#ifdef MOXIE_JIT
+    else if (!strcmp(name, "jit"))
+        engine = ENGINE_JIT;
+#endif
+    else
+        return false;
+
+    return true;
+}
@@ -69,9 +69,37 @@ static void test_string_func(void)
     assert(p == (teststr + 3));
 }
 
+static void test_bulk_func(void)
+{
+    const char *teststr = "We are Motorhead";
+    char buf[32];
+    unsigned int i;
+
+    // moxie_bulk_copy
+    assert(moxie_bulk_copy(buf, teststr, 17) == buf);
+    assert(memcmp(buf, teststr, 17) == 0);
+
+    // moxie_bulk_compare
+    assert(moxie_bulk_compare(buf, teststr, 17) == 0);
+    assert(moxie_bulk_compare(teststr, "We are Motorhexd", 17) < 0);
+    assert(moxie_bulk_compare(buf, teststr, 0) == 0);
+
+    // moxie_bulk_move
+    assert(moxie_bulk_move(buf + 1, buf, 16) == buf + 1);
+    assert(memcmp(buf + 1, teststr, 16) == 0);
+    moxie_bulk_move(buf, buf + 1, 16);
+    assert(memcmp(buf, teststr, 16) == 0);
+
+    // moxie_bulk_fill
+    assert(moxie_bulk_fill(buf, ' ', sizeof(buf)) == buf);
+    for (i = 0; i < sizeof(buf); i++)
+        assert(buf[i] == ' ');
+}
+
 int main(int argc, char *argv[])
 {
     test_string_func();
+    test_bulk_func();
     do_setup();
     fini();
     return 0;
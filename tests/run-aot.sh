@@ -0,0 +1,72 @@
+#!/bin/sh
+
+# Translate the tests with moxie-aot, build them with the host compiler,
+# and check that each run with --aot ends with the exit status and
+# output it has under the switch core.  The instruction count must match
+# too: a run budgeted for the instructions the switch core takes must
+# finish, and runs given fewer must stop on the budgeted instruction.
+
+srcdir=`pwd`
+
+TMP=AOT-TEST.tmp$$
+HOSTCC=${HOSTCC:-cc}
+
+rm -rf $TMP
+mkdir -p $TMP/aot || exit 1
+
+RET=0
+for t in basic exit0 exit1 rtlib cn_string sha256 sha256_swi; do
+	args="-e $t"
+	case $t in sha256*) args="$args -d $srcdir/random.data" ;; esac
+
+	# moxie-aot ends with the SHA-256 the object is looked up by
+	sum=`../src/moxie-aot -o $TMP/$t.c $t 2>&1 | tail -n 1`
+	if ! $HOSTCC -O2 -shared -fPIC -o $TMP/aot/$sum.so $TMP/$t.c; then
+		echo "aot $t: translation failed"
+		RET=1
+		continue
+	fi
+
+	echo "$args" > $TMP/manifest
+	../src/sandbox-batch -j 1 -s $TMP/status $TMP/manifest 2>/dev/null
+	n=`grep -v '^#' $TMP/status | cut -f4`
+
+	../src/sandbox $args -o $TMP/$t.out 2>/dev/null
+	rc=$?
+	../src/sandbox $args --aot=$TMP/aot --budget=$n -o $TMP/$t.aot \
+		2> $TMP/$t.err
+	if [ $? -ne $rc ]; then
+		echo "aot $t: exit status or instruction count differs"
+		RET=1
+	fi
+	if grep -q "AOT code not loaded" $TMP/$t.err; then
+		echo "aot $t: translation not loaded"
+		RET=1
+	fi
+	if [ -f $TMP/$t.out ] || [ -f $TMP/$t.aot ]; then
+		if ! cmp -s $TMP/$t.out $TMP/$t.aot; then
+			echo "aot $t: output differs"
+			RET=1
+		fi
+	fi
+
+	# host sha256 calls cost many instructions at once, and stop short
+	# of a budget that lands within them
+	budgets="`expr $n - 1` `expr $n / 2` `expr $n / 7`"
+	[ $t = sha256_swi ] && budgets=`expr $n - 1`
+
+	for b in $budgets; do
+		[ $b -gt 0 ] || continue
+		../src/sandbox $args --aot=$TMP/aot --budget=$b > /dev/null \
+			2> $TMP/$t.err
+		if ! grep -q "budget exhausted after $b instructions" \
+			$TMP/$t.err; then
+			echo "aot $t: budget of $b not stopped on"
+			RET=1
+		fi
+	done
+done
+
+rm -rf $TMP
+
+exit $RET
@@ -0,0 +1,67 @@
+#!/bin/sh
+
+# Stop fib and sha256 at every budget up to 200 instructions, and at a
+# few larger ones, under every interpreter core.  Budgets land inside
+# blocks and superinstructions, and each run must report having run
+# exactly its budget.
+
+srcdir=`pwd`
+
+TMP=BUDGET-TEST.tmp$$
+
+ENGINES="switch threaded trace"
+if ../src/sandbox-batch --engine=jit -s /dev/null /dev/null 2>/dev/null; then
+	ENGINES="$ENGINES jit"
+fi
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+
+# fib of 1000, as a little-endian word
+printf '\350\003\000\000' > $TMP/fib.in
+
+RET=0
+for e in $ENGINES; do
+	for t in fib sha256; do
+		if [ $t = fib ]; then
+			JOB="-e $t -d $TMP/fib.in"
+		else
+			JOB="-e $t -d $srcdir/random.data"
+		fi
+
+		# the instructions of the whole run
+		echo "$JOB" > $TMP/manifest
+		../src/sandbox-batch -j 1 --engine=$e -s $TMP/status \
+			$TMP/manifest 2>/dev/null
+		N=`awk '!/^#/ { print $4 }' $TMP/status`
+
+		awk -v n="$N" 'BEGIN {
+			for (b = 1; b < n && b <= 200; b++)
+				print b
+			for (d = 7; d >= 2; d--)
+				if (n / d > 200)
+					print int(n / d)
+			if (n - 1 > 200)
+				print n - 1
+		}' > $TMP/budgets
+
+		awk -v job="$JOB" '{ print job " --budget=" $1 }' \
+			$TMP/budgets > $TMP/manifest
+		awk '{ print NR "\tbudget\t0\t" $1 }' \
+			$TMP/budgets > $TMP/expected
+
+		../src/sandbox-batch --engine=$e -s $TMP/status \
+			$TMP/manifest 2>/dev/null
+		grep -v '^#' $TMP/status | cut -f1-4 > $TMP/result
+
+		if ! cmp -s $TMP/expected $TMP/result; then
+			echo "engine $e: $t did not stop at its budget"
+			diff $TMP/expected $TMP/result | head -10
+			RET=1
+		fi
+	done
+done
+
+rm -rf $TMP
+
+exit $RET
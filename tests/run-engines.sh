@@ -0,0 +1,59 @@
+#!/bin/sh
+
+# Run the tests under every interpreter core, and check that each ends
+# with the exit status, output and instruction count it has under the
+# switch core.  Runs with --hle, where library calls run natively and
+# take fewer instructions, must end with the same exit status and
+# output.
+
+srcdir=`pwd`
+
+TMP=ENGINES-TEST.tmp$$
+
+ENGINES="switch threaded trace"
+if ../src/sandbox-batch --engine=jit -s /dev/null /dev/null 2>/dev/null; then
+	ENGINES="$ENGINES jit"
+fi
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+
+RET=0
+for e in $ENGINES hle; do
+	for t in basic exit0 exit1 rtlib cn_string; do
+		echo "-e $t -o $TMP/$t.$e"
+	done > $TMP/manifest.$e
+	for t in sha256 sha256_swi; do
+		echo "-e $t -d $srcdir/random.data -o $TMP/$t.$e"
+	done >> $TMP/manifest.$e
+
+	if [ $e = hle ]; then
+		../src/sandbox-batch -j 1 --hle -s $TMP/status.$e \
+			$TMP/manifest.$e 2>/dev/null
+		cut -f1-3 $TMP/status.switch > $TMP/result.switch
+		cut -f1-3 $TMP/status.$e > $TMP/result.$e
+	else
+		../src/sandbox-batch -j 1 --engine=$e -s $TMP/status.$e \
+			$TMP/manifest.$e 2>/dev/null
+		cut -f1-4 $TMP/status.$e > $TMP/result.$e
+	fi
+
+	if ! cmp -s $TMP/result.switch $TMP/result.$e; then
+		echo "engine $e: exit status or instruction count differs"
+		diff $TMP/result.switch $TMP/result.$e
+		RET=1
+	fi
+
+	for t in basic exit0 exit1 rtlib cn_string sha256 sha256_swi; do
+		if [ -f $TMP/$t.switch ] || [ -f $TMP/$t.$e ]; then
+			if ! cmp -s $TMP/$t.switch $TMP/$t.$e; then
+				echo "engine $e: output of $t differs"
+				RET=1
+			fi
+		fi
+	done
+done
+
+rm -rf $TMP
+
+exit $RET
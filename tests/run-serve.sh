@@ -0,0 +1,105 @@
+#!/bin/sh
+
+# Run the tests through sandbox --serve, and check that each ends with
+# the exit status and output it has under sandbox, and the instruction
+# count sandbox-batch reports.  Inputs go both as files, which the
+# server copies, and as sealed memfds, which it maps; a program is also
+# replaced while the server runs, which must load it again.
+
+srcdir=`pwd`
+
+TMP=SERVE-TEST.tmp$$
+SOCK=$TMP/sock
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+
+../src/sandbox --serve $SOCK --threads=2 2>/dev/null &
+SERVER=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -S $SOCK ] && break
+	sleep 0.1
+done
+
+RET=0
+
+# check <name> <client args>: compare the job with the sandbox run of
+# the same name
+check() {
+	name=$1
+	shift
+	../src/sandbox-client "$@" -o $TMP/$name.serve $SOCK \
+		> $TMP/$name.result 2>/dev/null
+	rc=$?
+	if [ $rc -ne `cat $TMP/$name.rc` ]; then
+		echo "serve $name: exit status $rc, not `cat $TMP/$name.rc`"
+		RET=1
+	fi
+	if ! cmp -s $TMP/$name.expected $TMP/$name.result; then
+		echo "serve $name: status or instruction count differs"
+		diff $TMP/$name.expected $TMP/$name.result
+		RET=1
+	fi
+	if [ -f $TMP/$name.out ] || [ -f $TMP/$name.serve ]; then
+		if ! cmp -s $TMP/$name.out $TMP/$name.serve; then
+			echo "serve $name: output differs"
+			RET=1
+		fi
+	fi
+}
+
+n=0
+for t in basic exit0 exit1 rtlib sha256 sha256_swi; do
+	args="-e $srcdir/$t"
+	case $t in sha256*) args="$args -d $srcdir/random.data" ;; esac
+
+	../src/sandbox $args -o $TMP/$t.out 2>/dev/null
+	echo $? > $TMP/$t.rc
+	echo "$args -o $TMP/$t.batch" > $TMP/manifest
+	../src/sandbox-batch -j 1 -s $TMP/status $TMP/manifest 2>/dev/null
+	grep -v '^#' $TMP/status | cut -f2-4 > $TMP/$t.expected
+
+	check $t $args
+	case $t in sha256*)
+		for f in rc expected out; do
+			cp $TMP/$t.$f $TMP/$t.sealed.$f
+		done
+		check $t.sealed $args --seal-input --seal-output
+		;;
+	esac
+done
+
+# a job stopped by its budget
+../src/sandbox-client -e $srcdir/sha256 -d $srcdir/random.data \
+	--budget=1000 $SOCK > $TMP/budget.result 2>/dev/null
+if [ "`cut -f1,3 $TMP/budget.result`" != "`printf 'budget\t1000'`" ]; then
+	echo "serve: budget run did not stop at 1000 instructions"
+	RET=1
+fi
+
+# a program that does not exist
+../src/sandbox-client -e $TMP/missing $SOCK > $TMP/missing.result \
+	2>/dev/null
+if [ "`cut -f1 $TMP/missing.result`" != "error-2" ]; then
+	echo "serve: missing program did not fail with ENOENT"
+	RET=1
+fi
+
+# a program rewritten in place after the server loaded it
+cp $srcdir/exit0 $TMP/prog
+../src/sandbox-client -e $TMP/prog $SOCK > /dev/null 2>&1
+rc0=$?
+sleep 0.1
+cat $srcdir/exit1 > $TMP/prog
+../src/sandbox-client -e $TMP/prog $SOCK > /dev/null 2>&1
+rc1=$?
+if [ $rc0 -ne `cat $TMP/exit0.rc` ] || [ $rc1 -ne `cat $TMP/exit1.rc` ]; then
+	echo "serve: program was not loaded again after it changed"
+	RET=1
+fi
+
+kill $SERVER
+wait $SERVER 2>/dev/null
+rm -rf $TMP
+
+exit $RET
@@ -0,0 +1,22 @@
+#!/bin/sh
+
+srcdir=`pwd`
+
+TFN=SHA256-SWI-TEST.tmp$$
+BFN=$srcdir/random.data.sum
+
+../src/sandbox -e sha256_swi -d $srcdir/random.data -o $TFN
+if [ $? -ne 0 ]; then
+	exit 1
+fi
+
+cmp -s $TFN $BFN
+RET=$?
+
+rm -f $TFN
+
+if [ $RET -ne 0 ]; then
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+# Run snapshot as two --jobs with different data, once from its marker
+# and once from the start, and check that each job hashes its own data
+# as sha256 does.  Only from the marker does the program start without
+# a memory map.
+
+srcdir=`pwd`
+
+TMP=SNAPSHOT-TEST.tmp$$
+
+rm -rf $TMP
+mkdir $TMP || exit 1
+
+head -c 1000 $srcdir/random.data > $TMP/b.data
+
+RET=0
+for d in $srcdir/random.data $TMP/b.data; do
+	../src/sandbox -e sha256 -d $d -o $TMP/sum 2>/dev/null
+	cp $TMP/sum $TMP/`basename $d`.marker
+	printf '\000' >> $TMP/`basename $d`.marker
+	cp $TMP/sum $TMP/`basename $d`.start
+	printf '\001' >> $TMP/`basename $d`.start
+done
+
+for mode in marker start; do
+	opts=
+	[ $mode = marker ] && opts=--snapshot=marker
+
+	cat > $TMP/jobs <<EOF
+-d $srcdir/random.data -o $TMP/random.data.out
+-d $TMP/b.data -o $TMP/b.data.out
+EOF
+	../src/sandbox -e snapshot --jobs=$TMP/jobs $opts 2> $TMP/log
+	if [ $? -ne 0 ]; then
+		echo "snapshot from $mode: a job failed"
+		grep '^job' $TMP/log
+		RET=1
+	fi
+
+	for f in random.data b.data; do
+		if ! cmp -s $TMP/$f.$mode $TMP/$f.out; then
+			echo "snapshot from $mode: output for $f differs"
+			RET=1
+		fi
+	done
+	rm -f $TMP/*.out
+done
+
+rm -rf $TMP
+
+exit $RET
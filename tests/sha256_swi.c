@@ -0,0 +1,66 @@
+#include "sandboxrt.h"
+#include "sandboxrt_crypto.h"
+
+static struct moxie_memory_map_ent *data;
+
+static void find_data(void)
+{
+    data = moxie_memmap;
+    while (data->addr) {
+        if (strstr(data->tags, "data0,"))
+            return;
+
+        data++;
+    }
+
+    _exit(1);
+}
+
+static sha256_context ctx, ref;
+
+/* Hash in uneven pieces with the system call and the runtime code; both
+   must leave the same context behind.  */
+static void hash_data(void)
+{
+    const uint8_t *p = data->addr;
+    size_t left = data->length, n = 1;
+
+    moxie_sha256_init(&ctx);
+    sha256_init(&ref);
+    while (left) {
+        if (n > left)
+            n = left;
+        moxie_sha256_hash(&ctx, p, n);
+        sha256_hash(&ref, p, n);
+        if (memcmp(&ctx, &ref, sizeof(ctx)))
+            _exit(1);
+        p += n;
+        left -= n;
+        n = n * 3 + 7;
+    }
+}
+
+static void output_result(void)
+{
+    uint8_t hash[SHA256_BYTES];
+    void *result = mmap(NULL, MACH_PAGE_SIZE,
+                        MOXIE_PROT_EXEC | MOXIE_PROT_READ | MOXIE_PROT_WRITE,
+                        MOXIE_MAP_PRIVATE | MOXIE_MAP_ANONYMOUS, 0, 0);
+    if (result == (void *) -1)
+        _exit(1);
+
+    moxie_sha256_done(&ctx, result);
+    sha256_done(&ref, hash);
+    if (memcmp(result, hash, SHA256_BYTES) || memcmp(&ctx, &ref, sizeof(ctx)))
+        _exit(1);
+
+    setreturn(result, SHA256_BYTES);
+}
+
+int main(int argc, char *argv[])
+{
+    find_data();
+    hash_data();
+    output_result();
+    return 0;
+}
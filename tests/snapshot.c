@@ -0,0 +1,67 @@
+#include "sandboxrt.h"
+#include "sandboxrt_crypto.h"
+
+/* Hashes data0 like sha256, after setup done before moxie_snapshot().
+   The output is the hash, then a byte that is 1 if moxie_memmap was
+   already set before the marker.  */
+
+static unsigned int table[256];
+static int jobs;
+static unsigned char result[SHA256_BYTES + 1];
+
+static void setup(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 256; i++)
+        table[i] = i * 2654435761U;
+}
+
+static int check_setup(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 256; i++)
+        if (table[i] != i * 2654435761U)
+            return 0;
+    return 1;
+}
+
+static struct moxie_memory_map_ent *find_data(
+    struct moxie_memory_map_ent *ent)
+{
+    while (ent->addr) {
+        if (strstr(ent->tags, "data0,"))
+            return ent;
+
+        ent++;
+    }
+
+    _exit(1);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct moxie_memory_map_ent *map, *data;
+    sha256_context ctx;
+
+    result[SHA256_BYTES] = moxie_memmap != NULL;
+    setup();
+
+    map = moxie_snapshot();
+    if (!map || map != moxie_memmap)
+        _exit(2);
+
+    // each job starts from the snapshot, not from the job before it
+    if (++jobs != 1 || !check_setup())
+        _exit(3);
+
+    data = find_data(map);
+    sha256_init(&ctx);
+    sha256_hash(&ctx, data->addr, data->length);
+    sha256_done(&ctx, result);
+
+    setreturn(result, sizeof(result));
+    return 0;
+}